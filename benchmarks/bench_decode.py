@@ -0,0 +1,397 @@
+"""Benchmarks for decoding JPEG 2000 data.
+
+Measures the throughput (in megapixels per second) and latency percentiles of
+:func:`openjpeg.decode` for a range of synthetic codestreams and, if
+available, the JPEG 2000 files from pylibjpeg-data. The results are written
+as JSON so they can be compared between commits.
+
+The multi-threaded cases decode the same :class:`bytes` concurrently from
+several Python threads, which only scales because decoding :class:`bytes`
+releases the GIL for the whole decode (the tier-1 decoding within a single
+decode is single-threaded).
+
+The transcoded cases decode the same image transcoded with and without
+selective arithmetic coding bypass, to measure the bypass speed-up.
+
+Usage
+-----
+Run the benchmarks and write the results to a file::
+
+    python benchmarks/bench_decode.py -o results.json
+
+Compare two sets of results::
+
+    python benchmarks/bench_decode.py --compare before.json after.json
+"""
+
+import argparse
+from concurrent.futures import ThreadPoolExecutor
+import datetime
+import json
+import platform
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+import openjpeg
+from openjpeg import decode, encode, get_parameters, transcode
+from openjpeg.index import build_index
+from openjpeg.utils import get_openjpeg_version
+
+try:
+    from ljdata import JPEG_DIRECTORY
+    HAS_DATA = True
+except ImportError:
+    HAS_DATA = False
+
+
+def synthetic_image(rows, columns, samples_per_pixel, bits_stored, seed=0):
+    """Return a smooth noisy image that compresses like a natural image."""
+    rng = np.random.default_rng(seed)
+    y, x = np.mgrid[0:rows, 0:columns]
+    maximum = 2**bits_stored - 1
+
+    planes = []
+    for ii in range(samples_per_pixel):
+        plane = (
+            np.sin(x / (17 + ii * 5)) * np.cos(y / (23 + ii * 3)) + 1
+        ) * maximum / 2
+        plane += rng.normal(0, maximum * 0.02, size=plane.shape)
+        planes.append(np.clip(plane, 0, maximum))
+
+    arr = np.stack(planes, axis=-1) if samples_per_pixel > 1 else planes[0]
+    dtype = np.uint8 if bits_stored <= 8 else np.uint16
+
+    return arr.astype(dtype)
+
+
+def encode_image(
+    arr, bits_stored, lossless=True, tile_size=None, subsampling=None
+):
+    """Return `arr` encoded as a J2K codestream."""
+    return encode(
+        arr,
+        bits_stored=bits_stored,
+        photometric_interpretation="YBR_FULL" if subsampling else None,
+        compression_ratios=None if lossless else [20],
+        tile_size=tile_size,
+        subsampling=subsampling,
+    )
+
+
+def synthetic_cases(size):
+    """Yield (name, tags, codestream) for the synthetic benchmark cases."""
+    rows = columns = size
+    variants = [
+        # (samples per pixel, bits stored, lossless, tile size, subsampling)
+        (1, 8, True, None, None),
+        (1, 16, True, None, None),
+        (1, 16, False, None, None),
+        (3, 8, True, None, None),
+        (3, 8, False, None, None),
+        (1, 16, True, (256, 256), None),
+        (3, 8, True, (256, 256), None),
+        # YBR_FULL with subsampled chroma, needs upsampling when decoding
+        (3, 8, True, None, (1, 2)),
+        (3, 8, True, None, (2, 2)),
+        (3, 8, False, None, (2, 2)),
+    ]
+    for spp, bits, lossless, tile_size, subsampling in variants:
+        arr = synthetic_image(rows, columns, spp, bits)
+        colour = "gray"
+        if spp == 3:
+            colour = "ybr" if subsampling else "rgb"
+
+        tags = {
+            "colour": colour,
+            "bits_stored": bits,
+            "lossless": lossless,
+            "tiled": bool(tile_size),
+            "subsampled": bool(subsampling),
+            "source": "synthetic",
+        }
+        name = (
+            f"synthetic-{colour}-{bits}bit-"
+            f"{'lossless' if lossless else 'lossy'}"
+            f"{'-tiled' if tile_size else ''}"
+            f"{'-422' if subsampling == (1, 2) else ''}"
+            f"{'-420' if subsampling == (2, 2) else ''}-{rows}x{columns}"
+        )
+
+        data = encode_image(arr, bits, lossless, tile_size, subsampling)
+        yield name, tags, data
+
+
+def transcode_cases(size):
+    """Yield (name, tags, codestream) for the transcoded benchmark cases.
+
+    The same noisy 12-bit image transcoded with and without selective
+    arithmetic coding bypass, so the decoding speed-up from the bypass can be
+    compared.
+    """
+    rows = columns = size
+    # Noisy enough that most of the code-block passes are bypassed
+    arr = synthetic_image(rows, columns, 1, 11)
+    rng = np.random.default_rng(1)
+    arr += rng.integers(0, 2**10, size=arr.shape, dtype=arr.dtype)
+    src = encode_image(arr, 12)
+
+    for bypass in (False, True):
+        tags = {
+            "colour": "gray",
+            "bits_stored": 12,
+            "lossless": True,
+            "tiled": False,
+            "subsampled": False,
+            "bypass": bypass,
+            "source": "transcoded",
+        }
+        name = (
+            f"transcoded-gray-12bit-lossless-"
+            f"{'bypass' if bypass else 'plain'}-{rows}x{columns}"
+        )
+
+        yield name, tags, transcode(src, bypass=bypass)
+
+
+def dataset_cases():
+    """Yield (name, tags, codestream) for the pylibjpeg-data J2K files."""
+    if not HAS_DATA:
+        print("pylibjpeg-data unavailable, skipping the dataset cases")
+        return
+
+    paths = sorted(
+        p for p in (JPEG_DIRECTORY / "15444").glob("**/*")
+        if p.suffix.lower() in (".j2k", ".jp2", ".j2c")
+    )
+    for path in paths:
+        data = path.read_bytes()
+        try:
+            meta = get_parameters(data)
+            index = build_index(data, packets=False)
+        except Exception:
+            continue
+
+        # The reversible 5/3 wavelet is used for lossless encoding
+        tags = {
+            "colour": "rgb" if meta["nr_components"] >= 3 else "gray",
+            "bits_stored": meta["precision"],
+            "lossless": index.transform == 1,
+            "tiled": index.tile_grid != (1, 1),
+            "subsampled": any(
+                (dx, dy) != (1, 1) for _, _, dx, dy in index.components
+            ),
+            "source": "pylibjpeg-data",
+        }
+        name = str(path.relative_to(JPEG_DIRECTORY))
+
+        yield name, tags, data
+
+
+def run_case(data, nr_threads, nr_iterations, min_time):
+    """Return the benchmark results for decoding `data`.
+
+    Parameters
+    ----------
+    data : bytes
+        The encoded JPEG 2000 data, as :class:`bytes` so the GIL is released
+        while decoding.
+    nr_threads : int
+        The number of threads decoding concurrently.
+    nr_iterations : int
+        The minimum number of decodes per thread.
+    min_time : float
+        The minimum total time to run for (in seconds).
+    """
+    data = bytes(data)
+    meta = get_parameters(data)
+    pixels = meta["rows"] * meta["columns"]
+
+    # Warm up
+    decode(data)
+
+    def worker():
+        latencies = []
+        start = time.perf_counter()
+        while (
+            len(latencies) < nr_iterations
+            or time.perf_counter() - start < min_time
+        ):
+            t = time.perf_counter()
+            decode(data)
+            latencies.append(time.perf_counter() - t)
+
+        return latencies
+
+    start = time.perf_counter()
+    if nr_threads == 1:
+        latencies = worker()
+    else:
+        with ThreadPoolExecutor(max_workers=nr_threads) as pool:
+            futures = [pool.submit(worker) for _ in range(nr_threads)]
+            latencies = sum((f.result() for f in futures), [])
+
+    elapsed = time.perf_counter() - start
+    latencies = np.asarray(latencies) * 1000
+
+    return {
+        "rows": meta["rows"],
+        "columns": meta["columns"],
+        "nr_components": meta["nr_components"],
+        "nr_bytes": len(data),
+        "nr_decodes": len(latencies),
+        "mpixel_per_s": pixels * len(latencies) / elapsed / 1e6,
+        "latency_ms": {
+            "min": float(latencies.min()),
+            "mean": float(latencies.mean()),
+            "p50": float(np.percentile(latencies, 50)),
+            "p90": float(np.percentile(latencies, 90)),
+            "p99": float(np.percentile(latencies, 99)),
+            "max": float(latencies.max()),
+        },
+    }
+
+
+def get_commit():
+    """Return the current git commit (if available)."""
+    try:
+        return subprocess.check_output(
+            ["git", "rev-parse", "HEAD"], stderr=subprocess.DEVNULL
+        ).decode("ascii").strip()
+    except Exception:
+        return None
+
+
+def run(args):
+    """Run the benchmarks and return the results."""
+    cases = list(synthetic_cases(args.size))
+    cases.extend(transcode_cases(args.size))
+    if not args.no_datasets:
+        cases.extend(dataset_cases())
+
+    if args.filter:
+        cases = [c for c in cases if args.filter in c[0]]
+
+    results = []
+    for name, tags, data in cases:
+        for nr_threads in args.threads:
+            result = run_case(data, nr_threads, args.iterations, args.min_time)
+            result.update({"name": name, "threads": nr_threads, **tags})
+            results.append(result)
+            print(
+                f"{name:<60} threads={nr_threads:<2} "
+                f"{result['mpixel_per_s']:>9.2f} MP/s  "
+                f"p50 {result['latency_ms']['p50']:>8.3f} ms  "
+                f"p99 {result['latency_ms']['p99']:>8.3f} ms"
+            )
+
+    return {
+        "metadata": {
+            "commit": get_commit(),
+            "date": datetime.datetime.now().isoformat(),
+            "version": openjpeg.__version__,
+            "openjpeg": ".".join(str(v) for v in get_openjpeg_version()),
+            "python": sys.version.split()[0],
+            "platform": platform.platform(),
+            "processor": platform.processor(),
+        },
+        "results": results,
+    }
+
+
+def compare(before, after, threshold):
+    """Print the change in throughput between two sets of results.
+
+    Returns
+    -------
+    int
+        The number of cases where the throughput decreased by more than
+        `threshold` percent.
+    """
+    with open(before) as f:
+        before = json.load(f)
+
+    with open(after) as f:
+        after = json.load(f)
+
+    reference = {
+        (r["name"], r["threads"]): r for r in before["results"]
+    }
+
+    nr_regressions = 0
+    for result in after["results"]:
+        key = (result["name"], result["threads"])
+        if key not in reference:
+            continue
+
+        old = reference[key]["mpixel_per_s"]
+        new = result["mpixel_per_s"]
+        change = (new - old) / old * 100
+        flag = ""
+        if change < -threshold:
+            flag = "  <-- regression"
+            nr_regressions += 1
+
+        print(
+            f"{key[0]:<60} threads={key[1]:<2} "
+            f"{old:>9.2f} -> {new:>9.2f} MP/s ({change:+6.1f}%){flag}"
+        )
+
+    return nr_regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark decoding JPEG 2000 data"
+    )
+    parser.add_argument(
+        "-o", "--output", help="write the results as JSON to this file"
+    )
+    parser.add_argument(
+        "--size", type=int, default=1024,
+        help="rows and columns of the synthetic images (default 1024)",
+    )
+    parser.add_argument(
+        "--threads", type=int, nargs="+", default=[1, 4],
+        help="number of concurrently decoding threads (default 1 4)",
+    )
+    parser.add_argument(
+        "--iterations", type=int, default=10,
+        help="minimum number of decodes per case and thread (default 10)",
+    )
+    parser.add_argument(
+        "--min-time", type=float, default=0.5,
+        help="minimum time to run each case for in seconds (default 0.5)",
+    )
+    parser.add_argument(
+        "--filter", help="only run cases with this in their name"
+    )
+    parser.add_argument(
+        "--no-datasets", action="store_true",
+        help="don't include the pylibjpeg-data files",
+    )
+    parser.add_argument(
+        "--compare", nargs=2, metavar=("BEFORE", "AFTER"),
+        help="compare two result files instead of running the benchmarks",
+    )
+    parser.add_argument(
+        "--threshold", type=float, default=5.0,
+        help="percentage decrease in throughput reported as a regression",
+    )
+    args = parser.parse_args()
+
+    if args.compare:
+        return 1 if compare(*args.compare, args.threshold) else 0
+
+    results = run(args)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=2)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,4 +1,24 @@
 """Set package shortcuts."""
 
 from ._version import __version__
-from .utils import decode, decode_pixel_data, get_parameters
+from .cache import FrameCache, SharedFrameCache
+from .index import build_index, CodestreamIndex, SparseBuffer
+from .utils import (
+    CancelToken,
+    decode,
+    decode_async,
+    decode_into,
+    decode_partial,
+    decode_pyramid,
+    decode_region,
+    decode_pixel_data,
+    DecodeCancelledError,
+    DecodeTimeoutError,
+    encode,
+    encode_frames,
+    get_parameters,
+    MemoryLimitError,
+    PlanePool,
+    ProgressiveDecoder,
+    transcode,
+)
@@ -1,13 +1,22 @@
 # cython: language_level=3
 # distutils: language=c
+from io import BytesIO
 from math import ceil
+import time
 
-from libc.stdint cimport uint32_t
+from libc.stdint cimport int64_t, uint32_t, uint64_t
+from libc.stdlib cimport free
+from libc.string cimport memset
 
-from cpython.ref cimport PyObject
+from cpython.ref cimport PyObject, Py_XDECREF
 import numpy as np
 cimport numpy as np
 
+cdef extern from "Python.h":
+    PyObject* PyBytes_FromStringAndSize(const char *v, Py_ssize_t length)
+    char* PyBytes_AS_STRING(PyObject *o)
+    int _PyBytes_Resize(PyObject **o, Py_ssize_t length) except -1
+
 cdef extern struct JPEG2000Parameters:
     uint32_t columns
     uint32_t rows
@@ -16,10 +25,144 @@ cdef extern struct JPEG2000Parameters:
     uint32_t precision
     unsigned int is_signed
     uint32_t nr_tiles
+    uint64_t memory
+
+cdef extern from "pool.h":
+    # Maximum number of planes that can be held by a pool
+    enum: POOL_NR_SLOTS
+
+    # The layout is taken from pool.h so they can't differ
+    cdef struct PlanePoolData:
+        void *planes[POOL_NR_SLOTS]
+        size_t sizes[POOL_NR_SLOTS]
+        size_t requested[POOL_NR_SLOTS]
+        size_t nr_requested
+        size_t max_size
+        size_t size
+        unsigned long long hits
+        unsigned long long misses
+
+    void pool_init(PlanePoolData *pool, size_t max_size)
+    void pool_clear(PlanePoolData *pool)
+
+cdef extern struct DecodeStats:
+    double header_time
+    double decode_time
+    double colour_time
+    double upsample_time
+    double pack_time
+    double read_time
+    double total_time
+    uint64_t bytes_read
+    uint64_t nr_reads
+    uint64_t nr_skips
+    uint64_t nr_seeks
+    uint64_t peak_memory
+
+cdef extern struct DecodeOptions:
+    int allow_partial
+    int is_partial
+    const int *cancel
+    double timeout
+    uint32_t area[4]
+    uint32_t reduce
+    uint32_t layers
+    uint32_t levels
+    int planar
+    const int64_t *strides
+    int rescale
+    float slope
+    float intercept
+    int window
+    float center
+    float width
+    int layout
+
+cdef extern struct CodecMessages:
+    char error[1024]
+    char warning[1024]
+    char info[1024]
+
+cdef extern struct EncodeParameters:
+    uint32_t columns
+    uint32_t rows
+    uint32_t samples_per_pixel
+    uint32_t bits_stored
+    uint32_t bytes_allocated
+    uint32_t is_signed
+    int colourspace
+    int use_mct
+    int codec_format
+    int irreversible
+    int quality_mode
+    uint32_t nr_layers
+    float quality[100]
+    uint32_t nr_resolutions
+    uint32_t codeblock_width
+    uint32_t codeblock_height
+    int progression_order
+    uint32_t tile_width
+    uint32_t tile_height
+    int nr_threads
+    int tlm
+    int plt
+    uint32_t subsampling_x
+    uint32_t subsampling_y
+
+cdef extern struct EncodeBuffer:
+    unsigned char *data
+    size_t length
+    size_t capacity
+    size_t position
+    int is_external
 
 cdef extern char* OpenJpegVersion()
-cdef extern int Decode(void* fp, unsigned char* out, int codec)
-cdef extern int GetParameters(void* fp, int codec, JPEG2000Parameters *param)
+cdef extern int Decode(
+    void* fp,
+    unsigned char* out,
+    int codec,
+    DecodeOptions *options,
+    PlanePoolData *pool,
+    DecodeStats *stats,
+    CodecMessages *messages,
+)
+cdef extern int DecodeBuffer(
+    const unsigned char *src,
+    size_t length,
+    unsigned char* out,
+    int codec,
+    DecodeOptions *options,
+    PlanePoolData *pool,
+    DecodeStats *stats,
+    CodecMessages *messages,
+) nogil
+cdef extern int Encode(
+    const unsigned char *src,
+    EncodeParameters *parameters,
+    EncodeBuffer *output,
+    CodecMessages *messages,
+) nogil
+cdef extern int Transcode(
+    const unsigned char *src,
+    size_t length,
+    int codec_format,
+    int mode,
+    EncodeBuffer *output,
+    CodecMessages *messages,
+) nogil
+cdef extern uint64_t AtomicLoad(uint64_t *value)
+cdef extern void AtomicStore(uint64_t *value, uint64_t desired)
+cdef extern int AtomicCompareExchange(
+    uint64_t *value, uint64_t expected, uint64_t desired
+)
+cdef extern uint64_t AtomicFetchAdd(uint64_t *value, uint64_t amount)
+cdef extern int GetParameters(
+    void* fp,
+    int codec,
+    JPEG2000Parameters *param,
+    DecodeOptions *options,
+    CodecMessages *messages,
+)
 
 
 ERRORS = {
@@ -31,8 +174,160 @@ ERRORS = {
     6: "failed to decode image",
     7: "support for more than 16-bits per component is not implemented",
     8: "failed to upscale subsampled components",
+    9: "decoding was cancelled",
+    10: "decoding took longer than allowed by the deadline",
+    11: "failed to allocate the lower resolution levels",
+    12: "failed to allocate the window lookup table",
+    13: "RGBA and BGRA output requires 8-bit samples or a window",
 }
 
+# The VOI LUT functions usable with decode(window=...)
+VOI_FUNCTIONS = {"LINEAR": 1, "SIGMOID": 2}
+# The pixel layouts usable with decode(layout=...)
+LAYOUTS = {"RGBA": 1, "BGRA": 2}
+
+ENCODING_ERRORS = {
+    1: "the number of samples per pixel must be 1 or 3",
+    2: "the bits stored must be in the range (1, 16)",
+    3: "the number of bytes per sample must be 1 or 2",
+    4: "failed to create the image",
+    5: "failed to create the compressor",
+    6: "failed to setup the encoder",
+    7: "failed to create the output stream",
+    8: "failed to start compression",
+    9: "failed to encode the image",
+    10: "failed to end compression",
+    11: "the number of quality layers must be in the range (1, 100)",
+    12: "failed to add the TLM or PLT marker segments",
+    13: "the subsampling must be 1 or 2 and requires 3 samples per pixel",
+    14: "failed to set the number of encoding threads",
+}
+
+TRANSCODING_ERRORS = {
+    1: "failed to create the input stream",
+    2: "failed to setup the decoder",
+    3: "failed to read the header",
+    4: "failed to read the codestream information",
+    5: "failed to decode image",
+    6: "failed to create the compressor",
+    7: "failed to setup the encoder",
+    8: "failed to create the output stream",
+    9: "failed to encode the image",
+    10: (
+        "the components use different resolutions, code-block or precinct "
+        "sizes, which can't be kept"
+    ),
+}
+
+
+cdef class PlanePool:
+    """A pool for recycling the decoded image planes between calls to
+    :func:`decode`.
+
+    Decoding needs several large int32 planes per image, by recycling planes
+    of the same size between decodes the pool avoids repeatedly going to the
+    system allocator. A pool is not thread-safe, so use one per thread.
+
+    Parameters
+    ----------
+    max_size : int, optional
+        The maximum total size of the planes held by the pool (in bytes),
+        default 128 MiB.
+    """
+    cdef PlanePoolData pool
+
+    def __cinit__(self, max_size=128 * 1024 * 1024):
+        if max_size < 0:
+            raise ValueError("'max_size' must be greater than or equal to 0")
+
+        pool_init(&self.pool, max_size)
+
+    def __dealloc__(self):
+        pool_clear(&self.pool)
+
+    def clear(self):
+        """Free all the planes held by the pool."""
+        pool_clear(&self.pool)
+
+    @property
+    def hits(self):
+        """Return the number of plane allocations served by the pool."""
+        return self.pool.hits
+
+    @property
+    def max_size(self):
+        """Return the maximum size of the pool (in bytes)."""
+        return self.pool.max_size
+
+    @property
+    def misses(self):
+        """Return the number of plane allocations not served by the pool."""
+        return self.pool.misses
+
+    @property
+    def size(self):
+        """Return the total size of the planes held by the pool (in bytes)."""
+        return self.pool.size
+
+
+cdef class CancelToken:
+    """A flag used to cancel a decode that's running in another thread.
+
+    The flag is checked whenever the decoder reads more data, which for
+    tiled images is between tiles, and between the decoding stages.
+    """
+    cdef int flag
+
+    def __cinit__(self):
+        self.flag = 0
+
+    def cancel(self):
+        """Cancel any decodes using the token."""
+        self.flag = 1
+
+    @property
+    def cancelled(self):
+        """Return ``True`` if the token has been cancelled."""
+        return bool(self.flag)
+
+
+cdef list _split_messages(const char *buffer):
+    """Return the messages in `buffer` as a list of str."""
+    text = buffer.decode("utf-8", errors="replace")
+    return [line.strip() for line in text.splitlines() if line.strip()]
+
+
+cdef _raise_error(
+    int result,
+    CodecMessages *messages,
+    msg="Error decoding the J2K data",
+    reasons=ERRORS,
+):
+    """Raise a RuntimeError for the `result` of a failed decode, encode or
+    transcode.
+    """
+    if result in reasons:
+        msg += f": {reasons[result]}"
+
+    # Include the reason given by openjpeg (if any)
+    errors = _split_messages(messages.error)
+    if errors:
+        msg += f" - {'; '.join(errors)}"
+
+    raise RuntimeError(msg)
+
+
+class MemoryLimitError(MemoryError):
+    """Raised when decoding would exceed the allowed memory."""
+
+
+class DecodeCancelledError(RuntimeError):
+    """Raised when decoding is cancelled."""
+
+
+class DecodeTimeoutError(DecodeCancelledError, TimeoutError):
+    """Raised when decoding doesn't finish before the deadline."""
+
 
 def get_version():
     """Return the openjpeg version as bytes."""
@@ -41,49 +336,390 @@ def get_version():
     return version
 
 
-def decode(fp, codec=0):
+def decode(
+    fp,
+    codec=0,
+    pool=None,
+    max_memory=None,
+    stats=False,
+    allow_partial=False,
+    CancelToken cancel_token=None,
+    deadline=None,
+    area=None,
+    reduce=0,
+    layers=None,
+    levels=0,
+    planar=False,
+    out=None,
+    rescale=None,
+    window=None,
+    voi_function="LINEAR",
+    layout=None,
+):
     """Return the decoded JPEG 2000 data from Python file-like `fp`.
 
     Parameters
     ----------
-    fp : file-like
-        A Python file-like containing the encoded JPEG 2000 data. Must have
-        ``tell()``, ``seek()`` and ``read()`` methods.
+    fp : bytes or file-like
+        The encoded JPEG 2000 data, or a Python file-like containing it which
+        must have ``tell()``, ``seek()`` and ``read()`` methods. If
+        :class:`bytes` then the GIL is released while decoding.
     codec : int, optional
         The codec to use for decoding, one of:
 
         * ``0``: JPEG-2000 codestream
         * ``1``: JPT-stream (JPEG 2000, JPIP)
         * ``2``: JP2 file format
+    pool : PlanePool, optional
+        The pool to use for recycling the decoded image planes.
+    max_memory : int, optional
+        The maximum memory that may be used for decoding (in bytes). The peak
+        memory required is estimated from the JPEG 2000 header prior to
+        decoding, default no limit.
+    stats : bool, optional
+        If ``True`` then also return the decoding statistics, default
+        ``False``.
+    allow_partial : bool, optional
+        If ``True`` then decode as much of truncated data as possible rather
+        than raising an exception, default ``False``.
+    cancel_token : CancelToken, optional
+        A token that may be used to cancel decoding from another thread.
+    deadline : float, optional
+        The :func:`time.monotonic` time by which decoding must finish,
+        default no limit.
+    area : tuple of int, optional
+        The (x0, y0, x1, y1) pixel coordinates of the area of the image to
+        decode, relative to the image origin, default the whole image.
+    reduce : int, optional
+        The number of highest resolution levels to discard, each one halves
+        the width and height of the decoded image, default ``0``.
+    layers : int, optional
+        The number of quality layers to decode, default all layers.
+    levels : int, optional
+        The number of lower resolution levels of the image to also return,
+        each one half the width and height of the level above (rounding up)
+        and following the image data in the returned array, default ``0``.
+        Cannot be used with `area` or `reduce`.
+    planar : bool, optional
+        If ``True`` then write each component of the image contiguously
+        (planar configuration 1), otherwise interleave the components of
+        each pixel (planar configuration 0, default).
+    out : numpy.ndarray, optional
+        The writeable array to decode into, which must have the shape and
+        dtype of the decoded image but may have any strides, such as a view
+        of a larger array. Cannot be used with `levels` or `planar`.
+    rescale : tuple of (float, float), optional
+        If used then the decoded data is float32 with the (slope, intercept)
+        applied to each sample as ``value * slope + intercept``, such as the
+        DICOM *Rescale Slope* and *Rescale Intercept*. Cannot be used with
+        `levels`.
+    window : tuple of (float, float), optional
+        If used then the decoded data is uint8 with the (center, width)
+        window applied to each sample (after any `rescale`), such as the
+        DICOM *Window Center* and *Window Width*. Cannot be used with
+        `levels`.
+    voi_function : str, optional
+        The VOI LUT function used with `window`, one of ``"LINEAR"``
+        (default) or ``"SIGMOID"``.
+    layout : str, optional
+        If used then the decoded data is 8-bit pixels of four samples, one
+        of ``"RGBA"`` or ``"BGRA"``. The alpha sample is from the component
+        marked as alpha scaled to 8-bits, otherwise 255, and grayscale is
+        replicated to RGB. Signed samples are offset so their minimum is 0.
+        Requires 8-bit samples or `window`, and cannot be used with `levels`
+        or `planar`.
 
     Returns
     -------
-    numpy.ndarray
-        An ndarray of uint8 containing the decoded image data.
+    numpy.ndarray or tuple of (numpy.ndarray, dict)
+        An ndarray of uint8 containing the decoded image data, or `out` if
+        used. If `stats` or
+        `allow_partial` is ``True`` then a :class:`dict` will also be
+        returned containing the decoding statistics (see
+        :func:`openjpeg.utils.decode`) and/or ``'is_partial'``, which is
+        ``True`` if the data was truncated.
 
     Raises
     ------
     RuntimeError
         If unable to decode the JPEG 2000 data.
+    MemoryLimitError
+        If decoding would require more than `max_memory` bytes.
+    DecodeCancelledError
+        If decoding was cancelled using `cancel_token`.
+    DecodeTimeoutError
+        If decoding didn't finish before the `deadline`.
     """
-    param = get_parameters(fp, codec)
-    bpp = ceil(param['precision'] / 8)
-    nr_bytes = param['rows'] * param['columns'] * param['nr_components'] * bpp
+    is_buffer = isinstance(fp, bytes)
+    cdef JPEG2000Parameters param = _read_parameters(
+        BytesIO(fp) if is_buffer else fp, codec, area, reduce
+    )
+    x0, y0, x1, y1 = 0, 0, param.columns, param.rows
+    if area is not None:
+        x0, y0, x1, y1 = area
+        if not (0 <= x0 < x1 <= param.columns and 0 <= y0 < y1 <= param.rows):
+            raise ValueError(
+                f"Invalid 'area' value {tuple(area)}, must be within the "
+                f"image and have a non-zero size"
+            )
+
+    if reduce < 0:
+        raise ValueError("'reduce' must be greater than or equal to 0")
+
+    if layers is not None and layers < 1:
+        raise ValueError("'layers' must be greater than 0")
+
+    if levels < 0:
+        raise ValueError("'levels' must be greater than or equal to 0")
+
+    if levels and (area is not None or reduce):
+        raise ValueError("'levels' cannot be used with 'area' or 'reduce'")
+
+    if levels and (rescale is not None or window is not None):
+        raise ValueError("'levels' cannot be used with 'rescale' or 'window'")
+
+    if layout is not None:
+        if layout not in LAYOUTS:
+            raise ValueError(f"Unsupported 'layout' value: {layout}")
+
+        if levels or planar:
+            raise ValueError(
+                "'layout' cannot be used with 'levels' or 'planar'"
+            )
+
+        if window is None and (rescale is not None or param.precision > 8):
+            raise ValueError(
+                "'layout' requires 8-bit samples or 'window' to be used"
+            )
+
+    if voi_function not in VOI_FUNCTIONS:
+        raise ValueError(f"Unsupported 'voi_function' value: {voi_function}")
+
+    if window is not None:
+        # DICOM Standard, Part 3, C.11.2.1.2.1 and C.11.2.1.3.1
+        if voi_function == "LINEAR" and window[1] < 1:
+            raise ValueError(
+                "The window width must be greater than or equal to 1"
+            )
+
+        if voi_function == "SIGMOID" and window[1] <= 0:
+            raise ValueError("The window width must be greater than 0")
+
+    # Each discarded resolution level halves the size, rounding up
+    scale = 2**reduce
+    rows = ceil(y1 / scale) - ceil(y0 / scale)
+    columns = ceil(x1 / scale) - ceil(x0 / scale)
+
+    nr_components = param.nr_components
+    bpp = ceil(param.precision / 8)
+    dtype = np.dtype(f"<{'i' if param.is_signed else 'u'}{bpp}")
+    if layout is not None:
+        bpp = 1
+        dtype = np.dtype("uint8")
+        nr_components = 4
+    elif window is not None:
+        bpp = 1
+        dtype = np.dtype("uint8")
+    elif rescale is not None:
+        bpp = 4
+        dtype = np.dtype("float32")
+
+    nr_bytes = rows * columns * nr_components * bpp
+    for level in range(1, levels + 1):
+        scale = 2**level
+        nr_bytes += (
+            ceil(param.rows / scale) * ceil(param.columns / scale)
+            * nr_components * bpp
+        )
+
+    cdef int64_t strides[3]
+    if out is not None:
+        shape = (rows, columns)
+        if nr_components > 1:
+            shape = (rows, columns, nr_components)
+
+        _check_output(out, shape, dtype, levels or planar)
+        strides[:] = [*out.strides[:2], 0]
+        if nr_components > 1:
+            strides[2] = out.strides[2]
+
+    if max_memory is not None:
+        required = nr_bytes + param.memory
+        if required > max_memory:
+            raise MemoryLimitError(
+                f"Decoding the J2K data requires an estimated {required} "
+                f"bytes, which exceeds the 'max_memory' limit of "
+                f"{max_memory} bytes"
+            )
 
     cdef PyObject* p_in = <PyObject*>fp
-    arr = np.zeros(nr_bytes, dtype=np.uint8)
+    arr = np.zeros(nr_bytes, dtype=np.uint8) if out is None else out
     cdef unsigned char *p_out = <unsigned char *>np.PyArray_DATA(arr)
 
-    result = Decode(p_in, p_out, codec)
+    cdef PlanePoolData *p_pool = NULL
+    if pool is not None:
+        p_pool = &(<PlanePool?>pool).pool
+
+    cdef DecodeStats decode_stats
+    cdef DecodeStats *p_stats = &decode_stats if stats else NULL
+    cdef CodecMessages messages
+    cdef DecodeOptions options
+    options.allow_partial = allow_partial
+    options.is_partial = 0
+    options.cancel = &cancel_token.flag if cancel_token is not None else NULL
+    options.timeout = 0
+    for idx, value in enumerate(area or (0, 0, 0, 0)):
+        options.area[idx] = value
+    options.reduce = reduce
+    options.layers = layers or 0
+    options.levels = levels
+    options.planar = planar
+    options.strides = strides if out is not None else NULL
+    options.rescale = rescale is not None
+    options.slope, options.intercept = rescale or (1, 0)
+    options.window = VOI_FUNCTIONS[voi_function] if window is not None else 0
+    options.center, options.width = window or (0, 0)
+    options.layout = LAYOUTS[layout] if layout is not None else 0
+    if deadline is not None:
+        options.timeout = deadline - time.monotonic()
+        if options.timeout <= 0:
+            raise DecodeTimeoutError("The deadline for decoding has passed")
+
+    cdef const unsigned char *p_src = NULL
+    cdef size_t length = 0
+    cdef int codec_format = codec
+    cdef int result
+    if is_buffer:
+        p_src = <const unsigned char *>PyBytes_AS_STRING(p_in)
+        length = len(fp)
+        # `fp` and `arr` are kept alive while the GIL is released
+        with nogil:
+            result = DecodeBuffer(
+                p_src,
+                length,
+                p_out,
+                codec_format,
+                &options,
+                p_pool,
+                p_stats,
+                &messages,
+            )
+    else:
+        result = Decode(
+            p_in, p_out, codec, &options, p_pool, p_stats, &messages
+        )
+
+    if result == 9:
+        raise DecodeCancelledError("Decoding was cancelled")
+
+    if result == 10:
+        raise DecodeTimeoutError(
+            "Decoding was cancelled as it didn't finish before the deadline"
+        )
+
     if result != 0:
-        try:
-            msg = f": {ERRORS[result]}"
-        except KeyError:
-            pass
+        _raise_error(result, &messages)
+
+    if not stats and not allow_partial:
+        return arr
+
+    info = {}
+    if allow_partial:
+        info['is_partial'] = bool(options.is_partial)
+
+    if not stats:
+        return arr, info
+
+    info.update({
+        'time': {
+            'header': decode_stats.header_time,
+            'decode': decode_stats.decode_time,
+            'colour': decode_stats.colour_time,
+            'upsample': decode_stats.upsample_time,
+            'pack': decode_stats.pack_time,
+            'read': decode_stats.read_time,
+            'total': decode_stats.total_time,
+        },
+        'bytes_read': decode_stats.bytes_read,
+        'nr_reads': decode_stats.nr_reads,
+        'nr_skips': decode_stats.nr_skips,
+        'nr_seeks': decode_stats.nr_seeks,
+        'peak_memory': decode_stats.peak_memory + nr_bytes,
+        'messages': {
+            'error': _split_messages(messages.error),
+            'warning': _split_messages(messages.warning),
+            'info': _split_messages(messages.info),
+        },
+    })
+
+    return arr, info
+
+
+cdef _check_output(out, shape, dtype, exclusive):
+    """Raise an exception if the array `out` can't be decoded into."""
+    if not isinstance(out, np.ndarray):
+        raise TypeError("'out' must be a numpy.ndarray")
+
+    if exclusive:
+        raise ValueError("'out' cannot be used with 'levels' or 'planar'")
+
+    if out.shape != shape:
+        raise ValueError(
+            f"The shape of 'out' {out.shape} doesn't match the shape of the "
+            f"decoded image {shape}"
+        )
+
+    if out.dtype != dtype:
+        raise ValueError(
+            f"The dtype of 'out' ({out.dtype}) doesn't match the dtype of "
+            f"the decoded image ({dtype})"
+        )
+
+    if not out.flags.writeable:
+        raise ValueError("'out' must be writeable")
+
+
+cdef JPEG2000Parameters _read_parameters(
+    fp, codec, area=None, reduce=0
+) except *:
+    """Return the JPEG 2000 image parameters from Python file-like `fp`,
+    with the memory estimate for decoding `area` with `reduce` resolution
+    levels discarded.
+    """
+    cdef JPEG2000Parameters param
+    param.columns = 0
+    param.rows = 0
+    param.colourspace = 0
+    param.nr_components = 0
+    param.precision = 0
+    param.is_signed = 0
+    param.nr_tiles = 0
+    param.memory = 0
+
+    # Pointer to the JPEGParameters object
+    cdef JPEG2000Parameters *p_param = &param
+
+    # Pointer to J2K data
+    cdef PyObject* ptr = <PyObject*>fp
+
+    cdef CodecMessages messages
+
+    # Only the area and reduce options affect the memory estimate, an
+    #   invalid area is ignored here and rejected by the caller
+    cdef DecodeOptions options
+    memset(&options, 0, sizeof(DecodeOptions))
+    if area is not None and all(0 <= value < 2**32 for value in area):
+        for idx, value in enumerate(area):
+            options.area[idx] = value
 
-        raise RuntimeError("Error decoding the J2K data" + msg)
+    options.reduce = min(max(reduce, 0), 31)
 
-    return arr
+    # Decode the data - output is written to output_buffer
+    result = GetParameters(ptr, codec, p_param, &options, &messages)
+    if result != 0:
+        _raise_error(result, &messages)
+
+    return param
 
 
 def get_parameters(fp, codec=0):
@@ -114,30 +750,7 @@ def get_parameters(fp, codec=0):
     RuntimeError
         If unable to decode the JPEG 2000 data.
     """
-    cdef JPEG2000Parameters param
-    param.columns = 0
-    param.rows = 0
-    param.colourspace = 0
-    param.nr_components = 0
-    param.precision = 0
-    param.is_signed = 0
-    param.nr_tiles = 0
-
-    # Pointer to the JPEGParameters object
-    cdef JPEG2000Parameters *p_param = &param
-
-    # Pointer to J2K data
-    cdef PyObject* ptr = <PyObject*>fp
-
-    # Decode the data - output is written to output_buffer
-    result = GetParameters(ptr, codec, p_param)
-    if result != 0:
-        try:
-            msg = f": {ERRORS[result]}"
-        except KeyError:
-            pass
-
-        raise RuntimeError("Error decoding the J2K data" + msg)
+    cdef JPEG2000Parameters param = _read_parameters(fp, codec)
 
     # From openjpeg.h#L309
     colours = {
@@ -166,3 +779,264 @@ def get_parameters(fp, codec=0):
     }
 
     return parameters
+
+
+def encode(
+    np.ndarray arr,
+    int bits_stored,
+    int colourspace,
+    bint use_mct,
+    int codec_format,
+    bint irreversible=False,
+    int quality_mode=0,
+    layers=(),
+    int nr_resolutions=0,
+    codeblock_size=(0, 0),
+    int progression_order=0,
+    tile_size=(0, 0),
+    int nr_threads=1,
+    bint tlm=False,
+    bint plt=False,
+    subsampling=(1, 1),
+    size_hint=None,
+):
+    """Return the JPEG 2000 compressed `arr` as :class:`bytes`.
+
+    Parameters
+    ----------
+    arr : numpy.ndarray
+        A C-contiguous ndarray of uint8, int8, uint16 or int16 with shape
+        (rows, columns) or (rows, columns, 3).
+    bits_stored : int
+        The number of bits used per sample, in the range (1, 16).
+    colourspace : int
+        The ``OPJ_COLOR_SPACE`` of `arr`.
+    use_mct : bool
+        If ``True`` then apply the multiple component transform to RGB
+        images.
+    codec_format : int
+        The format of the encoded data, one of:
+
+        * ``0``: JPEG-2000 codestream
+        * ``2``: JP2 file format
+    irreversible : bool, optional
+        If ``True`` then use the irreversible 9/7 wavelet, otherwise use the
+        reversible 5/3 wavelet (default).
+    quality_mode : int, optional
+        How the quality `layers` are specified, one of:
+
+        * ``0``: a single lossless layer (default), `layers` is ignored
+        * ``1``: compression ratios
+        * ``2``: peak signal-to-noise ratios (in dB)
+    layers : sequence of float, optional
+        The compression ratio or PSNR target for each quality layer.
+    nr_resolutions : int, optional
+        The number of resolutions, or ``0`` for the default.
+    codeblock_size : tuple of int, optional
+        The code-block (width, height), or ``(0, 0)`` for the default.
+    progression_order : int, optional
+        The ``OPJ_PROG_ORDER`` to use, default ``0`` (LRCP).
+    tile_size : tuple of int, optional
+        The tile (width, height), or ``(0, 0)`` for a single tile.
+    nr_threads : int, optional
+        The number of threads openjpeg may use for encoding, default ``1``.
+    tlm : bool, optional
+        If ``True`` then write TLM marker segments, default ``False``.
+    plt : bool, optional
+        If ``True`` then write PLT marker segments, default ``False``.
+    subsampling : tuple of int, optional
+        The (horizontal, vertical) subsampling of the second and third
+        components, 1 or 2, default ``(1, 1)``.
+    size_hint : int, optional
+        The initial size of the output buffer (in bytes), default is an
+        estimate based on `arr` and the quality `layers`. Intended for
+        testing.
+
+    Returns
+    -------
+    bytes
+        The encoded JPEG 2000 data.
+
+    Raises
+    ------
+    RuntimeError
+        If unable to encode `arr`.
+    ValueError
+        If `size_hint` is less than 1.
+    """
+    if size_hint is not None and size_hint < 1:
+        raise ValueError("'size_hint' must be at least 1")
+
+    cdef EncodeParameters parameters
+    parameters.rows = arr.shape[0]
+    parameters.columns = arr.shape[1]
+    parameters.samples_per_pixel = arr.shape[2] if arr.ndim == 3 else 1
+    parameters.bits_stored = bits_stored
+    parameters.bytes_allocated = arr.dtype.itemsize
+    parameters.is_signed = arr.dtype.kind == "i"
+    parameters.colourspace = colourspace
+    parameters.use_mct = use_mct
+    parameters.codec_format = codec_format
+    parameters.irreversible = irreversible
+    parameters.quality_mode = quality_mode
+    parameters.nr_layers = len(layers)
+    for idx, value in enumerate(layers[:100]):
+        parameters.quality[idx] = value
+    parameters.nr_resolutions = nr_resolutions
+    parameters.codeblock_width, parameters.codeblock_height = codeblock_size
+    parameters.progression_order = progression_order
+    parameters.tile_width, parameters.tile_height = tile_size
+    parameters.nr_threads = nr_threads
+    parameters.tlm = tlm
+    parameters.plt = plt
+    parameters.subsampling_x, parameters.subsampling_y = subsampling
+
+    # Estimate the size of the encoded data so it can be written directly
+    #   to the bytes object that's returned, avoiding a copy. If the estimate
+    #   is too small the encoder falls back to its own buffer
+    nr_bytes = arr.nbytes
+    if quality_mode == 1:
+        nr_bytes = int(nr_bytes / min(layers))
+    nr_bytes += nr_bytes // 8 + 4096
+    if size_hint is not None:
+        nr_bytes = size_hint
+
+    cdef PyObject *p_bytes = PyBytes_FromStringAndSize(NULL, nr_bytes)
+    if p_bytes is NULL:
+        raise MemoryError("Unable to allocate the output buffer")
+
+    cdef EncodeBuffer output
+    output.data = <unsigned char *>PyBytes_AS_STRING(p_bytes)
+    output.length = 0
+    output.capacity = nr_bytes
+    output.position = 0
+    output.is_external = 1
+
+    cdef const unsigned char *p_in = <unsigned char *>np.PyArray_DATA(arr)
+    cdef CodecMessages messages
+    cdef int result
+
+    # The input array is kept alive by `arr` and the output by `p_bytes`
+    #   while the GIL is released
+    with nogil:
+        result = Encode(p_in, &parameters, &output, &messages)
+
+    try:
+        if result != 0:
+            _raise_error(
+                result, &messages, "Error encoding the data", ENCODING_ERRORS
+            )
+
+        if not output.is_external:
+            # The estimate was too small
+            try:
+                return (<char *>output.data)[:output.length]
+            finally:
+                free(output.data)
+
+        # Shrink to fit, usually done in-place
+        _PyBytes_Resize(&p_bytes, output.length)
+        return <object>p_bytes
+    finally:
+        Py_XDECREF(p_bytes)
+
+
+def transcode(const unsigned char[::1] src not None, int codec, int mode):
+    """Return the losslessly re-encoded JPEG 2000 data in `src`.
+
+    Parameters
+    ----------
+    src : bytes-like
+        The JPEG 2000 data to be transcoded.
+    codec : int
+        The format of `src`, one of:
+
+        * ``0``: JPEG-2000 codestream
+        * ``2``: JP2 file format
+    mode : int
+        The code-block coding style flags to use when encoding.
+
+    Returns
+    -------
+    bytes
+        The re-encoded J2K codestream.
+
+    Raises
+    ------
+    RuntimeError
+        If unable to transcode `src`.
+    """
+    cdef EncodeBuffer output
+    output.data = NULL
+    output.length = 0
+    output.capacity = 0
+    output.position = 0
+    output.is_external = 0
+
+    cdef const unsigned char *p_in = &src[0]
+    cdef size_t length = src.shape[0]
+    cdef CodecMessages messages
+    cdef int result
+
+    # `src` is kept alive by the memoryview while the GIL is released
+    with nogil:
+        result = Transcode(p_in, length, codec, mode, &output, &messages)
+
+    if result != 0:
+        _raise_error(
+            result, &messages, "Error transcoding the data", TRANSCODING_ERRORS
+        )
+
+    try:
+        return (<char *>output.data)[:output.length]
+    finally:
+        free(output.data)
+
+
+cdef uint64_t* _atomic_pointer(
+    unsigned char[::1] buffer, Py_ssize_t offset
+) except NULL:
+    """Return a pointer to the aligned uint64 at `offset` in `buffer`."""
+    if offset < 0 or offset + 8 > buffer.shape[0]:
+        raise IndexError("The offset is outside the buffer")
+
+    cdef uint64_t *p_value = <uint64_t *>&buffer[offset]
+    if <size_t>p_value % 8:
+        raise ValueError("The value must be 8-byte aligned")
+
+    return p_value
+
+
+def atomic_load(unsigned char[::1] buffer not None, Py_ssize_t offset):
+    """Return the uint64 at `offset` in `buffer` using an atomic load."""
+    return AtomicLoad(_atomic_pointer(buffer, offset))
+
+
+def atomic_store(
+    unsigned char[::1] buffer not None, Py_ssize_t offset, uint64_t value
+):
+    """Set the uint64 at `offset` in `buffer` to `value` atomically."""
+    AtomicStore(_atomic_pointer(buffer, offset), value)
+
+
+def atomic_compare_exchange(
+    unsigned char[::1] buffer not None,
+    Py_ssize_t offset,
+    uint64_t expected,
+    uint64_t desired,
+):
+    """Set the uint64 at `offset` in `buffer` to `desired` if it's currently
+    `expected` and return ``True``, otherwise return ``False``.
+    """
+    return bool(
+        AtomicCompareExchange(_atomic_pointer(buffer, offset), expected, desired)
+    )
+
+
+def atomic_fetch_add(
+    unsigned char[::1] buffer not None, Py_ssize_t offset, uint64_t amount
+):
+    """Add `amount` to the uint64 at `offset` in `buffer` atomically and
+    return the original value.
+    """
+    return AtomicFetchAdd(_atomic_pointer(buffer, offset), amount)
@@ -0,0 +1,541 @@
+"""Caches for decoded images."""
+
+from collections import OrderedDict
+import hashlib
+import os
+import struct
+import sys
+import threading
+import time
+
+import numpy as np
+
+from _openjpeg import (
+    atomic_compare_exchange,
+    atomic_fetch_add,
+    atomic_load,
+    atomic_store,
+)
+
+
+class FrameCache(object):
+    """An in-process least recently used cache of decoded images.
+
+    Images are keyed by a hash of the encoded data and the decoding options,
+    and are returned as read-only arrays which are shared between all the
+    callers that get the same image. When adding an image would take the
+    total size of the cached images over `max_size` then the least recently
+    used images are evicted. The cache is thread-safe.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        from openjpeg import FrameCache, decode
+
+        cache = FrameCache(max_size=512 * 1024 * 1024)
+        arr = decode(frame, cache=cache)
+
+    Parameters
+    ----------
+    max_size : int, optional
+        The maximum total size of the cached images (in bytes), default
+        256 MiB.
+    """
+    def __init__(self, max_size=256 * 1024 * 1024):
+        if max_size < 0:
+            raise ValueError("'max_size' must be greater than or equal to 0")
+
+        self._max_size = max_size
+        self._size = 0
+        self._images = OrderedDict()
+        self._lock = threading.Lock()
+        self._hits = 0
+        self._misses = 0
+        self._evictions = 0
+
+    def __contains__(self, key):
+        with self._lock:
+            return key in self._images
+
+    def __len__(self):
+        with self._lock:
+            return len(self._images)
+
+    def clear(self):
+        """Remove all the cached images."""
+        with self._lock:
+            self._images.clear()
+            self._size = 0
+
+    @property
+    def evictions(self):
+        """Return the number of images evicted to make room for others."""
+        return self._evictions
+
+    def get(self, key):
+        """Return the cached image for `key`.
+
+        Parameters
+        ----------
+        key : tuple
+            The key for the image, from :meth:`make_key`.
+
+        Returns
+        -------
+        numpy.ndarray or None
+            The read-only cached image, or ``None`` if not in the cache.
+        """
+        with self._lock:
+            arr = self._images.get(key)
+            if arr is None:
+                self._misses += 1
+                return None
+
+            self._images.move_to_end(key)
+            self._hits += 1
+
+            return arr
+
+    @property
+    def hits(self):
+        """Return the number of lookups served by the cache."""
+        return self._hits
+
+    @staticmethod
+    def make_key(data, **options):
+        """Return the cache key for the encoded `data` decoded with `options`.
+
+        Parameters
+        ----------
+        data : bytes-like
+            The encoded JPEG 2000 data.
+        **options
+            The decoding options that affect the decoded image.
+
+        Returns
+        -------
+        tuple
+            The cache key.
+        """
+        digest = hashlib.blake2b(data, digest_size=16).digest()
+
+        return (digest, len(data), tuple(sorted(options.items())))
+
+    @property
+    def max_size(self):
+        """Return the maximum total size of the cached images (in bytes)."""
+        return self._max_size
+
+    @property
+    def misses(self):
+        """Return the number of lookups not served by the cache."""
+        return self._misses
+
+    def put(self, key, arr):
+        """Add an image to the cache.
+
+        Parameters
+        ----------
+        key : tuple
+            The key for the image, from :meth:`make_key`.
+        arr : numpy.ndarray
+            The decoded image, which will be made read-only.
+
+        Returns
+        -------
+        numpy.ndarray
+            The read-only `arr`. If another image was already cached for
+            `key` then that image is returned instead.
+        """
+        arr.flags.writeable = False
+
+        with self._lock:
+            if key in self._images:
+                self._images.move_to_end(key)
+                return self._images[key]
+
+            # Too large to cache without evicting everything
+            if arr.nbytes > self._max_size:
+                return arr
+
+            while self._size + arr.nbytes > self._max_size:
+                _, evicted = self._images.popitem(last=False)
+                self._size -= evicted.nbytes
+                self._evictions += 1
+
+            self._images[key] = arr
+            self._size += arr.nbytes
+
+            return arr
+
+    @property
+    def size(self):
+        """Return the total size of the cached images (in bytes)."""
+        return self._size
+
+
+# Shared-memory segment layout, all values are little endian
+#   Header: magic, version, number of slots, data offset, data size and the
+#   (atomically incremented) size of the data used so far
+_HEADER = struct.Struct("<6Q16x")
+_MAGIC = int.from_bytes(b"OPJCACHE", "little")
+_VERSION = 1
+_NEXT_OFFSET = 40
+#   Index slots: state, key digest, data offset, data size, dtype, ndim and
+#   shape. The state is atomically set to claimed by the writer then to ready
+#   once everything else has been written
+_SLOT = struct.Struct("<Q16sQQ8sI3I")
+_EMPTY, _CLAIMED, _READY = 0, 1, 2
+# How long to wait for another process to initialise the segment (in seconds)
+_ATTACH_TIMEOUT = 1.0
+
+
+def _open_segment(name, create=False, size=0):
+    """Return the shared-memory segment `name`, which won't be unlinked when
+    this process exits.
+    """
+    # Only available with Python 3.8+, so not imported with the package
+    from multiprocessing import shared_memory
+
+    if sys.version_info >= (3, 13):
+        return shared_memory.SharedMemory(
+            name, create=create, size=size, track=False
+        )
+
+    shm = shared_memory.SharedMemory(name, create=create, size=size)
+    _set_tracked(shm, False)
+
+    return shm
+
+
+def _set_tracked(shm, tracked):
+    """Register or unregister `shm` with the resource tracker, which unlinks
+    the segments still registered when the process exits.
+    """
+    if os.name != "posix":
+        return
+
+    try:
+        from multiprocessing import resource_tracker
+
+        # The tracker uses the name with the leading "/"
+        if tracked:
+            resource_tracker.register(f"/{shm.name}", "shared_memory")
+        else:
+            resource_tracker.unregister(f"/{shm.name}", "shared_memory")
+    except Exception:
+        pass
+
+
+class SharedFrameCache(object):
+    """A cache of decoded images in shared memory that can be used by many
+    processes.
+
+    The images are stored in a named shared-memory segment containing a
+    fixed size hash table index followed by the image data. Slots in the
+    index are claimed and published using atomic operations and the data is
+    appended, so no locks are needed and any process can return an image
+    decoded by another as a read-only zero-copy view of the segment. Nothing
+    is evicted, once the segment is full no more images are added.
+
+    The first process to use `name` creates the segment, the others attach to
+    it. The segment persists until :meth:`unlink` is called, even after the
+    processes that used it have exited. Requires Python 3.8 or later.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        from openjpeg import SharedFrameCache, decode
+
+        # In each worker process
+        cache = SharedFrameCache("frames", max_size=2 * 1024**3)
+        arr = decode(frame, cache=cache)
+
+    Parameters
+    ----------
+    name : str
+        The name of the shared-memory segment.
+    max_size : int, optional
+        The size of the image data in the segment (in bytes), only used when
+        creating the segment, default 256 MiB.
+    nr_slots : int, optional
+        The number of slots in the index, which is the maximum number of
+        images that can be cached, only used when creating the segment,
+        default 4096.
+    """
+    def __init__(self, name, max_size=256 * 1024 * 1024, nr_slots=4096):
+        if max_size < 0:
+            raise ValueError("'max_size' must be greater than or equal to 0")
+
+        if nr_slots < 1:
+            raise ValueError("'nr_slots' must be greater than 0")
+
+        if sys.version_info < (3, 8):
+            raise RuntimeError("SharedFrameCache requires Python 3.8 or later")
+
+        self._hits = 0
+        self._misses = 0
+
+        data_offset = _HEADER.size + nr_slots * _SLOT.size
+        try:
+            self._shm = _open_segment(
+                name, create=True, size=data_offset + max_size
+            )
+        except FileExistsError:
+            self._shm = self._attach(name)
+        else:
+            buffer = self._shm.buf
+            _HEADER.pack_into(
+                buffer, 0, 0, _VERSION, nr_slots, data_offset, max_size, 0
+            )
+            # Publish the header last
+            atomic_store(buffer, 0, _MAGIC)
+
+        _, version, self._nr_slots, self._data_offset, self._max_size, _ = (
+            _HEADER.unpack_from(self._shm.buf, 0)
+        )
+        if version != _VERSION:
+            self._shm.close()
+            raise ValueError(
+                f"The shared-memory segment '{name}' uses an unsupported "
+                f"cache version: {version}"
+            )
+
+    def __contains__(self, key):
+        return self._find(key) is not None
+
+    def __len__(self):
+        buffer = self._shm.buf
+        return sum(
+            atomic_load(buffer, self._slot_offset(idx)) == _READY
+            for idx in range(self._nr_slots)
+        )
+
+    @staticmethod
+    def _attach(name):
+        """Return the existing segment `name`, waiting for the process that
+        created it to size and initialise it.
+        """
+        end = time.monotonic() + _ATTACH_TIMEOUT
+        while True:
+            try:
+                shm = _open_segment(name)
+            except ValueError:
+                # Not sized yet, so can't be mapped
+                shm = None
+
+            if shm is not None:
+                # The magic is written last, once the header is complete
+                if (
+                    shm.size >= _HEADER.size
+                    and atomic_load(shm.buf, 0) == _MAGIC
+                ):
+                    return shm
+
+                shm.close()
+
+            if time.monotonic() > end:
+                raise RuntimeError(
+                    f"The shared-memory segment '{name}' wasn't initialised "
+                    f"as an image cache"
+                )
+
+            time.sleep(0.001)
+
+    def close(self):
+        """Detach from the shared-memory segment.
+
+        Any images returned by the cache must be deleted first.
+        """
+        self._shm.close()
+
+    def _find(self, key):
+        """Return the offset of the ready slot for `key`, or ``None``."""
+        buffer = self._shm.buf
+        start = int.from_bytes(key[:8], "little") % self._nr_slots
+        for ii in range(self._nr_slots):
+            offset = self._slot_offset((start + ii) % self._nr_slots)
+            state = atomic_load(buffer, offset)
+            if state == _EMPTY:
+                return None
+
+            if state == _READY and _SLOT.unpack_from(buffer, offset)[1] == key:
+                return offset
+
+        return None
+
+    def get(self, key):
+        """Return the cached image for `key`.
+
+        Parameters
+        ----------
+        key : bytes
+            The key for the image, from :meth:`make_key`.
+
+        Returns
+        -------
+        numpy.ndarray or None
+            The cached image as a read-only view of the shared memory, or
+            ``None`` if not in the cache.
+        """
+        offset = self._find(key)
+        if offset is None:
+            self._misses += 1
+            return None
+
+        self._hits += 1
+
+        return self._view(offset)
+
+    @property
+    def hits(self):
+        """Return the number of lookups served by the cache in this process.
+        """
+        return self._hits
+
+    @staticmethod
+    def make_key(data, **options):
+        """Return the cache key for the encoded `data` decoded with `options`.
+
+        Parameters
+        ----------
+        data : bytes-like
+            The encoded JPEG 2000 data.
+        **options
+            The decoding options that affect the decoded image.
+
+        Returns
+        -------
+        bytes
+            The 16 byte cache key.
+        """
+        key = FrameCache.make_key(data, **options)
+
+        return hashlib.blake2b(repr(key).encode(), digest_size=16).digest()
+
+    @property
+    def max_size(self):
+        """Return the size of the image data in the segment (in bytes)."""
+        return self._max_size
+
+    @property
+    def misses(self):
+        """Return the number of lookups not served by the cache in this
+        process.
+        """
+        return self._misses
+
+    @property
+    def name(self):
+        """Return the name of the shared-memory segment."""
+        return self._shm.name
+
+    def put(self, key, arr):
+        """Add an image to the cache.
+
+        Parameters
+        ----------
+        key : bytes
+            The key for the image, from :meth:`make_key`.
+        arr : numpy.ndarray
+            The decoded image, with at most 3 dimensions.
+
+        Returns
+        -------
+        numpy.ndarray
+            The cached image as a read-only view of the shared memory. If
+            the image couldn't be cached because the segment is full then the
+            read-only `arr` is returned instead.
+        """
+        arr = np.ascontiguousarray(arr)
+        arr.flags.writeable = False
+        if arr.ndim > 3:
+            return arr
+
+        buffer = self._shm.buf
+
+        # Claim a slot, images already being added by other processes are
+        #   skipped over so at worst an image is cached twice
+        start = int.from_bytes(key[:8], "little") % self._nr_slots
+        slot = None
+        for ii in range(self._nr_slots):
+            offset = self._slot_offset((start + ii) % self._nr_slots)
+            state = atomic_load(buffer, offset)
+            if state == _READY and _SLOT.unpack_from(buffer, offset)[1] == key:
+                return self._view(offset)
+
+            if state == _EMPTY:
+                if atomic_compare_exchange(buffer, offset, _EMPTY, _CLAIMED):
+                    slot = offset
+                    break
+
+        if slot is None:
+            return arr
+
+        # Append the data, keeping everything 8-byte aligned
+        nr_bytes = (arr.nbytes + 7) & ~7
+        position = atomic_fetch_add(buffer, _NEXT_OFFSET, nr_bytes)
+        if position + arr.nbytes > self._max_size:
+            # The segment is full, the claimed slot stays unusable
+            return arr
+
+        start = self._data_offset + position
+        buffer[start:start + arr.nbytes] = arr.reshape(-1).view("u1")
+
+        shape = list(arr.shape) + [0] * (3 - arr.ndim)
+        _SLOT.pack_into(
+            buffer,
+            slot,
+            _CLAIMED,
+            key,
+            position,
+            arr.nbytes,
+            arr.dtype.str.encode(),
+            arr.ndim,
+            *shape,
+        )
+        atomic_store(buffer, slot, _READY)
+
+        return self._view(slot)
+
+    @property
+    def size(self):
+        """Return the size of the image data used so far (in bytes)."""
+        return min(atomic_load(self._shm.buf, _NEXT_OFFSET), self._max_size)
+
+    def _slot_offset(self, idx):
+        """Return the offset to the index slot `idx`."""
+        return _HEADER.size + idx * _SLOT.size
+
+    def unlink(self):
+        """Remove the shared-memory segment once every process has closed
+        it.
+        """
+        if sys.version_info < (3, 13):
+            # SharedMemory.unlink() also unregisters the segment
+            _set_tracked(self._shm, True)
+
+        self._shm.unlink()
+
+    def _view(self, offset):
+        """Return a read-only view of the image in the slot at `offset`."""
+        (
+            _, _, position, nr_bytes, dtype, ndim, *shape
+        ) = _SLOT.unpack_from(self._shm.buf, offset)
+        arr = np.ndarray(
+            shape[:ndim],
+            dtype=dtype.rstrip(b"\x00").decode(),
+            buffer=self._shm.buf,
+            offset=self._data_offset + position,
+        )
+        arr.flags.writeable = False
+
+        return arr
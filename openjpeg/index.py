@@ -0,0 +1,939 @@
+"""Index the structure of a JPEG 2000 codestream for random access."""
+
+import bisect
+from collections import namedtuple
+from io import BytesIO
+from math import ceil
+from pathlib import Path
+import struct
+
+
+# Marker codes, see 15444-1 Annex A
+_SOC = 0xFF4F
+_SIZ = 0xFF51
+_COD = 0xFF52
+_COC = 0xFF53
+_TLM = 0xFF55
+_PLM = 0xFF57
+_PLT = 0xFF58
+_POC = 0xFF5F
+_PPM = 0xFF60
+_PPT = 0xFF61
+_SOT = 0xFF90
+_SOD = 0xFF93
+_EOC = 0xFFD9
+
+# Serialised index format
+_MAGIC = b"OPJINDEX"
+_VERSION = 1
+_INDEX_HEADER = struct.Struct("<8sI3Q8I2H8BI")
+_COMPONENT = struct.Struct("<4B")
+_TILE_PART = struct.Struct("<HBQQIi")
+
+
+TilePart = namedtuple(
+    "TilePart",
+    ["tile", "part", "offset", "length", "header_length", "packet_lengths"],
+)
+TilePart.__doc__ = """A tile-part of a codestream.
+
+    Attributes
+    ----------
+    tile : int
+        The index of the tile the tile-part belongs to.
+    part : int
+        The index of the tile-part within the tile.
+    offset : int
+        The offset to the start of the SOT marker (in bytes), from the start
+        of the indexed data.
+    length : int
+        The length of the tile-part (in bytes), including the header.
+    header_length : int
+        The length of the tile-part header (in bytes), including the SOT and
+        SOD markers, or ``0`` if the header wasn't read.
+    packet_lengths : list of int or None
+        The length of each packet in the tile-part (in bytes), from the PLM or
+        PLT marker segments, or ``None`` if not known.
+"""
+
+
+class _TruncatedError(ValueError):
+    """The JPEG 2000 data ended before the part being read."""
+
+
+class _Reader(object):
+    """Random access reads from bytes, a path or a file-like."""
+    def __init__(self, src):
+        if isinstance(src, (str, Path)):
+            with open(src, "rb") as f:
+                src = f.read()
+
+        if isinstance(src, (bytes, bytearray, memoryview)):
+            src = BytesIO(src)
+
+        self._src = src
+        self.nr_reads = 0
+        self._src.seek(0, 2)
+        self.length = self._src.tell()
+
+    def read(self, offset, size):
+        """Return `size` bytes from `offset`."""
+        self._src.seek(offset)
+        data = self._src.read(size)
+        self.nr_reads += 1
+        if len(data) != size:
+            raise _TruncatedError(
+                f"Unexpected end of the JPEG 2000 data at offset {offset}"
+            )
+
+        return data
+
+
+class SparseBuffer(object):
+    """A file-like containing only some byte ranges of JPEG 2000 data.
+
+    Used to decode from data where only the byte ranges needed have been
+    fetched, such as from object storage using HTTP range requests. Reading
+    data that hasn't been added raises an exception.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        from openjpeg import SparseBuffer, decode_region
+
+        ranges = index.byte_ranges(area, reduce=2)
+        buffer = SparseBuffer()
+        for offset, length in ranges:
+            buffer.add(offset, fetch(offset, length))
+
+        arr = decode_region(buffer, area, index, reduce=2)
+
+    Parameters
+    ----------
+    length : int, optional
+        The length of the complete data (in bytes), default the end of the
+        last range that's been added.
+    """
+    def __init__(self, length=None):
+        self._length = length
+        self._offsets = []
+        self._chunks = []
+        self._position = 0
+
+    def add(self, offset, data):
+        """Add the `data` found at `offset` in the complete data.
+
+        Parameters
+        ----------
+        offset : int
+            The offset to the start of `data` (in bytes).
+        data : bytes
+            The data.
+        """
+        idx = bisect.bisect(self._offsets, offset)
+        self._offsets.insert(idx, offset)
+        self._chunks.insert(idx, bytes(data))
+
+    @property
+    def nr_bytes(self):
+        """Return the number of bytes that have been added."""
+        return sum(len(chunk) for chunk in self._chunks)
+
+    def read(self, size=-1):
+        """Return `size` bytes from the current position."""
+        offset = self._position
+        if size < 0:
+            size = self.seek(0, 2) - offset
+
+        idx = bisect.bisect(self._offsets, offset) - 1
+        if idx >= 0:
+            chunk = self._chunks[idx]
+            start = offset - self._offsets[idx]
+            if start + size <= len(chunk):
+                self._position += size
+                return chunk[start:start + size]
+
+        raise ValueError(
+            f"The sparse buffer doesn't contain the {size} bytes at offset "
+            f"{offset}"
+        )
+
+    def seek(self, offset, whence=0):
+        """Change the current position and return it."""
+        if whence == 1:
+            offset += self._position
+        elif whence == 2:
+            length = self._length
+            if length is None and self._offsets:
+                length = self._offsets[-1] + len(self._chunks[-1])
+
+            offset += length or 0
+
+        self._position = offset
+
+        return offset
+
+    def tell(self):
+        """Return the current position."""
+        return self._position
+
+
+def _find_codestream(reader):
+    """Return the (offset, length) of the codestream in the data."""
+    signature = reader.read(0, 2)
+    if signature == b"\xff\x4f":
+        return 0, reader.length
+
+    # Otherwise the codestream is in the JP2 Contiguous Codestream box
+    offset = 0
+    while offset + 8 <= reader.length:
+        length, box_type = struct.unpack(">I4s", reader.read(offset, 8))
+        header_length = 8
+        if length == 1:
+            length = struct.unpack(">Q", reader.read(offset + 8, 8))[0]
+            header_length = 16
+        elif length == 0:
+            length = reader.length - offset
+
+        if box_type == b"jp2c":
+            return offset + header_length, length - header_length
+
+        if length < header_length:
+            break
+
+        offset += length
+
+    if offset + 8 > reader.length:
+        # Ran out of boxes, the codestream may not have been received yet
+        raise _TruncatedError("No JPEG 2000 codestream found in the data")
+
+    raise ValueError("No JPEG 2000 codestream found in the data")
+
+
+def _packet_lengths(data):
+    """Return the packet lengths encoded in a PLM or PLT segment."""
+    lengths = []
+    value = 0
+    for byte in data:
+        value = (value << 7) | (byte & 0x7F)
+        if not byte & 0x80:
+            lengths.append(value)
+            value = 0
+
+    return lengths
+
+
+class CodestreamIndex(object):
+    """The structure of a JPEG 2000 codestream.
+
+    Records the image and tiling parameters from the main header and the
+    location of every tile-part (and where available every packet), so
+    that decoding part of the image only needs to read the main header and
+    the tile-parts that are required. Use :func:`build_index` to create an
+    index and :meth:`to_bytes` and :meth:`from_bytes` to store it.
+
+    .. versionadded:: 1.2
+
+    Attributes
+    ----------
+    offset : int
+        The offset to the start of the codestream (in bytes), ``0`` for a
+        J2K codestream or the start of the Contiguous Codestream box's
+        contents for JP2.
+    length : int
+        The length of the codestream (in bytes).
+    main_header_length : int
+        The length of the main header (in bytes), including the SOC marker.
+    image_area : tuple of int
+        The (x0, y0, x1, y1) of the image on the reference grid.
+    tile_size : tuple of int
+        The (width, height) of the tiles on the reference grid.
+    tile_origin : tuple of int
+        The (x0, y0) of the first tile on the reference grid.
+    components : list of tuple of int
+        The (precision, is_signed, dx, dy) of each component.
+    progression_order : int
+        The progression order, ``0`` for LRCP through to ``4`` for CPRL.
+    nr_layers : int
+        The number of quality layers.
+    nr_decompositions : int
+        The number of wavelet decomposition levels.
+    codeblock_size : tuple of int
+        The code-block (width, height).
+    precinct_sizes : list of tuple of int or None
+        The precinct (width, height) for each resolution level from the
+        lowest, or ``None`` for the maximum precinct size.
+    uses_mct : bool
+        ``True`` if the multiple component transform is used.
+    has_overrides : bool
+        ``True`` if POC, COC or PPT marker segments, or COD marker segments
+        in the tile-part headers, change the order or number of packets for
+        some tiles or components, in which case the packets needed for fewer
+        layers or resolutions aren't located and whole tile-parts are used
+        instead.
+    tile_parts : list of TilePart
+        The tile-parts, in the order they appear in the codestream.
+    """
+    def __init__(self):
+        self.offset = 0
+        self.length = 0
+        self.main_header_length = 0
+        self.image_area = (0, 0, 0, 0)
+        self.tile_size = (0, 0)
+        self.tile_origin = (0, 0)
+        self.components = []
+        self.progression_order = 0
+        self.nr_layers = 0
+        self.nr_decompositions = 0
+        self.codeblock_size = (0, 0)
+        self.precinct_sizes = None
+        self.uses_mct = False
+        self.codeblock_style = 0
+        self.transform = 0
+        self.uses_sop = False
+        self.uses_eph = False
+        self.uses_ppm = False
+        self.has_overrides = False
+        self.tile_parts = []
+
+    def byte_ranges(self, area=None, reduce=0, layers=None):
+        """Return the byte ranges needed to decode `area` with `reduce` and
+        `layers`.
+
+        The ranges cover the main header and the tiles that overlap `area`.
+        Where the packet lengths are known and the progression order puts
+        the packets that aren't needed at the end of each tile, such as
+        LRCP when decoding fewer quality layers or RLCP and RPCL when
+        discarding resolutions, only the start of each tile is included.
+        Adjacent ranges are merged.
+
+        Parameters
+        ----------
+        area : tuple of int, optional
+            The (x0, y0, x1, y1) pixel coordinates of the area, relative to
+            the image origin, default the whole image.
+        reduce : int, optional
+            The number of highest resolution levels that will be discarded,
+            default ``0``.
+        layers : int, optional
+            The number of quality layers that will be decoded, default all
+            layers.
+
+        Returns
+        -------
+        list of tuple of int
+            The (offset, length) of each byte range in the indexed data, in
+            increasing order of offset.
+        """
+        ranges = [[self.offset, self.main_header_length]]
+        for tile_part, length in self._plan(area, reduce, layers):
+            last = ranges[-1]
+            if last[0] + last[1] == tile_part.offset:
+                last[1] += length
+            else:
+                ranges.append([tile_part.offset, length])
+
+        return [tuple(r) for r in ranges]
+
+    @property
+    def columns(self):
+        """Return the width of the image (in pixels)."""
+        return self.image_area[2] - self.image_area[0]
+
+    @classmethod
+    def from_bytes(cls, data):
+        """Return a :class:`CodestreamIndex` from its serialised form.
+
+        Parameters
+        ----------
+        data : bytes
+            The serialised index from :meth:`to_bytes`.
+
+        Returns
+        -------
+        CodestreamIndex
+            The index.
+        """
+        data = memoryview(data)
+        values = _INDEX_HEADER.unpack_from(data, 0)
+        magic, version = values[:2]
+        if magic != _MAGIC:
+            raise ValueError("The data is not a serialised codestream index")
+
+        if version != _VERSION:
+            raise ValueError(f"Unsupported codestream index version {version}")
+
+        index = cls()
+        index.offset, index.length, index.main_header_length = values[2:5]
+        index.image_area = tuple(values[5:9])
+        index.tile_size = tuple(values[9:11])
+        index.tile_origin = tuple(values[11:13])
+        nr_components = values[13]
+        index.nr_layers = values[14]
+        index.progression_order = values[15]
+        index.nr_decompositions = values[16]
+        index.codeblock_size = (1 << values[17], 1 << values[18])
+        index.codeblock_style = values[19]
+        index.transform = values[20]
+        flags = values[21]
+        nr_tile_parts = values[23]
+        index.uses_mct = bool(flags & 0x01)
+        index.uses_sop = bool(flags & 0x02)
+        index.uses_eph = bool(flags & 0x04)
+        index.uses_ppm = bool(flags & 0x10)
+        index.has_overrides = bool(flags & 0x20)
+
+        offset = _INDEX_HEADER.size
+        for _ in range(nr_components):
+            index.components.append(_COMPONENT.unpack_from(data, offset))
+            offset += _COMPONENT.size
+
+        if flags & 0x08:
+            nr_resolutions = index.nr_decompositions + 1
+            sizes = data[offset:offset + nr_resolutions]
+            index.precinct_sizes = [
+                (1 << (v & 0x0F), 1 << (v >> 4)) for v in sizes
+            ]
+            offset += nr_resolutions
+
+        counts = []
+        for _ in range(nr_tile_parts):
+            tile, part, tp_offset, length, header_length, count = (
+                _TILE_PART.unpack_from(data, offset)
+            )
+            offset += _TILE_PART.size
+            index.tile_parts.append(
+                TilePart(tile, part, tp_offset, length, header_length, None)
+            )
+            counts.append(count)
+
+        for idx, count in enumerate(counts):
+            if count < 0:
+                continue
+
+            lengths = list(struct.unpack_from(f"<{count}I", data, offset))
+            offset += 4 * count
+            index.tile_parts[idx] = index.tile_parts[idx]._replace(
+                packet_lengths=lengths
+            )
+
+        return index
+
+    def _nr_packets(self, tile, reduce, layers):
+        """Return the number of packets at the start of `tile` needed to
+        decode with `reduce` and `layers`, and the total number of packets.
+        """
+        nr_resolutions = self.nr_decompositions + 1
+        nr_columns = self.tile_grid[0]
+        ix0, iy0, ix1, iy1 = self.image_area
+        tx0, ty0 = self.tile_origin
+        width, height = self.tile_size
+        x0 = max(tx0 + (tile % nr_columns) * width, ix0)
+        x1 = min(tx0 + (tile % nr_columns + 1) * width, ix1)
+        y0 = max(ty0 + (tile // nr_columns) * height, iy0)
+        y1 = min(ty0 + (tile // nr_columns + 1) * height, iy1)
+
+        # The number of precincts in each resolution, over all components,
+        #   see 15444-1 B.5 and B.6
+        precincts = [0] * nr_resolutions
+        for _, _, dx, dy in self.components:
+            cx0, cx1 = ceil(x0 / dx), ceil(x1 / dx)
+            cy0, cy1 = ceil(y0 / dy), ceil(y1 / dy)
+            for resolution in range(nr_resolutions):
+                scale = 2**(nr_resolutions - 1 - resolution)
+                rx0, rx1 = ceil(cx0 / scale), ceil(cx1 / scale)
+                ry0, ry1 = ceil(cy0 / scale), ceil(cy1 / scale)
+                if rx0 == rx1 or ry0 == ry1:
+                    continue
+
+                pw, ph = 2**15, 2**15
+                if self.precinct_sizes:
+                    pw, ph = self.precinct_sizes[resolution]
+
+                precincts[resolution] += (
+                    (ceil(rx1 / pw) - rx0 // pw) * (ceil(ry1 / ph) - ry0 // ph)
+                )
+
+        nr_layers = self.nr_layers
+        total = nr_layers * sum(precincts)
+        kept = nr_resolutions - reduce
+        if layers is not None:
+            nr_layers = min(layers, nr_layers)
+
+        if self.progression_order == 0:
+            # LRCP, up to the last kept resolution of the last layer
+            needed = (nr_layers - 1) * sum(precincts) + sum(precincts[:kept])
+        elif self.progression_order == 1:
+            # RLCP, up to the last layer of the last kept resolution
+            needed = (
+                self.nr_layers * sum(precincts[:kept - 1])
+                + nr_layers * precincts[kept - 1]
+            )
+        elif self.progression_order == 2:
+            # RPCL, every layer of the kept resolutions
+            needed = self.nr_layers * sum(precincts[:kept])
+        else:
+            # PCRL and CPRL, the packets needed are spread through the tile
+            needed = total
+
+        return needed, total
+
+    def _plan(self, area, reduce, layers):
+        """Return the (tile-part, length) of the start of each tile-part
+        needed to decode `area` with `reduce` and `layers`.
+        """
+        if not 0 <= reduce <= self.nr_decompositions:
+            raise ValueError(
+                f"'reduce' must be in the range (0, {self.nr_decompositions})"
+            )
+
+        if layers is not None and layers < 1:
+            raise ValueError("'layers' must be greater than 0")
+
+        tiles = set(self.tiles(area))
+        by_tile = {}
+        for tile_part in self.tile_parts:
+            if tile_part.tile in tiles:
+                by_tile.setdefault(tile_part.tile, []).append(tile_part)
+
+        plan = []
+        for tile_part in self.tile_parts:
+            if tile_part.tile not in tiles:
+                continue
+
+            parts = by_tile[tile_part.tile]
+            if tile_part is parts[0]:
+                # Use whole tile-parts unless every packet is located
+                remaining = None
+                if not self.has_overrides and all(
+                    tp.header_length and tp.packet_lengths is not None
+                    for tp in parts
+                ):
+                    needed, total = self._nr_packets(
+                        tile_part.tile, reduce, layers
+                    )
+                    nr_packets = sum(len(tp.packet_lengths) for tp in parts)
+                    if nr_packets == total:
+                        remaining = needed
+
+            if remaining is None:
+                plan.append((tile_part, tile_part.length))
+                continue
+
+            # Later tile-parts keep their header so the tile is complete
+            lengths = tile_part.packet_lengths[:remaining]
+            plan.append((tile_part, tile_part.header_length + sum(lengths)))
+            remaining -= len(lengths)
+
+        return plan
+
+    def read_area(self, src, area=None, reduce=0, layers=None):
+        """Return a J2K codestream containing only the data needed to decode
+        `area` with `reduce` and `layers`.
+
+        The main header is copied without any TLM or PLM marker segments,
+        which would no longer match, followed by the tile-parts of the tiles
+        that overlap `area`, truncated to the packets that are needed as
+        described in :meth:`byte_ranges`. Only the data in the byte ranges
+        from :meth:`byte_ranges` is read.
+
+        Parameters
+        ----------
+        src : str, pathlib.Path, bytes or file-like
+            The indexed JPEG 2000 data, which may be a :class:`SparseBuffer`
+            containing only the byte ranges from :meth:`byte_ranges`.
+        area : tuple of int, optional
+            The (x0, y0, x1, y1) pixel coordinates of the area, relative to
+            the image origin, default the whole image.
+        reduce : int, optional
+            The number of highest resolution levels that will be discarded,
+            default ``0``.
+        layers : int, optional
+            The number of quality layers that will be decoded, default all
+            layers.
+
+        Returns
+        -------
+        bytes
+            The codestream.
+        """
+        if self.uses_ppm:
+            raise ValueError(
+                "Codestreams with packed packet headers in the main header "
+                "can't be split into tiles"
+            )
+
+        reader = src if isinstance(src, _Reader) else _Reader(src)
+        plan = self._plan(area, reduce, layers)
+
+        header = reader.read(self.offset, self.main_header_length)
+        segments = [header[:2]]
+        offset = 2
+        while offset < len(header):
+            marker, length = struct.unpack_from(">HH", header, offset)
+            if marker not in (_TLM, _PLM):
+                segments.append(header[offset:offset + 2 + length])
+
+            offset += 2 + length
+
+        for tile_part, length in plan:
+            # Psot must match the copied length, and may have been 0 for the
+            #   last tile-part in the codestream
+            segment = bytearray(reader.read(tile_part.offset, length))
+            struct.pack_into(">I", segment, 6, length)
+            segments.append(segment)
+
+        segments.append(b"\xff\xd9")
+
+        return b"".join(segments)
+
+    @property
+    def rows(self):
+        """Return the height of the image (in pixels)."""
+        return self.image_area[3] - self.image_area[1]
+
+    @property
+    def tile_grid(self):
+        """Return the number of (columns, rows) of tiles."""
+        x0, y0, x1, y1 = self.image_area
+        tx0, ty0 = self.tile_origin
+        width, height = self.tile_size
+
+        return ceil((x1 - tx0) / width), ceil((y1 - ty0) / height)
+
+    def tiles(self, area=None):
+        """Return the indices of the tiles that overlap `area`.
+
+        Parameters
+        ----------
+        area : tuple of int, optional
+            The (x0, y0, x1, y1) pixel coordinates of the area, relative to
+            the image origin, default the whole image.
+
+        Returns
+        -------
+        list of int
+            The tile indices, in raster order.
+        """
+        nr_columns, nr_rows = self.tile_grid
+        if area is None:
+            return list(range(nr_columns * nr_rows))
+
+        x0, y0, x1, y1 = area
+        if not (0 <= x0 < x1 <= self.columns and 0 <= y0 < y1 <= self.rows):
+            raise ValueError(
+                f"Invalid 'area' value {tuple(area)}, must be within the "
+                f"image and have a non-zero size"
+            )
+
+        # Convert to the reference grid relative to the first tile
+        ix0, iy0 = self.image_area[:2]
+        tx0, ty0 = self.tile_origin
+        width, height = self.tile_size
+        first_column = (ix0 + x0 - tx0) // width
+        last_column = (ix0 + x1 - 1 - tx0) // width
+        first_row = (iy0 + y0 - ty0) // height
+        last_row = (iy0 + y1 - 1 - ty0) // height
+
+        return [
+            row * nr_columns + column
+            for row in range(first_row, last_row + 1)
+            for column in range(first_column, last_column + 1)
+        ]
+
+    def to_bytes(self):
+        """Return the index serialised as :class:`bytes`."""
+        flags = (
+            self.uses_mct
+            | self.uses_sop << 1
+            | self.uses_eph << 2
+            | (self.precinct_sizes is not None) << 3
+            | self.uses_ppm << 4
+            | self.has_overrides << 5
+        )
+        parts = [
+            _INDEX_HEADER.pack(
+                _MAGIC,
+                _VERSION,
+                self.offset,
+                self.length,
+                self.main_header_length,
+                *self.image_area,
+                *self.tile_size,
+                *self.tile_origin,
+                len(self.components),
+                self.nr_layers,
+                self.progression_order,
+                self.nr_decompositions,
+                self.codeblock_size[0].bit_length() - 1,
+                self.codeblock_size[1].bit_length() - 1,
+                self.codeblock_style,
+                self.transform,
+                flags,
+                0,
+                len(self.tile_parts),
+            )
+        ]
+        parts.extend(_COMPONENT.pack(*c) for c in self.components)
+        if self.precinct_sizes is not None:
+            parts.append(bytes(
+                (w.bit_length() - 1) | (h.bit_length() - 1) << 4
+                for w, h in self.precinct_sizes
+            ))
+
+        for tile_part in self.tile_parts:
+            lengths = tile_part.packet_lengths
+            parts.append(_TILE_PART.pack(
+                tile_part.tile,
+                tile_part.part,
+                tile_part.offset,
+                tile_part.length,
+                tile_part.header_length,
+                -1 if lengths is None else len(lengths),
+            ))
+
+        for tile_part in self.tile_parts:
+            lengths = tile_part.packet_lengths
+            if lengths:
+                parts.append(struct.pack(f"<{len(lengths)}I", *lengths))
+
+        return b"".join(parts)
+
+
+def _parse_main_header(reader, index):
+    """Parse the main header into `index` and return the tile-part lengths
+    from any TLM segments and the packet lengths from any PLM segments.
+    """
+    if reader.read(index.offset, 2) != b"\xff\x4f":
+        raise ValueError("No SOC marker found at the start of the codestream")
+
+    tlm = []
+    plm = []
+    offset = index.offset + 2
+    while True:
+        marker, length = struct.unpack(">HH", reader.read(offset, 4))
+        if marker == _SOT:
+            break
+
+        if marker >> 8 != 0xFF or length < 2:
+            raise ValueError(
+                f"Invalid marker 0x{marker:04X} in the main header at offset "
+                f"{offset}"
+            )
+
+        segment = reader.read(offset + 4, length - 2)
+        if marker == _SIZ:
+            values = struct.unpack_from(">H8IH", segment)
+            index.image_area = (values[3], values[4], values[1], values[2])
+            index.tile_size = (values[5], values[6])
+            index.tile_origin = (values[7], values[8])
+            for ii in range(values[9]):
+                ssiz, dx, dy = segment[36 + 3 * ii:39 + 3 * ii]
+                index.components.append(
+                    ((ssiz & 0x7F) + 1, ssiz >> 7, dx, dy)
+                )
+        elif marker == _COD:
+            scod = segment[0]
+            index.progression_order = segment[1]
+            index.nr_layers = struct.unpack_from(">H", segment, 2)[0]
+            index.uses_mct = bool(segment[4])
+            index.nr_decompositions = segment[5]
+            index.codeblock_size = (
+                1 << (segment[6] + 2), 1 << (segment[7] + 2)
+            )
+            index.codeblock_style = segment[8]
+            index.transform = segment[9]
+            index.uses_sop = bool(scod & 0x02)
+            index.uses_eph = bool(scod & 0x04)
+            if scod & 0x01:
+                index.precinct_sizes = [
+                    (1 << (v & 0x0F), 1 << (v >> 4)) for v in segment[10:]
+                ]
+        elif marker == _TLM:
+            stlm = segment[1]
+            size_t = (stlm >> 4) & 0x03
+            size_p = 4 if stlm & 0x40 else 2
+            entry = size_t + size_p
+            for ii in range(2, len(segment) - entry + 1, entry):
+                tile = int.from_bytes(segment[ii:ii + size_t], "big")
+                psot = int.from_bytes(segment[ii + size_t:ii + entry], "big")
+                tlm.append((tile if size_t else None, psot))
+        elif marker == _PLM:
+            # Only complete Nplm lists within a segment are supported
+            ii = 1
+            while ii < len(segment):
+                nr_bytes = segment[ii]
+                plm.append(_packet_lengths(segment[ii + 1:ii + 1 + nr_bytes]))
+                ii += 1 + nr_bytes
+        elif marker == _PPM:
+            index.uses_ppm = True
+        elif marker in (_COC, _POC):
+            index.has_overrides = True
+
+        offset += 2 + length
+
+    index.main_header_length = offset - index.offset
+
+    return tlm, plm
+
+
+def _read_tile_part_header(reader, offset, length):
+    """Return the (header length, packet lengths, has overrides) for a
+    tile-part.
+    """
+    position = offset + 12
+    packet_lengths = None
+    has_overrides = False
+    while position < offset + length:
+        marker = struct.unpack(">H", reader.read(position, 2))[0]
+        if marker == _SOD:
+            return position + 2 - offset, packet_lengths, has_overrides
+
+        segment_length = struct.unpack(">H", reader.read(position + 2, 2))[0]
+        if marker in (_COD, _COC, _POC, _PPT):
+            has_overrides = True
+        elif marker == _PLT:
+            segment = reader.read(position + 4, segment_length - 2)
+            packet_lengths = (packet_lengths or []) + _packet_lengths(
+                segment[1:]
+            )
+
+        position += 2 + segment_length
+
+    raise ValueError(
+        f"No SOD marker found in the tile-part at offset {offset}"
+    )
+
+
+def _has_headers(src):
+    """Return ``True`` if the JPEG 2000 data contains the main header and all
+    of every tile-part header it starts, ``False`` if it ends part way
+    through one of them.
+
+    Raises
+    ------
+    ValueError
+        If the headers are invalid.
+    """
+    reader = src if isinstance(src, _Reader) else _Reader(src)
+
+    index = CodestreamIndex()
+    try:
+        index.offset, index.length = _find_codestream(reader)
+        _parse_main_header(reader, index)
+
+        end = min(index.offset + index.length, reader.length)
+        offset = index.offset + index.main_header_length
+        while offset < end:
+            marker = struct.unpack(">H", reader.read(offset, 2))[0]
+            if marker == _EOC:
+                break
+
+            if marker != _SOT:
+                raise ValueError(
+                    f"Expected an SOT marker at offset {offset}, found "
+                    f"0x{marker:04X}"
+                )
+
+            length = struct.unpack(">I", reader.read(offset + 6, 4))[0]
+            # Reads past the end of the data raise _TruncatedError before
+            #   the SOD marker is missed
+            _read_tile_part_header(reader, offset, length or 2**32)
+            if length == 0:
+                # The last tile-part, which runs to the EOC marker
+                break
+
+            offset += length
+    except _TruncatedError:
+        return False
+
+    return True
+
+
+def build_index(src, packets=True):
+    """Return an index of the structure of JPEG 2000 data.
+
+    Only the main header and the tile-part headers are read. If the main
+    header has TLM marker segments, and also has PLM marker segments or
+    `packets` is ``False``, then the tile-parts are located using them
+    without reading any of the tile-part headers. Otherwise the tile-part
+    headers are read once, following the chain of SOT markers and recording
+    the packet lengths from any PLT marker segments.
+
+    .. versionadded:: 1.2
+
+    Parameters
+    ----------
+    src : str, pathlib.Path, bytes or file-like
+        The J2K codestream or JP2 file to index, if a file-like then it must
+        have ``seek()``, ``tell()`` and ``read()`` methods.
+    packets : bool, optional
+        If ``True`` (default) then record the packet lengths, which may need
+        the tile-part headers to be read.
+
+    Returns
+    -------
+    CodestreamIndex
+        The index.
+    """
+    reader = src if isinstance(src, _Reader) else _Reader(src)
+
+    index = CodestreamIndex()
+    index.offset, index.length = _find_codestream(reader)
+    tlm, plm = _parse_main_header(reader, index)
+
+    end = index.offset + index.length
+    offset = index.offset + index.main_header_length
+    if tlm and (not packets or len(plm) >= len(tlm)):
+        # No need to read any of the tile-part headers
+        nr_parts = {}
+        for idx, (tile, length) in enumerate(tlm):
+            # Tiles are in index order when Ttlm isn't used
+            tile = idx if tile is None else tile
+            part = nr_parts.get(tile, 0)
+            nr_parts[tile] = part + 1
+            packet_lengths = plm[idx] if idx < len(plm) else None
+            index.tile_parts.append(
+                TilePart(tile, part, offset, length, 0, packet_lengths)
+            )
+            offset += length
+
+        return index
+
+    while offset < end:
+        marker = struct.unpack(">H", reader.read(offset, 2))[0]
+        if marker == _EOC:
+            break
+
+        if marker != _SOT:
+            raise ValueError(
+                f"Expected an SOT marker at offset {offset}, found "
+                f"0x{marker:04X}"
+            )
+
+        sot = reader.read(offset + 4, 8)
+        tile, length, part, _ = struct.unpack(">HIBB", sot)
+        if length == 0:
+            # The last tile-part, which runs to the EOC marker
+            length = end - offset
+            if reader.read(end - 2, 2) == b"\xff\xd9":
+                length -= 2
+
+        header_length, packet_lengths, has_overrides = _read_tile_part_header(
+            reader, offset, length
+        )
+        index.has_overrides |= has_overrides
+        nr_tile_parts = len(index.tile_parts)
+        if nr_tile_parts < len(plm):
+            packet_lengths = plm[nr_tile_parts]
+
+        index.tile_parts.append(
+            TilePart(tile, part, offset, length, header_length, packet_lengths)
+        )
+        offset += length
+
+    return index
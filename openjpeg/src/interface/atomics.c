@@ -0,0 +1,73 @@
+/*
+
+Atomic operations on 64-bit values in memory shared between processes.
+
+Used by the index of the shared-memory cache of decoded images. The values
+must be 8-byte aligned. Loads use acquire and stores release ordering so that
+anything written before a store is visible to a process that loads the
+stored value.
+
+*/
+
+#include <stdint.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
+
+
+extern uint64_t AtomicLoad(uint64_t *value)
+{
+    /* Return `value` using an acquire load. */
+#ifdef _MSC_VER
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+extern void AtomicStore(uint64_t *value, uint64_t desired)
+{
+    /* Set `value` to `desired` using a release store. */
+#ifdef _MSC_VER
+    InterlockedExchange64((volatile LONG64 *)value, (LONG64)desired);
+#else
+    __atomic_store_n(value, desired, __ATOMIC_RELEASE);
+#endif
+}
+
+
+extern int AtomicCompareExchange(
+    uint64_t *value, uint64_t expected, uint64_t desired
+)
+{
+    /* Set `value` to `desired` if it's currently `expected`.
+
+    Returns
+    -------
+    int
+        1 if `value` was set, 0 otherwise.
+    */
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64(
+        (volatile LONG64 *)value, (LONG64)desired, (LONG64)expected
+    ) == (LONG64)expected;
+#else
+    return __atomic_compare_exchange_n(
+        value, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    );
+#endif
+}
+
+
+extern uint64_t AtomicFetchAdd(uint64_t *value, uint64_t amount)
+{
+    /* Add `amount` to `value` and return the original `value`. */
+#ifdef _MSC_VER
+    return (uint64_t)InterlockedExchangeAdd64(
+        (volatile LONG64 *)value, (LONG64)amount
+    );
+#else
+    return __atomic_fetch_add(value, amount, __ATOMIC_ACQ_REL);
+#endif
+}
@@ -40,6 +40,7 @@
 #include <assert.h>
 
 #include "openjpeg.h"
+#include "pool.h"
 #include "color.h"
 
 
@@ -97,7 +98,23 @@ static void sycc_to_rgb(
     *out_b = b;
 }
 
-static void sycc444_to_rgb(opj_image_t *img)
+static void release_planes(opj_image_t *img, plane_pool_t *pool)
+{
+    /* Return the Y, Cb and Cr planes of `img` to the pool */
+    size_t i;
+
+    for (i = 0U; i < 3U; ++i) {
+        pool_release(
+            pool,
+            img->comps[i].data,
+            sizeof(int) * (size_t)img->comps[i].w * (size_t)img->comps[i].h
+        );
+        img->comps[i].data = NULL;
+    }
+}
+
+
+static void sycc444_to_rgb(opj_image_t *img, plane_pool_t *pool)
 {
     int *d0, *d1, *d2, *r, *g, *b;
     const int *y, *cb, *cr;
@@ -116,9 +133,9 @@ static void sycc444_to_rgb(opj_image_t *img)
     cb = img->comps[1].data;
     cr = img->comps[2].data;
 
-    d0 = r = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d1 = g = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d2 = b = (int*)opj_image_data_alloc(sizeof(int) * max);
+    d0 = r = (int*)pool_acquire(pool, sizeof(int) * max);
+    d1 = g = (int*)pool_acquire(pool, sizeof(int) * max);
+    d2 = b = (int*)pool_acquire(pool, sizeof(int) * max);
 
     if (r == NULL || g == NULL || b == NULL) {
         goto fails;
@@ -133,23 +150,21 @@ static void sycc444_to_rgb(opj_image_t *img)
         ++g;
         ++b;
     }
-    opj_image_data_free(img->comps[0].data);
+    release_planes(img, pool);
     img->comps[0].data = d0;
-    opj_image_data_free(img->comps[1].data);
     img->comps[1].data = d1;
-    opj_image_data_free(img->comps[2].data);
     img->comps[2].data = d2;
     img->color_space = OPJ_CLRSPC_SRGB;
     return;
 
 fails:
-    opj_image_data_free(r);
-    opj_image_data_free(g);
-    opj_image_data_free(b);
+    pool_release(pool, r, sizeof(int) * max);
+    pool_release(pool, g, sizeof(int) * max);
+    pool_release(pool, b, sizeof(int) * max);
 }
 
 
-static void sycc422_to_rgb(opj_image_t *img)
+static void sycc422_to_rgb(opj_image_t *img, plane_pool_t *pool)
 {
     int *d0, *d1, *d2, *r, *g, *b;
     const int *y, *cb, *cr;
@@ -169,9 +184,9 @@ static void sycc422_to_rgb(opj_image_t *img)
     cb = img->comps[1].data;
     cr = img->comps[2].data;
 
-    d0 = r = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d1 = g = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d2 = b = (int*)opj_image_data_alloc(sizeof(int) * max);
+    d0 = r = (int*)pool_acquire(pool, sizeof(int) * max);
+    d1 = g = (int*)pool_acquire(pool, sizeof(int) * max);
+    d2 = b = (int*)pool_acquire(pool, sizeof(int) * max);
 
     if (r == NULL || g == NULL || b == NULL) {
         goto fails;
@@ -217,11 +232,9 @@ static void sycc422_to_rgb(opj_image_t *img)
         }
     }
 
-    opj_image_data_free(img->comps[0].data);
+    release_planes(img, pool);
     img->comps[0].data = d0;
-    opj_image_data_free(img->comps[1].data);
     img->comps[1].data = d1;
-    opj_image_data_free(img->comps[2].data);
     img->comps[2].data = d2;
 
     img->comps[1].w = img->comps[2].w = img->comps[0].w;
@@ -232,13 +245,13 @@ static void sycc422_to_rgb(opj_image_t *img)
     return;
 
 fails:
-    opj_image_data_free(r);
-    opj_image_data_free(g);
-    opj_image_data_free(b);
+    pool_release(pool, r, sizeof(int) * max);
+    pool_release(pool, g, sizeof(int) * max);
+    pool_release(pool, b, sizeof(int) * max);
 }
 
 
-static void sycc420_to_rgb(opj_image_t *img)
+static void sycc420_to_rgb(opj_image_t *img, plane_pool_t *pool)
 {
     int *d0, *d1, *d2, *r, *g, *b, *nr, *ng, *nb;
     const int *y, *cb, *cr, *ny;
@@ -258,9 +271,9 @@ static void sycc420_to_rgb(opj_image_t *img)
     cb = img->comps[1].data;
     cr = img->comps[2].data;
 
-    d0 = r = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d1 = g = (int*)opj_image_data_alloc(sizeof(int) * max);
-    d2 = b = (int*)opj_image_data_alloc(sizeof(int) * max);
+    d0 = r = (int*)pool_acquire(pool, sizeof(int) * max);
+    d1 = g = (int*)pool_acquire(pool, sizeof(int) * max);
+    d2 = b = (int*)pool_acquire(pool, sizeof(int) * max);
 
     if (r == NULL || g == NULL || b == NULL) {
         goto fails;
@@ -376,11 +389,9 @@ static void sycc420_to_rgb(opj_image_t *img)
         }
     }
 
-    opj_image_data_free(img->comps[0].data);
+    release_planes(img, pool);
     img->comps[0].data = d0;
-    opj_image_data_free(img->comps[1].data);
     img->comps[1].data = d1;
-    opj_image_data_free(img->comps[2].data);
     img->comps[2].data = d2;
 
     img->comps[1].w = img->comps[2].w = img->comps[0].w;
@@ -391,13 +402,13 @@ static void sycc420_to_rgb(opj_image_t *img)
     return;
 
 fails:
-    opj_image_data_free(r);
-    opj_image_data_free(g);
-    opj_image_data_free(b);
+    pool_release(pool, r, sizeof(int) * max);
+    pool_release(pool, g, sizeof(int) * max);
+    pool_release(pool, b, sizeof(int) * max);
 }
 
 
-void color_sycc_to_rgb(opj_image_t *img)
+void color_sycc_to_rgb(opj_image_t *img, plane_pool_t *pool)
 {
     if (img->numcomps < 3) {
         img->color_space = OPJ_CLRSPC_GRAY;
@@ -411,7 +422,7 @@ void color_sycc_to_rgb(opj_image_t *img)
     )
     {
         /* horizontal and vertical sub-sample */
-        sycc420_to_rgb(img);
+        sycc420_to_rgb(img, pool);
     } else if (
         (img->comps[0].dx == 1) && (img->comps[0].dy == 1)
         && (img->comps[1].dx == 2) && (img->comps[1].dy == 1)
@@ -419,7 +430,7 @@ void color_sycc_to_rgb(opj_image_t *img)
     )
     {
         /* horizontal sub-sample only */
-        sycc422_to_rgb(img);
+        sycc422_to_rgb(img, pool);
     } else if (
         (img->comps[0].dx == 1) && (img->comps[0].dy == 1)
         && (img->comps[1].dx == 1) && (img->comps[1].dy == 1)
@@ -427,7 +438,7 @@ void color_sycc_to_rgb(opj_image_t *img)
     )
     {
         /* no sub-sample */
-        sycc444_to_rgb(img);
+        sycc444_to_rgb(img, pool);
     } else {
         return;
     }
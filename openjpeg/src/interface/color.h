@@ -37,5 +37,6 @@
 
 #ifndef _OPJ_COLOR_H_
 #define _OPJ_COLOR_H_
-    extern void color_sycc_to_rgb(opj_image_t *img);
+#include "pool.h"
+    extern void color_sycc_to_rgb(opj_image_t *img, plane_pool_t *pool);
 #endif
@@ -43,15 +43,31 @@ BSD license (see the main LICENSE file).
 */
 
 #include "Python.h"
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <../openjpeg/src/lib/openjp2/openjpeg.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "openjpeg.h"
+#include "pool.h"
 #include "color.h"
+#include "messages.h"
+#include "stream.h"
+#include "pyramid.h"
 
 
 // Size of the buffer for the input stream
 #define BUFFER_SIZE OPJ_J2K_STREAM_CHUNK_SIZE
 
+// Size of the buffer for the input stream when decoding may be cancelled or
+//  has a time limit,
+//  smaller so the data for each tile is read just before it's decoded
+#define CANCELLABLE_BUFFER_SIZE 65536
+
 
 const char * OpenJpegVersion(void)
 {
@@ -293,6 +309,210 @@ static OPJ_UINT64 py_length(PyObject * stream)
 }
 
 
+// Decoding statistics
+typedef struct DecodeStats {
+    double header_time;  // creating the codec and reading the main header
+    double decode_time;  // tier-2, tier-1 and the inverse DWT
+    double colour_time;  // converting from sYCC to RGB
+    double upsample_time;  // upsampling subsampled components
+    double pack_time;  // writing the output
+    double read_time;  // inside the read, skip and seek stream callbacks
+    double total_time;  // total time spent in Decode()
+    OPJ_UINT64 bytes_read;  // number of bytes read from the stream
+    OPJ_UINT64 nr_reads;  // number of calls to the read callback
+    OPJ_UINT64 nr_skips;  // number of calls to the skip callback
+    OPJ_UINT64 nr_seeks;  // number of calls to the seek callback
+    OPJ_UINT64 peak_memory;  // peak size of the component planes (in bytes)
+} decode_stats_t;
+
+
+// Options for decoding
+typedef struct DecodeOptions {
+    int allow_partial;  // 1 to decode as much of truncated data as possible
+    int is_partial;  // set to 1 by Decode() if the data was truncated
+    const volatile int *cancel;  // if not NULL, abort once non-zero
+    double timeout;  // abort after this many seconds, 0 for no limit
+    OPJ_UINT32 area[4];  // x0, y0, x1, y1 of the area to decode, all 0 for
+                         //  the whole image, relative to the image origin
+    OPJ_UINT32 reduce;  // number of highest resolution levels to discard
+    OPJ_UINT32 layers;  // number of quality layers to decode, 0 for all
+    OPJ_UINT32 levels;  // number of lower resolution levels to also write
+    int planar;  // 1 to write each component contiguously, 0 to interleave
+    const OPJ_INT64 *strides;  // if not NULL, the row, column and component
+                               //  strides of `out` (in bytes)
+    int rescale;  // 1 to write float32 samples of value * slope + intercept
+    float slope;  // the rescale slope
+    float intercept;  // the rescale intercept
+    int window;  // 1 to write uint8 samples using a linear window, 2 to use a
+                 //  sigmoid window, 0 for no window
+    float center;  // the window center
+    float width;  // the window width
+    int layout;  // 1 to write 8-bit RGBA pixels, 2 for BGRA pixels, 0 to
+                 //  write the image components
+} decode_options_t;
+
+
+// User data for the stream
+typedef struct StreamSource {
+    PyObject *fd;  // the Python stream object, NULL to use `buffer`
+    input_buffer_t *buffer;  // the in-memory data, used if `fd` is NULL
+    decode_stats_t *stats;  // the statistics to be updated, may be NULL
+    int reached_end;  // 1 if a read was attempted at the end of the data
+    const volatile int *cancel;  // if not NULL, abort once non-zero
+    double deadline;  // abort once get_time() passes this, 0 for no limit
+    int cancelled;  // 1 if decoding has been cancelled
+    int timed_out;  // 1 if decoding was cancelled by the deadline
+} stream_source_t;
+
+
+static double get_time(void)
+{
+    /* Return the value of a monotonic clock (in seconds). */
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+
+static void record_time(double *stage, double *start)
+{
+    /* Add the time elapsed since `start` to `stage` and reset `start`. */
+    double now = get_time();
+    *stage += now - *start;
+    *start = now;
+}
+
+
+static int is_cancelled(stream_source_t *source)
+{
+    /* Return 1 if decoding has been cancelled or the deadline has passed,
+    0 otherwise.
+    */
+    if (source->cancelled)
+        return 1;
+
+    if (source->cancel && *(source->cancel))
+        source->cancelled = 1;
+
+    if (source->deadline > 0 && get_time() > source->deadline)
+    {
+        source->cancelled = 1;
+        source->timed_out = 1;
+    }
+
+    return source->cancelled;
+}
+
+
+static OPJ_SIZE_T source_read(void *destination, OPJ_SIZE_T nr_bytes, void *src)
+{
+    /* py_read() or input_read() that also updates the statistics and end of
+    data flag.
+
+    Returns -1 without reading if decoding has been cancelled, which openjpeg
+    treats as the end of the data.
+    */
+    stream_source_t *source = (stream_source_t *)src;
+    if (is_cancelled(source))
+        return (OPJ_SIZE_T)-1;
+
+    double start = source->stats ? get_time() : 0;
+    OPJ_SIZE_T result;
+    if (source->fd)
+        result = py_read(destination, nr_bytes, source->fd);
+    else
+        result = input_read(destination, nr_bytes, source->buffer);
+
+    if (result == (OPJ_SIZE_T)-1)
+        source->reached_end = 1;
+
+    if (source->stats)
+    {
+        record_time(&source->stats->read_time, &start);
+        source->stats->nr_reads++;
+        if (result != (OPJ_SIZE_T)-1)
+            source->stats->bytes_read += result;
+    }
+
+    return result;
+}
+
+
+static OPJ_BOOL source_seek_set(OPJ_OFF_T offset, void *src)
+{
+    /* py_seek_set() or input_seek() that also updates the statistics. */
+    stream_source_t *source = (stream_source_t *)src;
+    if (is_cancelled(source))
+        return OPJ_FALSE;
+
+    double start = source->stats ? get_time() : 0;
+    OPJ_BOOL result;
+    if (source->fd)
+        result = py_seek_set(offset, source->fd);
+    else
+        result = input_seek(offset, source->buffer);
+
+    if (source->stats)
+    {
+        record_time(&source->stats->read_time, &start);
+        source->stats->nr_seeks++;
+    }
+
+    return result;
+}
+
+
+static OPJ_OFF_T source_skip(OPJ_OFF_T offset, void *src)
+{
+    /* py_skip() or input_skip() that also updates the statistics. */
+    stream_source_t *source = (stream_source_t *)src;
+    if (is_cancelled(source))
+        return -1;
+
+    double start = source->stats ? get_time() : 0;
+    OPJ_OFF_T result;
+    if (source->fd)
+        result = py_skip(offset, source->fd);
+    else
+        result = input_skip(offset, source->buffer);
+
+    if (source->stats)
+    {
+        record_time(&source->stats->read_time, &start);
+        source->stats->nr_skips++;
+    }
+
+    return result;
+}
+
+
+static OPJ_UINT64 image_size(opj_image_t *image)
+{
+    /* Return the total size of the component planes of `image` (in bytes). */
+    OPJ_UINT64 size = 0;
+    for (OPJ_UINT32 ii = 0U; ii < image->numcomps; ++ii)
+    {
+        if (image->comps[ii].data)
+        {
+            size += (
+                (OPJ_UINT64)image->comps[ii].w
+                * (OPJ_UINT64)image->comps[ii].h
+                * sizeof(OPJ_INT32)
+            );
+        }
+    }
+
+    return size;
+}
+
+
 // Decoding stuff
 static void set_default_parameters(opj_decompress_parameters* parameters)
 {
@@ -326,10 +546,136 @@ typedef struct JPEG2000Parameters {
     OPJ_UINT32 precision;  // precision of the components (in bits)
     unsigned int is_signed;  // 0 for unsigned, 1 for signed
     OPJ_UINT32 nr_tiles;  // number of tiles
+    OPJ_UINT64 memory;  // estimated peak memory needed for decoding (in bytes)
 } j2k_parameters_t;
 
 
-extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *output)
+static OPJ_UINT64 reduced_length(
+    OPJ_UINT32 start, OPJ_UINT32 end, OPJ_UINT32 step, OPJ_UINT32 reduce
+)
+{
+    /* Return the number of samples covering [`start`, `end`) on the
+    reference grid for a component with sample separation `step`, with
+    `reduce` resolution levels discarded.
+    */
+    OPJ_UINT64 scale = (OPJ_UINT64)step << reduce;
+    return (end + scale - 1) / scale - (start + scale - 1) / scale;
+}
+
+
+static OPJ_UINT64 estimate_memory(
+    opj_codec_t *codec,
+    opj_image_t *image,
+    const decode_options_t *options
+)
+{
+    /* Return an estimate of the peak memory needed by Decode().
+
+    Only the large allocations are included: the decoded int32 component
+    planes, the working buffer for a single tile (when the image is tiled) and
+    the scratch planes used by the colour conversion and upsampling. The
+    output array is allocated by the caller and isn't included.
+
+    Parameters
+    ----------
+    codec : opj_codec_t *
+        The codec the main header was read with.
+    image : opj_image_t *
+        The image returned by opj_read_header().
+    options : const decode_options_t *
+        If not NULL then the `area` and `reduce` options are used to limit
+        the estimate to the part of the image that will be decoded.
+
+    Returns
+    -------
+    OPJ_UINT64
+        The estimated peak memory (in bytes).
+    */
+    const OPJ_UINT64 SAMPLE_SIZE = sizeof(OPJ_INT32);
+    // The decoded area on the reference grid
+    OPJ_UINT32 x0 = image->x0, y0 = image->y0;
+    OPJ_UINT32 x1 = image->x1, y1 = image->y1;
+    OPJ_UINT32 reduce = 0;
+    if (options)
+    {
+        const OPJ_UINT32 *area = options->area;
+        reduce = options->reduce < 31 ? options->reduce : 31;
+        if (
+            area[0] < area[2] && area[1] < area[3]
+            && area[2] <= x1 - x0 && area[3] <= y1 - y0
+        ) {
+            x0 = image->x0 + area[0];
+            y0 = image->y0 + area[1];
+            x1 = image->x0 + area[2];
+            y1 = image->y0 + area[3];
+        }
+    }
+
+    OPJ_UINT64 planes = 0;
+    OPJ_UINT64 tile = 0;
+    OPJ_UINT64 full_plane = (
+        reduced_length(x0, x1, 1, reduce)
+        * reduced_length(y0, y1, 1, reduce)
+        * SAMPLE_SIZE
+    );
+    OPJ_BOOL is_subsampled = OPJ_FALSE;
+    opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+
+    for (OPJ_UINT32 ii = 0U; ii < image->numcomps; ++ii)
+    {
+        opj_image_comp_t *comp = &(image->comps[ii]);
+        planes += (
+            reduced_length(x0, x1, comp->dx, reduce)
+            * reduced_length(y0, y1, comp->dy, reduce)
+            * SAMPLE_SIZE
+        );
+        if (comp->dx > 1U || comp->dy > 1U)
+            is_subsampled = OPJ_TRUE;
+
+        // A single tile is moved into the image, otherwise each tile is
+        //  decoded separately and then copied
+        if (info && (info->tw * info->th) > 1U)
+        {
+            tile += (
+                reduced_length(0, info->tdx, comp->dx, reduce)
+                * reduced_length(0, info->tdy, comp->dy, reduce)
+                * SAMPLE_SIZE
+            );
+        }
+    }
+
+    if (info)
+        opj_destroy_cstr_info(&info);
+
+    // Colour conversion replaces the Y, Cb and Cr planes with full sized ones
+    OPJ_UINT64 colour = 0;
+    if (
+        image->numcomps == 3
+        && (
+            image->color_space == OPJ_CLRSPC_SYCC
+            || (image->comps[0].dx == image->comps[0].dy
+                && image->comps[1].dx != 1)
+        )
+    ) {
+        colour = 3 * full_plane;
+    }
+
+    // Upsampling copies every component to a new full sized plane
+    OPJ_UINT64 upsample = 0;
+    if (is_subsampled)
+        upsample = image->numcomps * full_plane;
+
+    return planes + tile + (colour > upsample ? colour : upsample);
+}
+
+
+extern int GetParameters(
+    PyObject* fd,
+    int codec_format,
+    j2k_parameters_t *output,
+    const decode_options_t *options,
+    codec_messages_t *messages
+)
 {
     /* Decode a JPEG 2000 header for the image meta data.
 
@@ -344,6 +690,12 @@ extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *outpu
         * ``2`` - OPJ_CODEC_JP2 : JP2 file format
     output : j2k_parameters_t *
         The struct where the parameters will be stored.
+    options : const decode_options_t *
+        If not NULL then the decoding options used to estimate the memory
+        needed, only `options->area` and `options->reduce` are used.
+    messages : codec_messages_t *
+        If not NULL then the openjpeg error, warning and info messages will
+        be written to it.
 
     Returns
     -------
@@ -359,6 +711,7 @@ extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *outpu
     // Setup decompression parameters
     opj_decompress_parameters parameters;
     set_default_parameters(&parameters);
+    clear_messages(messages);
 
     int error_code = EXIT_FAILURE;
 
@@ -380,6 +733,7 @@ extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *outpu
     opj_stream_set_user_data_length(stream, py_length(fd));
 
     codec = opj_create_decompress(codec_format);
+    set_message_handlers(codec, messages);
 
     /* Setup the decoder parameters */
     if (!opj_setup_decoder(codec, &(parameters.core)))
@@ -404,6 +758,7 @@ extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *outpu
     output->precision = (int)image->comps[0].prec;
     output->is_signed = (int)image->comps[0].sgnd;
     output->nr_tiles = parameters.nb_tile_to_decode;
+    output->memory = estimate_memory(codec, image, options);
 
     destroy_parameters(&parameters);
     opj_destroy_codec(codec);
@@ -425,9 +780,39 @@ extern int GetParameters(PyObject* fd, int codec_format, j2k_parameters_t *outpu
 }
 
 
-static opj_image_t* upsample_image_components(opj_image_t* original)
+static void destroy_image(opj_image_t *image, plane_pool_t *pool)
 {
-    // Basically a straight copy from opj_decompress.c
+    /* Return the component planes of `image` to `pool` and free the image.
+
+    Parameters
+    ----------
+    image : opj_image_t *
+        The image to be destroyed.
+    pool : plane_pool_t *
+        The pool the component planes should be returned to, if NULL then
+        the planes are freed.
+    */
+    for (OPJ_UINT32 ii = 0U; ii < image->numcomps; ++ii)
+    {
+        opj_image_comp_t* comp = &(image->comps[ii]);
+        pool_release(
+            pool,
+            comp->data,
+            sizeof(OPJ_INT32) * (size_t)comp->w * (size_t)comp->h
+        );
+        comp->data = NULL;
+    }
+
+    opj_image_destroy(image);
+}
+
+
+static opj_image_t* upsample_image_components(
+    opj_image_t* original, plane_pool_t* pool
+)
+{
+    // Basically a straight copy from opj_decompress.c, except that the
+    // planes for the new image are taken from `pool` (if available)
     opj_image_t* l_new_image = NULL;
     opj_image_cmptparm_t* l_new_components = NULL;
     OPJ_BOOL upsample = OPJ_FALSE;
@@ -453,7 +838,7 @@ static opj_image_t* upsample_image_components(opj_image_t* original)
     );
     if (l_new_components == NULL) {
         // Failed to allocate memory for component parameters
-        opj_image_destroy(original);
+        destroy_image(original, pool);
         return NULL;
     }
 
@@ -484,17 +869,34 @@ static opj_image_t* upsample_image_components(opj_image_t* original)
         }
     }
 
-    l_new_image = opj_image_create(
+    // Create the image without any component data, every sample of the new
+    // planes is written below so they don't need to be zeroed
+    l_new_image = opj_image_tile_create(
         original->numcomps, l_new_components, original->color_space
     );
     free(l_new_components);
 
     if (l_new_image == NULL) {
         // Failed to allocate memory for image
-        opj_image_destroy(original);
+        destroy_image(original, pool);
         return NULL;
     }
 
+    for (ii = 0U; ii < l_new_image->numcomps; ++ii)
+    {
+        opj_image_comp_t* l_new_cmp = &(l_new_image->comps[ii]);
+        l_new_cmp->data = (OPJ_INT32*)pool_acquire(
+            pool,
+            sizeof(OPJ_INT32) * (size_t)l_new_cmp->w * (size_t)l_new_cmp->h
+        );
+        if (l_new_cmp->data == NULL) {
+            // Failed to allocate memory for the component data
+            destroy_image(original, pool);
+            destroy_image(l_new_image, pool);
+            return NULL;
+        }
+    }
+
     l_new_image->x0 = original->x0;
     l_new_image->x1 = original->x1;
     l_new_image->y0 = original->y0;
@@ -522,8 +924,8 @@ static opj_image_t* upsample_image_components(opj_image_t* original)
             // Invalid components found
             if ((xoff >= l_org_cmp->dx) || (yoff >= l_org_cmp->dy))
             {
-                opj_image_destroy(original);
-                opj_image_destroy(l_new_image);
+                destroy_image(original, pool);
+                destroy_image(l_new_image, pool);
                 return NULL;
             }
 
@@ -621,19 +1023,387 @@ static opj_image_t* upsample_image_components(opj_image_t* original)
         }
     }
 
-    opj_image_destroy(original);
+    destroy_image(original, pool);
     return l_new_image;
 }
 
 
-extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
+static void get_output_strides(
+    decode_options_t *options,
+    OPJ_UINT32 width,
+    OPJ_UINT32 height,
+    OPJ_UINT32 nr_components,
+    OPJ_INT64 nr_bytes,
+    OPJ_INT64 strides[3]
+)
+{
+    /* Set `strides` to the row, column and component strides of the output
+    (in bytes) for samples of `nr_bytes`.
+    */
+    if (options && options->strides)
+    {
+        memcpy(strides, options->strides, 3 * sizeof(OPJ_INT64));
+    }
+    else if (options && options->planar)
+    {
+        strides[0] = width * nr_bytes;
+        strides[1] = nr_bytes;
+        strides[2] = (OPJ_INT64)width * height * nr_bytes;
+    }
+    else
+    {
+        strides[0] = (OPJ_INT64)width * nr_components * nr_bytes;
+        strides[1] = nr_components * nr_bytes;
+        strides[2] = nr_bytes;
+    }
+}
+
+
+static unsigned char * get_window_lut(
+    decode_options_t *options,
+    OPJ_UINT32 precision,
+    OPJ_UINT32 is_signed
+)
+{
+    /* Return a lookup table from each possible sample value to its windowed
+    uint8 value, or NULL if the allocation failed. Must be freed by the
+    caller.
+
+    The sample values are first rescaled (if required) then windowed using
+    the VOI LUT function from the DICOM Standard, Part 3, C.11.2.1.2 and
+    C.11.2.1.3.1, with an output range of (0, 255).
+    */
+    size_t nr_entries = (size_t)1 << precision;
+    unsigned char *lut = malloc(nr_entries);
+    if (!lut)
+        return NULL;
+
+    OPJ_INT32 minimum = is_signed ? -(1 << (precision - 1)) : 0;
+    const float center = options->center;
+    const float width = options->width;
+    for (size_t idx = 0; idx < nr_entries; idx++)
+    {
+        float x = (float)(minimum + (OPJ_INT32)idx);
+        if (options->rescale)
+            x = x * options->slope + options->intercept;
+
+        float y;
+        if (options->window == 2)
+        {
+            // SIGMOID
+            y = 255.0f / (1.0f + expf(-4.0f * (x - center) / width));
+        }
+        else if (x <= center - 0.5f - (width - 1.0f) / 2.0f)
+        {
+            y = 0.0f;
+        }
+        else if (x > center - 0.5f + (width - 1.0f) / 2.0f)
+        {
+            y = 255.0f;
+        }
+        else
+        {
+            // LINEAR
+            y = ((x - (center - 0.5f)) / (width - 1.0f) + 0.5f) * 255.0f;
+        }
+
+        y = y < 0.0f ? 0.0f : (y > 255.0f ? 255.0f : y);
+        lut[idx] = (unsigned char)(y + 0.5f);
+    }
+
+    return lut;
+}
+
+
+static int pack_rgba(
+    opj_image_t *image,
+    decode_options_t *options,
+    unsigned char *out
+)
 {
-    /* Decode JPEG 2000 data.
+    /* Write the decoded `image` to `out` as 8-bit RGBA or BGRA pixels.
+
+    The first three components not marked as alpha are used for the red,
+    green and blue samples, or if there are fewer than three then the first
+    is replicated to all three, such as for grayscale. Signed colour samples
+    are offset so the minimum value is 0. The alpha sample is from the first
+    component marked as alpha, scaled to 8-bits, or 255 (opaque) if there's
+    none.
 
     Parameters
     ----------
-    fd : PyObject *
-        The Python stream object containing the JPEG 2000 data to be decoded.
+    image : opj_image_t *
+        The decoded image, with every component at full size.
+    options : decode_options_t *
+        The decoding options, `options->layout` is 1 for RGBA and 2 for
+        BGRA. If `options->window` is used then the colour samples are
+        windowed, otherwise they must have a precision of 8 or less.
+    out : unsigned char *
+        Where to write the pixels.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    OPJ_UINT32 colour[3] = {0, 0, 0};
+    OPJ_UINT32 nr_colour = 0;
+    int alpha = -1;
+    for (OPJ_UINT32 ii = 0; ii < image->numcomps; ii++)
+    {
+        if (image->comps[ii].alpha)
+        {
+            if (alpha < 0)
+                alpha = (int)ii;
+        }
+        else if (nr_colour < 3)
+        {
+            colour[nr_colour] = ii;
+            nr_colour++;
+        }
+    }
+
+    // Grayscale is replicated to RGB
+    if (nr_colour < 3)
+        colour[1] = colour[2] = colour[0];
+
+    // Alpha samples are scaled to 8-bits, down by shifting or up by
+    //  multiplying so the maximum value is 255
+    OPJ_UINT32 alpha_precision = alpha >= 0 ? image->comps[alpha].prec : 8;
+    if (alpha_precision > 16)
+        return 7;
+
+    OPJ_INT32 alpha_last = (1 << alpha_precision) - 1;
+    OPJ_UINT32 shift = alpha_precision > 8 ? alpha_precision - 8 : 0;
+
+    OPJ_UINT32 precision = image->comps[colour[0]].prec;
+    OPJ_UINT32 is_signed = image->comps[colour[0]].sgnd;
+    unsigned char *lut = NULL;
+    if (options->window)
+    {
+        if (precision > 16)
+            return 7;
+
+        lut = get_window_lut(options, precision, is_signed);
+        if (!lut)
+            return 12;
+    }
+    else if (precision > 8)
+    {
+        return 13;
+    }
+
+    // The output sample for each of the colour components
+    int channels[3] = {0, 1, 2};
+    if (options->layout == 2)
+    {
+        channels[0] = 2;
+        channels[2] = 0;
+    }
+
+    OPJ_INT32 minimum = is_signed ? -(1 << (precision - 1)) : 0;
+    OPJ_INT32 last = (1 << precision) - 1;
+
+    OPJ_UINT32 width = image->comps[0].w;
+    OPJ_UINT32 height = image->comps[0].h;
+    OPJ_INT64 strides[3];
+    get_output_strides(options, width, height, 4, 1, strides);
+    size_t idx = 0;
+    for (OPJ_UINT32 row = 0; row < height; row++)
+    {
+        unsigned char *dst = out + row * strides[0];
+        for (OPJ_UINT32 col = 0; col < width; col++)
+        {
+            for (int cc = 0; cc < 3; cc++)
+            {
+                OPJ_INT32 value = image->comps[colour[cc]].data[idx];
+                value -= minimum;
+                value = value < 0 ? 0 : (value > last ? last : value);
+                if (lut)
+                    value = lut[value];
+
+                dst[channels[cc] * strides[2]] = (unsigned char)value;
+            }
+
+            OPJ_INT32 value = 255;
+            if (alpha >= 0)
+            {
+                value = image->comps[alpha].data[idx];
+                value = value < 0 ? 0 : (value > alpha_last ? alpha_last : value);
+                if (shift)
+                    value >>= shift;
+                else if (alpha_precision < 8)
+                    value = value * 255 / alpha_last;
+            }
+            dst[3 * strides[2]] = (unsigned char)value;
+
+            dst += strides[1];
+            idx++;
+        }
+    }
+
+    free(lut);
+
+    return 0;
+}
+
+
+static void pack_clipped(
+    OPJ_INT32 **planes,
+    OPJ_UINT32 nr_components,
+    OPJ_UINT32 width,
+    OPJ_UINT32 height,
+    OPJ_UINT32 precision,
+    OPJ_UINT32 is_signed,
+    int planar,
+    unsigned char *out
+)
+{
+    /* Write the component `planes` to `out` as for the decoded image,
+    clipping the samples to the range allowed by `precision`.
+    */
+    OPJ_INT32 minimum = is_signed ? -(1 << (precision - 1)) : 0;
+    OPJ_INT32 maximum = is_signed ? (1 << (precision - 1)) - 1 : (1 << precision) - 1;
+    size_t nr_samples = (size_t)width * height;
+    size_t nr_bytes = precision > 8 ? 2 : 1;
+    // The distance between consecutive samples of a component and between
+    //  the first samples of each component
+    size_t sample_step = planar ? nr_bytes : nr_bytes * nr_components;
+    size_t component_step = planar ? nr_bytes * nr_samples : nr_bytes;
+    for (OPJ_UINT32 ii = 0; ii < nr_components; ii++)
+    {
+        unsigned char *dst = out + ii * component_step;
+        for (size_t idx = 0; idx < nr_samples; idx++)
+        {
+            OPJ_INT32 value = planes[ii][idx];
+            value = value < minimum ? minimum : value;
+            value = value > maximum ? maximum : value;
+            dst[0] = (unsigned char)value;
+            // Little endian output
+            if (precision > 8)
+                dst[1] = (unsigned char)((unsigned short)value >> 8);
+
+            dst += sample_step;
+        }
+    }
+}
+
+
+static int write_pyramid(
+    opj_codec_t *codec,
+    opj_image_t *image,
+    OPJ_UINT32 levels,
+    int planar,
+    unsigned char *out
+)
+{
+    /* Write `levels` lower resolution levels of the decoded `image` to `out`.
+
+    Each level is half the width and height of the level above (rounding
+    up) and is written in the same way as the image.
+
+    Parameters
+    ----------
+    codec : opj_codec_t *
+        The codec used to decode `image`.
+    image : opj_image_t *
+        The decoded image, with every component at full size.
+    levels : OPJ_UINT32
+        The number of levels to write.
+    planar : int
+        1 to write each component contiguously, 0 to interleave them.
+    out : unsigned char *
+        Where to write the levels, directly after the image.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+    if (!info)
+        return 11;
+
+    tile_grid_t grid = {
+        info->tx0, info->ty0, info->tdx, info->tdy, info->tw, info->th
+    };
+    opj_destroy_cstr_info(&info);
+
+    const OPJ_UINT32 NR_COMPONENTS = image->numcomps;
+    OPJ_UINT32 precision = image->comps[0].prec;
+    OPJ_UINT32 nr_bytes = precision > 8 ? 2 : 1;
+    OPJ_UINT32 area[4] = {image->x0, image->y0, image->x1, image->y1};
+    OPJ_INT32 **planes = calloc(NR_COMPONENTS, sizeof(OPJ_INT32 *));
+    if (!planes)
+        return 11;
+
+    int error_code = 0;
+    for (OPJ_UINT32 level = 0; level < levels && !error_code; level++)
+    {
+        for (OPJ_UINT32 ii = 0; ii < NR_COMPONENTS; ii++)
+        {
+            // The first level is reduced from the decoded image
+            const OPJ_INT32 *plane = level ? planes[ii] : image->comps[ii].data;
+            OPJ_INT32 *reduced = reduce_plane(plane, area, &grid, level);
+            if (level)
+                free(planes[ii]);
+
+            planes[ii] = reduced;
+            if (!reduced)
+                error_code = 11;
+        }
+
+        for (int jj = 0; jj < 4; jj++)
+            area[jj] = (area[jj] + 1) >> 1;
+
+        if (error_code)
+            break;
+
+        OPJ_UINT32 width = area[2] - area[0];
+        OPJ_UINT32 height = area[3] - area[1];
+        pack_clipped(
+            planes,
+            NR_COMPONENTS,
+            width,
+            height,
+            precision,
+            image->comps[0].sgnd,
+            planar,
+            out
+        );
+        out += (size_t)width * height * NR_COMPONENTS * nr_bytes;
+    }
+
+    if (levels)
+    {
+        for (OPJ_UINT32 ii = 0; ii < NR_COMPONENTS; ii++)
+            free(planes[ii]);
+    }
+    free(planes);
+
+    return error_code;
+}
+
+
+static int decode_source(
+    stream_source_t *source,
+    OPJ_UINT64 length,
+    unsigned char *out,
+    int codec_format,
+    decode_options_t *options,
+    plane_pool_t *pool,
+    decode_stats_t *stats,
+    codec_messages_t *messages
+)
+{
+    /* Decode the JPEG 2000 data read from `source`.
+
+    Parameters
+    ----------
+    source : stream_source_t *
+        The source of the JPEG 2000 data to be decoded.
+    length : OPJ_UINT64
+        The length of the data (in bytes).
     out : unsigned char *
         The numpy ndarray of uint8 where the decoded image data will be written
     codec_format : int
@@ -641,6 +1411,39 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
         * ``0`` - OPJ_CODEC_J2K : JPEG-2000 codestream
         * ``1`` - OPJ_CODEC_JPT : JPT-stream (JPEG 2000, JPIP)
         * ``2`` - OPJ_CODEC_JP2 : JP2 file format
+    options : decode_options_t *
+        The decoding options, may be NULL to use the defaults. If
+        `options->allow_partial` is 1 then truncated data will be decoded as
+        far as possible and `options->is_partial` set to 1. If
+        `options->cancel` is not NULL then decoding will be aborted once it
+        becomes non-zero, and if `options->timeout` is greater than 0 then
+        decoding will be aborted after that many seconds. Both are checked
+        whenever data is read (so between tiles) and between the decoding
+        stages. If `options->area` isn't all 0 then only that area of the
+        image will be decoded, and `options->reduce` and `options->layers`
+        limit the resolution levels and quality layers that are decoded. If
+        `options->levels` is greater than 0 then that many lower resolution
+        levels of the image are written to `out` after the image itself. If
+        `options->planar` is 1 then each component is written contiguously
+        rather than interleaved. If `options->strides` is not NULL then each
+        sample is written to `out` using the row, column and component
+        strides, which may be negative, and `options->planar` and
+        `options->levels` are ignored. If `options->rescale` is 1 then float32
+        samples are written with `options->slope` and `options->intercept`
+        applied, and `options->levels` is ignored. If `options->window` is 1
+        or 2 then uint8 samples are written using the linear or sigmoid VOI
+        LUT function with `options->center` and `options->width` instead,
+        after applying any rescale. If `options->layout` is 1 or 2 then
+        8-bit RGBA or BGRA pixels are written, see pack_rgba().
+    pool : plane_pool_t *
+        The pool used to recycle the component planes between calls, may be
+        NULL.
+    stats : decode_stats_t *
+        If not NULL then the timing and stream statistics for the decode will
+        be written to it. Any existing values will be overwritten.
+    messages : codec_messages_t *
+        If not NULL then the openjpeg error, warning and info messages will
+        be written to it.
 
     Returns
     -------
@@ -658,11 +1461,32 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
     set_default_parameters(&parameters);
     // Array of pointers to the first element of each component
     int **p_component = NULL;
+    // Start times for the statistics
+    double decode_start = 0;
+    double stage_start = 0;
+    OPJ_UINT64 planes_size = 0;
+    clear_messages(messages);
 
     int error_code = EXIT_FAILURE;
 
+    if (stats)
+    {
+        memset(stats, 0, sizeof(decode_stats_t));
+        decode_start = stage_start = get_time();
+    }
+
+    if (options)
+    {
+        source->cancel = options->cancel;
+        if (options->timeout > 0)
+            source->deadline = get_time() + options->timeout;
+    }
+
     // Creates an abstract input stream; allocates memory
-    stream = opj_stream_create(BUFFER_SIZE, OPJ_TRUE);
+    int is_cancellable = source->cancel || source->deadline > 0;
+    stream = opj_stream_create(
+        is_cancellable ? CANCELLABLE_BUFFER_SIZE : BUFFER_SIZE, OPJ_TRUE
+    );
 
     if (!stream)
     {
@@ -672,15 +1496,28 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
     }
 
     // Functions for the stream
-    opj_stream_set_read_function(stream, py_read);
-    opj_stream_set_skip_function(stream, py_skip);
-    opj_stream_set_seek_function(stream, py_seek_set);
-    opj_stream_set_user_data(stream, fd, NULL);
-    opj_stream_set_user_data_length(stream, py_length(fd));
-
-    //opj_set_error_handler(codec, j2k_error, 00);
+    opj_stream_set_read_function(stream, source_read);
+    opj_stream_set_skip_function(stream, source_skip);
+    opj_stream_set_seek_function(stream, source_seek_set);
+    opj_stream_set_user_data(stream, source, NULL);
+    opj_stream_set_user_data_length(stream, length);
 
     codec = opj_create_decompress(codec_format);
+    set_message_handlers(codec, messages);
+
+    int allow_partial = options && options->allow_partial;
+    if (options)
+        options->is_partial = 0;
+
+    // By default openjpeg rejects truncated data
+    if (allow_partial)
+        opj_decoder_set_strict_mode(codec, OPJ_FALSE);
+
+    if (options)
+    {
+        parameters.core.cp_reduce = options->reduce;
+        parameters.core.cp_layer = options->layers;
+    }
 
     /* Setup the decoder parameters */
     if (!opj_setup_decoder(codec, &(parameters.core)))
@@ -713,6 +1550,14 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
         }
     }
 
+    if (options && options->area[2] && options->area[3])
+    {
+        parameters.DA_x0 = image->x0 + options->area[0];
+        parameters.DA_y0 = image->y0 + options->area[1];
+        parameters.DA_x1 = image->x0 + options->area[2];
+        parameters.DA_y1 = image->y0 + options->area[3];
+    }
+
     if (!opj_set_decode_area(
             codec, image,
             (OPJ_INT32)parameters.DA_x0,
@@ -726,14 +1571,52 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
         goto failure;
     }
 
+    if (stats)
+        record_time(&stats->header_time, &stage_start);
+
+    if (is_cancelled(source))
+    {
+        // decoding was cancelled
+        error_code = 9;
+        goto failure;
+    }
+
     /* Get the decoded image */
-    if (!(opj_decode(codec, stream, image) && opj_end_decompress(codec, stream)))
+    OPJ_BOOL is_decoded = opj_decode(codec, stream, image);
+    if (is_cancelled(source))
+    {
+        // decoding was cancelled, openjpeg saw the end of the data
+        error_code = 9;
+        goto failure;
+    }
+
+    if (!is_decoded)
+    {
+        // failed to decode image
+        error_code = 6;
+        goto failure;
+    }
+
+    // Running out of data while decoding means the data was truncated, any
+    //  missing code-blocks, layers or tiles are left as zero
+    if (allow_partial && source->reached_end)
+    {
+        options->is_partial = 1;
+    }
+    else if (!opj_end_decompress(codec, stream))
     {
         // failed to decode image
         error_code = 6;
         goto failure;
     }
 
+    if (stats)
+    {
+        record_time(&stats->decode_time, &stage_start);
+        planes_size = image_size(image);
+        stats->peak_memory = planes_size;
+    }
+
     // Convert colour space (if required)
     if (
         image->color_space != OPJ_CLRSPC_SYCC
@@ -746,17 +1629,49 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
 
     if (image->color_space == OPJ_CLRSPC_SYCC)
     {
-        color_sycc_to_rgb(image);
+        color_sycc_to_rgb(image, pool);
+
+        if (stats)
+        {
+            // The original planes are only freed after conversion
+            record_time(&stats->colour_time, &stage_start);
+            if (image->color_space != OPJ_CLRSPC_SYCC)
+            {
+                OPJ_UINT64 converted_size = image_size(image);
+                if (planes_size + converted_size > stats->peak_memory)
+                    stats->peak_memory = planes_size + converted_size;
+                planes_size = converted_size;
+            }
+        }
+    }
+
+    if (is_cancelled(source))
+    {
+        // decoding was cancelled
+        error_code = 9;
+        goto failure;
     }
 
     /* Upsample components (if required) */
-    image = upsample_image_components(image);
+    opj_image_t *original = image;
+    image = upsample_image_components(image, pool);
     if (image == NULL) {
         // failed to upsample image
         error_code = 8;
         goto failure;
     }
 
+    if (stats)
+    {
+        record_time(&stats->upsample_time, &stage_start);
+        if (image != original)
+        {
+            OPJ_UINT64 upsampled_size = image_size(image);
+            if (planes_size + upsampled_size > stats->peak_memory)
+                stats->peak_memory = planes_size + upsampled_size;
+        }
+    }
+
     // Set our component pointers
     const unsigned int NR_COMPONENTS = image->numcomps;  // 15444-1 A.5.1
     p_component = malloc(NR_COMPONENTS * sizeof(int *));
@@ -769,13 +1684,138 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
     int width = (int)image->comps[0].w;
     int height = (int)image->comps[0].h;
     int precision = (int)image->comps[0].prec;
+    size_t nr_samples = (size_t)width * height;
 
-    // Our output should have planar configuration of 0, i.e. for RGB data
-    //  we have R1, B1, G1 | R2, G2, B2 | ..., where 1 is the first pixel,
-    //  2 the second, etc
+    // By default our output has planar configuration of 0, i.e. for RGB
+    //  data we have R1, B1, G1 | R2, G2, B2 | ..., where 1 is the first
+    //  pixel, 2 the second, etc, otherwise a planar configuration of 1 with
+    //  R1, R2, ... | G1, G2, ... | B1, B2, ...
     // See DICOM Standard, Part 3, Annex C.7.6.3.1.3
     unsigned int row, col, ii;
-    if (precision <= 8)
+    if (options && options->layout)
+    {
+        error_code = pack_rgba(image, options, out);
+        if (error_code)
+            goto failure;
+    }
+    else if (options && options->window && precision <= 16)
+    {
+        // uint8 samples, windowed using a lookup table
+        unsigned char *lut = get_window_lut(
+            options, precision, image->comps[0].sgnd
+        );
+        if (!lut)
+        {
+            error_code = 12;
+            goto failure;
+        }
+
+        OPJ_INT64 strides[3];
+        get_output_strides(options, width, height, NR_COMPONENTS, 1, strides);
+        OPJ_INT32 minimum = image->comps[0].sgnd ? -(1 << (precision - 1)) : 0;
+        OPJ_INT32 last = (1 << precision) - 1;
+        for (ii = 0; ii < NR_COMPONENTS; ii++)
+        {
+            const OPJ_INT32 *src = p_component[ii];
+            for (row = 0; row < height; row++)
+            {
+                unsigned char *dst = out + row * strides[0] + ii * strides[2];
+                for (col = 0; col < width; col++)
+                {
+                    OPJ_INT32 idx = *src - minimum;
+                    idx = idx < 0 ? 0 : (idx > last ? last : idx);
+                    *dst = lut[idx];
+                    dst += strides[1];
+                    src++;
+                }
+            }
+        }
+
+        free(lut);
+    }
+    else if (options && options->window)
+    {
+        // Support for more than 16-bits per component is not implemented
+        error_code = 7;
+        goto failure;
+    }
+    else if (options && options->rescale)
+    {
+        // float32 samples, with the rescale slope and intercept applied
+        OPJ_INT64 strides[3];
+        get_output_strides(options, width, height, NR_COMPONENTS, 4, strides);
+        const float slope = options->slope;
+        const float intercept = options->intercept;
+        for (ii = 0; ii < NR_COMPONENTS; ii++)
+        {
+            const OPJ_INT32 *src = p_component[ii];
+            for (row = 0; row < height; row++)
+            {
+                unsigned char *dst = out + row * strides[0] + ii * strides[2];
+                for (col = 0; col < width; col++)
+                {
+                    float value = (float)(*src) * slope + intercept;
+                    memcpy(dst, &value, sizeof(float));
+                    dst += strides[1];
+                    src++;
+                }
+            }
+        }
+    }
+    else if (options && options->strides && precision <= 16)
+    {
+        // Write to a destination with arbitrary strides, such as a view
+        //  of a larger array
+        const OPJ_INT64 *strides = options->strides;
+        for (ii = 0; ii < NR_COMPONENTS; ii++)
+        {
+            const OPJ_INT32 *src = p_component[ii];
+            for (row = 0; row < height; row++)
+            {
+                unsigned char *dst = out + row * strides[0] + ii * strides[2];
+                for (col = 0; col < width; col++)
+                {
+                    dst[0] = (unsigned char)(*src);
+                    // Little endian output
+                    if (precision > 8)
+                        dst[1] = (unsigned char)((unsigned short)(*src) >> 8);
+
+                    dst += strides[1];
+                    src++;
+                }
+            }
+        }
+    }
+    else if (options && options->planar && precision <= 16)
+    {
+        // Each component plane is copied as a whole
+        for (ii = 0; ii < NR_COMPONENTS; ii++)
+        {
+            const OPJ_INT32 *src = p_component[ii];
+            if (precision <= 8)
+            {
+                // 8-bit signed/unsigned
+                for (size_t idx = 0; idx < nr_samples; idx++)
+                    out[idx] = (unsigned char)src[idx];
+
+                out += nr_samples;
+            }
+            else
+            {
+                // 16-bit signed/unsigned, little endian output
+                for (size_t idx = 0; idx < nr_samples; idx++)
+                {
+                    out[2 * idx] = (unsigned char)src[idx];
+                    out[2 * idx + 1] = (unsigned char)(
+                        (unsigned short)src[idx] >> 8
+                    );
+                }
+
+                out += 2 * nr_samples;
+            }
+        }
+    }
+    else if (precision <= 8)
     {
         // 8-bit signed/unsigned
         for (row = 0; row < height; row++)
@@ -823,6 +1863,29 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
         goto failure;
     }
 
+    // The lower resolution levels follow a contiguous integer image
+    if (
+        options
+        && options->levels
+        && !options->strides
+        && !options->rescale
+        && !options->window
+        && !options->layout
+    )
+    {
+        error_code = write_pyramid(
+            codec, image, options->levels, options->planar, out
+        );
+        if (error_code)
+            goto failure;
+    }
+
+    if (stats)
+    {
+        record_time(&stats->pack_time, &stage_start);
+        stats->total_time = get_time() - decode_start;
+    }
+
     if (p_component)
     {
         free(p_component);
@@ -830,12 +1893,16 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
     }
     destroy_parameters(&parameters);
     opj_destroy_codec(codec);
-    opj_image_destroy(image);
+    destroy_image(image, pool);
     opj_stream_destroy(stream);
 
     return EXIT_SUCCESS;
 
     failure:
+        // Reading stops once cancelled, so any failure is due to that
+        if (source->cancelled)
+            error_code = source->timed_out ? 10 : 9;
+
         if (p_component)
         {
             free(p_component);
@@ -844,10 +1911,82 @@ extern int Decode(PyObject* fd, unsigned char *out, int codec_format)
         destroy_parameters(&parameters);
         if (codec)
             opj_destroy_codec(codec);
+        // Don't recycle the planes of a failed decode
         if (image)
-            opj_image_destroy(image);
+            destroy_image(image, NULL);
         if (stream)
             opj_stream_destroy(stream);
 
         return error_code;
 }
+
+
+extern int Decode(
+    PyObject* fd,
+    unsigned char *out,
+    int codec_format,
+    decode_options_t *options,
+    plane_pool_t *pool,
+    decode_stats_t *stats,
+    codec_messages_t *messages
+)
+{
+    /* Decode JPEG 2000 data from a Python file-like.
+
+    Parameters
+    ----------
+    fd : PyObject *
+        The Python stream object containing the JPEG 2000 data to be decoded.
+
+    See decode_source() for the other parameters.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    stream_source_t source = {fd, NULL, stats, 0, NULL, 0, 0, 0};
+
+    return decode_source(
+        &source, py_length(fd), out, codec_format, options, pool, stats, messages
+    );
+}
+
+
+extern int DecodeBuffer(
+    const unsigned char *src,
+    size_t length,
+    unsigned char *out,
+    int codec_format,
+    decode_options_t *options,
+    plane_pool_t *pool,
+    decode_stats_t *stats,
+    codec_messages_t *messages
+)
+{
+    /* Decode JPEG 2000 data from memory.
+
+    Doesn't use the Python API so may be called without holding the GIL.
+
+    Parameters
+    ----------
+    src : const unsigned char *
+        The JPEG 2000 data to be decoded.
+    length : size_t
+        The length of `src` (in bytes).
+
+    See decode_source() for the other parameters.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    input_buffer_t input = {src, length, 0};
+    stream_source_t source = {NULL, &input, stats, 0, NULL, 0, 0, 0};
+
+    return decode_source(
+        &source, (OPJ_UINT64)length, out, codec_format, options, pool, stats,
+        messages
+    );
+}
@@ -0,0 +1,407 @@
+/*
+
+Encode an image as JPEG 2000 data in memory.
+
+The encoded data is written to a native growable buffer (see stream.c) rather
+than a Python object so that encoding can be done without holding the GIL. Bits and pieces
+are adapted from openjpeg/src/bin/jp2/opj_compress.c which is licensed under
+the 2-clause BSD license (see the main LICENSE file).
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "openjpeg.h"
+#include "messages.h"
+#include "stream.h"
+
+
+// Maximum number of quality layers, the size of opj_cparameters_t.tcp_rates
+#define MAX_LAYERS 100
+
+
+// Parameters for encoding
+typedef struct EncodeParameters {
+    OPJ_UINT32 columns;  // width of the image in pixels
+    OPJ_UINT32 rows;  // height of the image in pixels
+    OPJ_UINT32 samples_per_pixel;  // number of components, 1 or 3
+    OPJ_UINT32 bits_stored;  // precision of the components, 1 to 16
+    OPJ_UINT32 bytes_allocated;  // bytes per sample in the input, 1 or 2
+    OPJ_UINT32 is_signed;  // 0 for unsigned samples, 1 for signed
+    int colourspace;  // the OPJ_COLOR_SPACE of the input
+    int use_mct;  // 1 to apply the multiple component transform to RGB
+    int codec_format;  // 0 for a J2K codestream, 2 for the JP2 format
+    int irreversible;  // 0 for the reversible 5/3 wavelet, 1 for 9/7
+    int quality_mode;  // 0 lossless, 1 compression ratios, 2 PSNR (in dB)
+    OPJ_UINT32 nr_layers;  // number of quality layers, ignored if lossless
+    float quality[MAX_LAYERS];  // the ratio or PSNR target for each layer
+    OPJ_UINT32 nr_resolutions;  // number of resolutions, 0 for the default
+    OPJ_UINT32 codeblock_width;  // code-block width, 0 for the default
+    OPJ_UINT32 codeblock_height;  // code-block height, 0 for the default
+    int progression_order;  // the OPJ_PROG_ORDER to use
+    OPJ_UINT32 tile_width;  // tile width, 0 for a single tile
+    OPJ_UINT32 tile_height;  // tile height, 0 for a single tile
+    int nr_threads;  // number of threads used by openjpeg for encoding
+    int tlm;  // 1 to write TLM marker segments with the tile-part lengths
+    int plt;  // 1 to write PLT marker segments with the packet lengths
+    OPJ_UINT32 subsampling_x;  // horizontal subsampling of components 2 and 3
+    OPJ_UINT32 subsampling_y;  // vertical subsampling of components 2 and 3
+} encode_parameters_t;
+
+
+static int set_encoder_parameters(
+    opj_cparameters_t *cparameters, encode_parameters_t *parameters
+)
+{
+    /* Set the openjpeg encoding parameters from `parameters`.
+
+    Parameters
+    ----------
+    cparameters : opj_cparameters_t *
+        The openjpeg encoding parameters, should already contain the
+        defaults.
+    parameters : encode_parameters_t *
+        The parameters describing the input data and the encoding.
+
+    Returns
+    -------
+    int
+        1 for success, 0 if the quality layers are invalid.
+    */
+    if (parameters->quality_mode == 0)
+    {
+        // A single lossless quality layer
+        cparameters->tcp_numlayers = 1;
+        cparameters->tcp_rates[0] = 0;
+        cparameters->cp_disto_alloc = 1;
+    } else {
+        if (parameters->nr_layers < 1 || parameters->nr_layers > MAX_LAYERS)
+            return 0;
+
+        cparameters->tcp_numlayers = (int)parameters->nr_layers;
+        for (OPJ_UINT32 ii = 0; ii < parameters->nr_layers; ii++)
+        {
+            if (parameters->quality_mode == 1)
+                cparameters->tcp_rates[ii] = parameters->quality[ii];
+            else
+                cparameters->tcp_distoratio[ii] = parameters->quality[ii];
+        }
+
+        if (parameters->quality_mode == 1)
+            cparameters->cp_disto_alloc = 1;
+        else
+            cparameters->cp_fixed_quality = 1;
+    }
+
+    cparameters->irreversible = parameters->irreversible;
+    cparameters->tcp_mct = (
+        parameters->use_mct && parameters->samples_per_pixel == 3
+    ) ? 1 : 0;
+    cparameters->prog_order = (OPJ_PROG_ORDER)parameters->progression_order;
+
+    if (parameters->codeblock_width && parameters->codeblock_height)
+    {
+        cparameters->cblockw_init = (int)parameters->codeblock_width;
+        cparameters->cblockh_init = (int)parameters->codeblock_height;
+    }
+
+    OPJ_UINT32 width = parameters->columns;
+    OPJ_UINT32 height = parameters->rows;
+    if (parameters->tile_width && parameters->tile_height)
+    {
+        cparameters->tile_size_on = OPJ_TRUE;
+        cparameters->cp_tx0 = 0;
+        cparameters->cp_ty0 = 0;
+        cparameters->cp_tdx = (int)parameters->tile_width;
+        cparameters->cp_tdy = (int)parameters->tile_height;
+        if (parameters->tile_width < width)
+            width = parameters->tile_width;
+        if (parameters->tile_height < height)
+            height = parameters->tile_height;
+    }
+
+    if (parameters->nr_resolutions)
+    {
+        cparameters->numresolution = (int)parameters->nr_resolutions;
+    } else {
+        // The default number of resolutions is limited by the (tile) size
+        OPJ_UINT32 min_size = width < height ? width : height;
+        while (
+            cparameters->numresolution > 1
+            && (1U << (cparameters->numresolution - 1)) > min_size
+        )
+            cparameters->numresolution--;
+    }
+
+    return 1;
+}
+
+
+static inline OPJ_INT32 read_sample(
+    const unsigned char *src, size_t offset, encode_parameters_t *parameters
+)
+{
+    // Return the sample at `offset` (in samples) from the start of `src`
+    if (parameters->bytes_allocated == 1)
+    {
+        if (parameters->is_signed)
+            return (OPJ_INT32)((const signed char *)src)[offset];
+
+        return (OPJ_INT32)src[offset];
+    }
+
+    if (parameters->is_signed)
+        return (OPJ_INT32)((const short *)src)[offset];
+
+    return (OPJ_INT32)((const unsigned short *)src)[offset];
+}
+
+
+static void fill_components(
+    opj_image_t *image,
+    const unsigned char *src,
+    encode_parameters_t *parameters
+)
+{
+    /* Copy the interleaved samples in `src` to the component planes.
+
+    Subsampled components take the top-left sample of each block of
+    (dy, dx) samples.
+
+    Parameters
+    ----------
+    image : opj_image_t *
+        The image to be encoded.
+    src : const unsigned char *
+        The C-contiguous input data, as (rows, columns) for a single
+        component or (rows, columns, samples) otherwise.
+    parameters : encode_parameters_t *
+        The parameters describing the input data.
+    */
+    OPJ_UINT32 spp = parameters->samples_per_pixel;
+    size_t columns = (size_t)parameters->columns;
+
+    for (OPJ_UINT32 c = 0; c < spp; c++)
+    {
+        opj_image_comp_t *comp = &image->comps[c];
+        OPJ_INT32 *dst = comp->data;
+
+        for (OPJ_UINT32 row = 0; row < comp->h; row++)
+        {
+            size_t offset = (size_t)row * comp->dy * columns * spp + c;
+            size_t step = (size_t)comp->dx * spp;
+            for (OPJ_UINT32 col = 0; col < comp->w; col++)
+                *dst++ = read_sample(src, offset + col * step, parameters);
+        }
+    }
+}
+
+
+extern int Encode(
+    const unsigned char *src,
+    encode_parameters_t *parameters,
+    encode_buffer_t *output,
+    codec_messages_t *messages
+)
+{
+    /* Encode `src` as JPEG 2000 data.
+
+    Doesn't use the Python API so may be called without holding the GIL.
+
+    Parameters
+    ----------
+    src : const unsigned char *
+        The C-contiguous image data to be encoded, 1 or 2 bytes per sample.
+    parameters : encode_parameters_t *
+        The parameters describing the input data and the encoding.
+    output : encode_buffer_t *
+        The buffer the encoded data will be written to. Either zeroed by the
+        caller, or with `data`, `capacity` and `is_external` set to use a
+        caller owned buffer until more than `capacity` bytes are needed. On
+        success, if `output->is_external` is 0 then `output->data` must be
+        freed by the caller using ``free()``. On failure any data allocated
+        by the encoder is freed.
+    messages : codec_messages_t *
+        If not NULL then the openjpeg error, warning and info messages will
+        be written to it.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    opj_stream_t *stream = NULL;
+    opj_image_t *image = NULL;
+    opj_codec_t *codec = NULL;
+    opj_cparameters_t cparameters;
+    opj_image_cmptparm_t cmptparm[3];
+
+    int error_code = EXIT_FAILURE;
+
+    clear_messages(messages);
+
+    OPJ_UINT32 spp = parameters->samples_per_pixel;
+    if (spp != 1 && spp != 3)
+    {
+        // Unsupported number of samples per pixel
+        error_code = 1;
+        goto failure;
+    }
+
+    if (parameters->bits_stored < 1 || parameters->bits_stored > 16)
+    {
+        // Unsupported bits stored
+        error_code = 2;
+        goto failure;
+    }
+
+    if (parameters->bytes_allocated != 1 && parameters->bytes_allocated != 2)
+    {
+        // Unsupported bytes per sample
+        error_code = 3;
+        goto failure;
+    }
+
+    OPJ_UINT32 dx = parameters->subsampling_x ? parameters->subsampling_x : 1;
+    OPJ_UINT32 dy = parameters->subsampling_y ? parameters->subsampling_y : 1;
+    if (dx > 2 || dy > 2 || (spp == 1 && (dx > 1 || dy > 1)))
+    {
+        // Unsupported subsampling
+        error_code = 13;
+        goto failure;
+    }
+
+    // Create the image, with components 2 and 3 optionally subsampled
+    memset(cmptparm, 0, sizeof(cmptparm));
+    for (OPJ_UINT32 c = 0; c < spp; c++)
+    {
+        OPJ_UINT32 cdx = c ? dx : 1;
+        OPJ_UINT32 cdy = c ? dy : 1;
+        cmptparm[c].dx = cdx;
+        cmptparm[c].dy = cdy;
+        cmptparm[c].w = (parameters->columns + cdx - 1) / cdx;
+        cmptparm[c].h = (parameters->rows + cdy - 1) / cdy;
+        cmptparm[c].prec = parameters->bits_stored;
+        cmptparm[c].sgnd = parameters->is_signed;
+    }
+
+    image = opj_image_create(
+        spp, cmptparm, (OPJ_COLOR_SPACE)parameters->colourspace
+    );
+    if (!image)
+    {
+        // Failed to create the image
+        error_code = 4;
+        goto failure;
+    }
+
+    image->x0 = 0;
+    image->y0 = 0;
+    image->x1 = parameters->columns;
+    image->y1 = parameters->rows;
+
+    fill_components(image, src, parameters);
+
+    opj_set_default_encoder_parameters(&cparameters);
+    if (!set_encoder_parameters(&cparameters, parameters))
+    {
+        // Invalid number of quality layers
+        error_code = 11;
+        goto failure;
+    }
+
+    codec = opj_create_compress((OPJ_CODEC_FORMAT)parameters->codec_format);
+    if (!codec)
+    {
+        // Failed to create the compressor
+        error_code = 5;
+        goto failure;
+    }
+    set_message_handlers(codec, messages);
+
+    if (
+        parameters->nr_threads > 1
+        && !opj_codec_set_threads(codec, parameters->nr_threads)
+    )
+    {
+        // Failed to set the number of threads
+        error_code = 14;
+        goto failure;
+    }
+
+    if (!opj_setup_encoder(codec, &cparameters, image))
+    {
+        // Failed to setup the encoder
+        error_code = 6;
+        goto failure;
+    }
+
+    // TLM and PLT marker segments are only available with openjpeg 2.5+
+    const char *extra_options[3] = {NULL, NULL, NULL};
+    int nr_options = 0;
+    if (parameters->tlm)
+        extra_options[nr_options++] = "TLM=YES";
+    if (parameters->plt)
+        extra_options[nr_options++] = "PLT=YES";
+
+    if (nr_options && !opj_encoder_set_extra_options(codec, extra_options))
+    {
+        // Failed to set the extra encoder options
+        error_code = 12;
+        goto failure;
+    }
+
+    stream = create_output_stream(output);
+    if (!stream)
+    {
+        // Failed to create the output stream
+        error_code = 7;
+        goto failure;
+    }
+
+    if (!opj_start_compress(codec, image, stream))
+    {
+        // Failed to start compression
+        error_code = 8;
+        goto failure;
+    }
+
+    if (!opj_encode(codec, stream))
+    {
+        // Failed to encode the image
+        error_code = 9;
+        goto failure;
+    }
+
+    if (!opj_end_compress(codec, stream))
+    {
+        // Failed to end compression
+        error_code = 10;
+        goto failure;
+    }
+
+    opj_stream_destroy(stream);
+    opj_destroy_codec(codec);
+    opj_image_destroy(image);
+
+    return EXIT_SUCCESS;
+
+    failure:
+        if (stream)
+            opj_stream_destroy(stream);
+        if (codec)
+            opj_destroy_codec(codec);
+        if (image)
+            opj_image_destroy(image);
+
+        if (!output->is_external)
+        {
+            free(output->data);
+            output->data = NULL;
+            output->capacity = 0;
+        }
+        output->length = 0;
+        output->position = 0;
+
+        return error_code;
+}
@@ -0,0 +1,85 @@
+/*
+
+Capture the error, warning and info messages from an openjpeg codec.
+
+The messages are written to fixed size buffers so the handlers can be used
+without holding the GIL and without allocating.
+
+*/
+
+#include <string.h>
+#include "openjpeg.h"
+#include "messages.h"
+
+
+static void append_message(const char *msg, void *buffer)
+{
+    /* Append `msg` to the message `buffer`.
+
+    Messages that don't fit in the remaining space are truncated, the buffer
+    is always null terminated and nothing is allocated.
+
+    Parameters
+    ----------
+    msg : const char *
+        The message from openjpeg.
+    buffer : void *
+        The char[MESSAGE_BUFFER_SIZE] buffer to append to.
+    */
+    char *dst = (char *)buffer;
+    size_t length = strlen(dst);
+
+    // Leave room for the null terminator
+    while (*msg && length < MESSAGE_BUFFER_SIZE - 1)
+    {
+        dst[length] = *msg;
+        length++;
+        msg++;
+    }
+    dst[length] = '\0';
+}
+
+
+extern void clear_messages(codec_messages_t *messages)
+{
+    /* Empty the message buffers in `messages`.
+
+    Should be called before anything can fail so the buffers are always
+    valid when the caller reads them, even if no codec was created.
+
+    Parameters
+    ----------
+    messages : codec_messages_t *
+        The messages to clear, may be NULL.
+    */
+    if (!messages)
+        return;
+
+    messages->error[0] = '\0';
+    messages->warning[0] = '\0';
+    messages->info[0] = '\0';
+}
+
+
+extern void set_message_handlers(opj_codec_t *codec, codec_messages_t *messages)
+{
+    /* Capture the error, warning and info messages for `codec`.
+
+    Parameters
+    ----------
+    codec : opj_codec_t *
+        The codec to capture the messages from, may be a decompressor or a
+        compressor.
+    messages : codec_messages_t *
+        Where the messages will be written to, if NULL then the messages are
+        discarded.
+    */
+    if (!messages)
+        return;
+
+    clear_messages(messages);
+
+    opj_set_error_handler(codec, append_message, messages->error);
+    opj_set_warning_handler(codec, append_message, messages->warning);
+    opj_set_info_handler(codec, append_message, messages->info);
+}
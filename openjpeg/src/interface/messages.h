@@ -0,0 +1,29 @@
+/*
+
+Capture the error, warning and info messages from an openjpeg codec.
+
+*/
+
+#ifndef _PYLIBJPEG_MESSAGES_H_
+#define _PYLIBJPEG_MESSAGES_H_
+
+#include "openjpeg.h"
+
+// Size of each of the message buffers
+#define MESSAGE_BUFFER_SIZE 1024
+
+
+// Messages from the openjpeg event handlers
+typedef struct CodecMessages {
+    char error[MESSAGE_BUFFER_SIZE];  // newline separated error messages
+    char warning[MESSAGE_BUFFER_SIZE];  // newline separated warning messages
+    char info[MESSAGE_BUFFER_SIZE];  // newline separated info messages
+} codec_messages_t;
+
+
+extern void clear_messages(codec_messages_t *messages);
+extern void set_message_handlers(
+    opj_codec_t *codec, codec_messages_t *messages
+);
+
+#endif
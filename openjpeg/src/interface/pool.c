@@ -0,0 +1,156 @@
+/*
+
+A simple pool for recycling the int32 component planes used when decoding.
+
+Decoding the same sized images over and over again means the same sized
+multi-megabyte planes are repeatedly allocated and freed, which fragments
+memory in long running processes. Instead, planes that are no longer needed
+are returned to the pool and handed back out the next time a plane of the same
+size is required. Only planes with a size that has recently been asked for are
+kept, everything else is freed as usual.
+
+All planes are allocated with `opj_image_data_alloc()` so they can be freely
+swapped with the planes that openjpeg allocates for an `opj_image_t`. A pool
+is not thread-safe and should not be shared between threads.
+
+*/
+
+#include <string.h>
+#include "openjpeg.h"
+#include "pool.h"
+
+
+static int is_requested(plane_pool_t *pool, size_t nr_bytes)
+{
+    /* Return 1 if a plane of `nr_bytes` has been recently requested, 0
+    otherwise.
+    */
+    for (int ii = 0; ii < POOL_NR_SLOTS; ii++)
+    {
+        if (pool->requested[ii] == nr_bytes)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+extern void pool_init(plane_pool_t *pool, size_t max_size)
+{
+    /* Initialise an empty `pool`.
+
+    Parameters
+    ----------
+    pool : plane_pool_t *
+        The pool to initialise.
+    max_size : size_t
+        The maximum total size of the planes that may be held by the pool (in
+        bytes).
+    */
+    memset(pool, 0, sizeof(plane_pool_t));
+    pool->max_size = max_size;
+}
+
+
+extern void pool_clear(plane_pool_t *pool)
+{
+    /* Free all the planes held by `pool`.
+
+    Parameters
+    ----------
+    pool : plane_pool_t *
+        The pool to clear.
+    */
+    for (int ii = 0; ii < POOL_NR_SLOTS; ii++)
+    {
+        if (pool->planes[ii])
+        {
+            opj_image_data_free(pool->planes[ii]);
+            pool->planes[ii] = NULL;
+            pool->sizes[ii] = 0;
+        }
+    }
+    pool->size = 0;
+}
+
+
+extern void * pool_acquire(plane_pool_t *pool, size_t nr_bytes)
+{
+    /* Return a plane of `nr_bytes`, recycling a pooled plane if possible.
+
+    Parameters
+    ----------
+    pool : plane_pool_t *
+        The pool to use, if NULL then the plane is always newly allocated.
+    nr_bytes : size_t
+        The required size of the plane (in bytes).
+
+    Returns
+    -------
+    void *
+        The plane or NULL if the allocation failed.
+    */
+    if (pool)
+    {
+        for (int ii = 0; ii < POOL_NR_SLOTS; ii++)
+        {
+            if (pool->planes[ii] && pool->sizes[ii] == nr_bytes)
+            {
+                void *plane = pool->planes[ii];
+                pool->planes[ii] = NULL;
+                pool->sizes[ii] = 0;
+                pool->size -= nr_bytes;
+                pool->hits++;
+                return plane;
+            }
+        }
+        pool->misses++;
+
+        if (!is_requested(pool, nr_bytes))
+        {
+            pool->requested[pool->nr_requested % POOL_NR_SLOTS] = nr_bytes;
+            pool->nr_requested++;
+        }
+    }
+
+    return opj_image_data_alloc(nr_bytes);
+}
+
+
+extern void pool_release(plane_pool_t *pool, void *plane, size_t nr_bytes)
+{
+    /* Return `plane` to the pool, or free it if the pool is full or if no
+    plane of the same size has been requested.
+
+    Parameters
+    ----------
+    pool : plane_pool_t *
+        The pool to use, if NULL then the plane is always freed.
+    plane : void *
+        The plane to be recycled, may be NULL.
+    nr_bytes : size_t
+        The size of the plane (in bytes).
+    */
+    if (!plane)
+        return;
+
+    if (
+        pool
+        && pool->size + nr_bytes <= pool->max_size
+        && is_requested(pool, nr_bytes)
+    )
+    {
+        for (int ii = 0; ii < POOL_NR_SLOTS; ii++)
+        {
+            if (!pool->planes[ii])
+            {
+                pool->planes[ii] = plane;
+                pool->sizes[ii] = nr_bytes;
+                pool->size += nr_bytes;
+                return;
+            }
+        }
+    }
+
+    opj_image_data_free(plane);
+}
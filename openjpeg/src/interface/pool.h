@@ -0,0 +1,33 @@
+/*
+
+A simple pool for recycling the int32 component planes used when decoding.
+
+*/
+
+#ifndef _PYLIBJPEG_POOL_H_
+#define _PYLIBJPEG_POOL_H_
+
+#include <stddef.h>
+
+// Maximum number of planes that can be held by a pool
+#define POOL_NR_SLOTS 16
+
+
+typedef struct PlanePoolData {
+    void *planes[POOL_NR_SLOTS];  // recycled planes, NULL if the slot is empty
+    size_t sizes[POOL_NR_SLOTS];  // size of each recycled plane (in bytes)
+    size_t requested[POOL_NR_SLOTS];  // the most recently requested sizes
+    size_t nr_requested;  // total number of sizes added to `requested`
+    size_t max_size;  // maximum total size of the recycled planes (in bytes)
+    size_t size;  // current total size of the recycled planes (in bytes)
+    unsigned long long hits;  // number of allocations served by the pool
+    unsigned long long misses;  // number of allocations passed to openjpeg
+} plane_pool_t;
+
+
+extern void pool_init(plane_pool_t *pool, size_t max_size);
+extern void pool_clear(plane_pool_t *pool);
+extern void * pool_acquire(plane_pool_t *pool, size_t nr_bytes);
+extern void pool_release(plane_pool_t *pool, void *plane, size_t nr_bytes);
+
+#endif
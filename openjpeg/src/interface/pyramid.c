@@ -0,0 +1,208 @@
+/*
+
+Lower resolution levels of decoded component planes.
+
+The LL band of each level of the reversible 5/3 wavelet transform is the
+image at half the resolution of the level above, so applying the low-pass
+lifting steps of the forward transform to the decoded samples gives the next
+level of an image pyramid. For losslessly encoded data this is identical to
+what openjpeg returns when decoding with fewer resolution levels, without
+having to decode the codestream again. The transform is applied separately
+to each tile using the symmetric extension of 15444-1 Annex F.
+
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "pyramid.h"
+
+
+static OPJ_UINT32 ceil_div_pow2(OPJ_UINT32 value, OPJ_UINT32 level)
+{
+    /* Return `value` divided by 2**`level`, rounded up. */
+    return (OPJ_UINT32)(((uint64_t)value + (1ULL << level) - 1) >> level);
+}
+
+
+static OPJ_INT32 extended_sample(
+    const OPJ_INT32 *x, int64_t start, int64_t end, int64_t position
+)
+{
+    /* Return the sample at `position` of the signal `x` covering
+    [`start`, `end`), symmetrically extended beyond its ends (F.3.7).
+    */
+    while (position < start || position >= end)
+    {
+        if (position < start)
+            position = 2 * start - position;
+        if (position >= end)
+            position = 2 * (end - 1) - position;
+    }
+
+    return x[position - start];
+}
+
+
+static OPJ_INT32 high_pass(
+    const OPJ_INT32 *x, int64_t start, int64_t end, int64_t position
+)
+{
+    /* Return the first lifting step (F-9) at the odd `position`. */
+    return extended_sample(x, start, end, position) - (
+        (
+            extended_sample(x, start, end, position - 1)
+            + extended_sample(x, start, end, position + 1)
+        ) >> 1
+    );
+}
+
+
+static void low_pass(
+    const OPJ_INT32 *x,
+    OPJ_UINT32 start,
+    OPJ_UINT32 end,
+    OPJ_INT32 *out,
+    size_t stride
+)
+{
+    /* Write the low-pass output of the 5/3 forward transform of `x`.
+
+    Parameters
+    ----------
+    x : const OPJ_INT32 *
+        The signal, covering the positions [`start`, `end`).
+    start : OPJ_UINT32
+        The position of the first sample of `x`.
+    end : OPJ_UINT32
+        The position after the last sample of `x`.
+    out : OPJ_INT32 *
+        Where to write the output, one value for each even position.
+    stride : size_t
+        The distance between each output value.
+    */
+    if (end - start == 1)
+    {
+        // A single sample is only low-pass at an even position
+        if (!(start & 1))
+            *out = x[0];
+
+        return;
+    }
+
+    for (int64_t ii = start + (start & 1); ii < end; ii += 2)
+    {
+        // The second lifting step (F-9) at the even position
+        *out = x[ii - start] + (
+            (high_pass(x, start, end, ii - 1)
+            + high_pass(x, start, end, ii + 1) + 2) >> 2
+        );
+        out += stride;
+    }
+}
+
+
+extern OPJ_INT32 * reduce_plane(
+    const OPJ_INT32 *plane,
+    const OPJ_UINT32 area[4],
+    const tile_grid_t *grid,
+    OPJ_UINT32 level
+)
+{
+    /* Return the plane for the next lower resolution level.
+
+    Parameters
+    ----------
+    plane : const OPJ_INT32 *
+        The samples for resolution `level`, which may be outside the range
+        allowed by the precision.
+    area : const OPJ_UINT32[4]
+        The (x0, y0, x1, y1) covered by `plane` on the grid of `level`.
+    grid : const tile_grid_t *
+        The tiling of the image on the reference grid.
+    level : OPJ_UINT32
+        The number of resolution levels below full resolution of `plane`.
+
+    Returns
+    -------
+    OPJ_INT32 *
+        The samples covering (ceil(x0 / 2), ceil(y0 / 2), ceil(x1 / 2),
+        ceil(y1 / 2)), or NULL if the allocation failed. Must be freed by the
+        caller.
+    */
+    OPJ_UINT32 width = area[2] - area[0];
+    OPJ_UINT32 out_x0 = ceil_div_pow2(area[0], 1);
+    OPJ_UINT32 out_y0 = ceil_div_pow2(area[1], 1);
+    size_t out_width = ceil_div_pow2(area[2], 1) - out_x0;
+    size_t out_height = ceil_div_pow2(area[3], 1) - out_y0;
+
+    OPJ_INT32 *out = malloc(out_width * out_height * sizeof(OPJ_INT32));
+    // The vertical low-pass output for a tile and a single column of it
+    OPJ_INT32 *columns = malloc(
+        (size_t)(grid->width < width ? grid->width : width)
+        * out_height * sizeof(OPJ_INT32)
+    );
+    OPJ_INT32 *column = malloc((area[3] - area[1]) * sizeof(OPJ_INT32));
+    if (!out || !columns || !column)
+    {
+        free(out);
+        free(columns);
+        free(column);
+        return NULL;
+    }
+
+    for (OPJ_UINT32 row = 0; row < grid->nr_rows; row++)
+    {
+        // The tile bounds on the grid of `level`, clipped to the image
+        OPJ_UINT32 v0 = ceil_div_pow2(grid->y0 + row * grid->height, level);
+        OPJ_UINT32 v1 = ceil_div_pow2(
+            grid->y0 + (row + 1) * grid->height, level
+        );
+        v0 = v0 > area[1] ? v0 : area[1];
+        v1 = v1 < area[3] ? v1 : area[3];
+        if (v0 >= v1)
+            continue;
+
+        OPJ_UINT32 nr_low_rows = ceil_div_pow2(v1, 1) - ceil_div_pow2(v0, 1);
+        for (OPJ_UINT32 col = 0; col < grid->nr_columns; col++)
+        {
+            OPJ_UINT32 u0 = ceil_div_pow2(grid->x0 + col * grid->width, level);
+            OPJ_UINT32 u1 = ceil_div_pow2(
+                grid->x0 + (col + 1) * grid->width, level
+            );
+            u0 = u0 > area[0] ? u0 : area[0];
+            u1 = u1 < area[2] ? u1 : area[2];
+            if (u0 >= u1 || !nr_low_rows)
+                continue;
+
+            // Vertical then horizontal analysis, as in 2D_SD (F.4.8.2)
+            OPJ_UINT32 tile_width = u1 - u0;
+            for (OPJ_UINT32 u = u0; u < u1; u++)
+            {
+                const OPJ_INT32 *src = plane + (size_t)(v0 - area[1]) * width;
+                src += u - area[0];
+                for (OPJ_UINT32 v = 0; v < v1 - v0; v++)
+                {
+                    column[v] = *src;
+                    src += width;
+                }
+
+                low_pass(column, v0, v1, columns + (u - u0), tile_width);
+            }
+
+            OPJ_INT32 *dst = out + (ceil_div_pow2(v0, 1) - out_y0) * out_width;
+            dst += ceil_div_pow2(u0, 1) - out_x0;
+            for (OPJ_UINT32 ii = 0; ii < nr_low_rows; ii++)
+            {
+                low_pass(
+                    columns + (size_t)ii * tile_width, u0, u1, dst, 1
+                );
+                dst += out_width;
+            }
+        }
+    }
+
+    free(columns);
+    free(column);
+
+    return out;
+}
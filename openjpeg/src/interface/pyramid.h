@@ -0,0 +1,31 @@
+/*
+
+Lower resolution levels of decoded component planes, for decoding an image
+pyramid from a single decode.
+
+*/
+
+#ifndef _PYLIBJPEG_PYRAMID_H_
+#define _PYLIBJPEG_PYRAMID_H_
+
+#include "openjpeg.h"
+
+
+typedef struct TileGrid {
+    OPJ_UINT32 x0;  // horizontal offset to the first tile on the reference grid
+    OPJ_UINT32 y0;  // vertical offset to the first tile on the reference grid
+    OPJ_UINT32 width;  // tile width on the reference grid
+    OPJ_UINT32 height;  // tile height on the reference grid
+    OPJ_UINT32 nr_columns;  // number of tiles across
+    OPJ_UINT32 nr_rows;  // number of tiles down
+} tile_grid_t;
+
+
+extern OPJ_INT32 * reduce_plane(
+    const OPJ_INT32 *plane,
+    const OPJ_UINT32 area[4],
+    const tile_grid_t *grid,
+    OPJ_UINT32 level
+);
+
+#endif
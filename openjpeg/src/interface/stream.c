@@ -0,0 +1,268 @@
+/*
+
+Native in-memory input and output streams for openjpeg.
+
+Unlike the streams in decode.c, which read from a Python file-like, these
+don't use the Python API so they may be used without holding the GIL.
+
+The output stream writes to a growable buffer. The caller may supply the
+initial buffer, such as the storage of a preallocated Python bytes object
+sized using an estimate of the encoded size, in which case no copy is needed
+unless the estimate turns out to be too small.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "openjpeg.h"
+#include "stream.h"
+
+
+// Size of the buffer for the streams
+#define BUFFER_SIZE OPJ_J2K_STREAM_CHUNK_SIZE
+
+// Initial capacity of the output buffer
+#define OUTPUT_INITIAL_CAPACITY 65536
+
+
+// Output stream methods
+static int buffer_reserve(encode_buffer_t *buffer, size_t nr_bytes)
+{
+    /* Grow `buffer` so it can hold at least `nr_bytes`.
+
+    A buffer owned by the caller is never reallocated, instead the data is
+    moved to a new buffer allocated with malloc().
+
+    Returns
+    -------
+    int
+        1 for success, 0 if the allocation failed.
+    */
+    if (nr_bytes <= buffer->capacity)
+        return 1;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : OUTPUT_INITIAL_CAPACITY;
+    while (capacity < nr_bytes)
+        capacity *= 2;
+
+    unsigned char *data = NULL;
+    if (buffer->is_external)
+    {
+        data = (unsigned char *)malloc(capacity);
+        if (!data)
+            return 0;
+
+        memcpy(data, buffer->data, buffer->length);
+        buffer->is_external = 0;
+    } else {
+        data = (unsigned char *)realloc(buffer->data, capacity);
+        if (!data)
+            return 0;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+
+    return 1;
+}
+
+
+static OPJ_SIZE_T buffer_write(void *src, OPJ_SIZE_T nr_bytes, void *user_data)
+{
+    /* Write `nr_bytes` from `src` to the output buffer.
+
+    Parameters
+    ----------
+    src : void *
+        The data to be written.
+    nr_bytes : OPJ_SIZE_T
+        The number of bytes to write.
+    user_data : void *
+        The encode_buffer_t to write to.
+
+    Returns
+    -------
+    OPJ_SIZE_T
+        The number of bytes written, or -1 if the buffer couldn't be grown.
+    */
+    encode_buffer_t *buffer = (encode_buffer_t *)user_data;
+
+    if (!buffer_reserve(buffer, buffer->position + nr_bytes))
+        return (OPJ_SIZE_T)-1;
+
+    // Zero any gap left by skipping past the end of the written data
+    if (buffer->position > buffer->length)
+        memset(
+            buffer->data + buffer->length, 0, buffer->position - buffer->length
+        );
+
+    memcpy(buffer->data + buffer->position, src, nr_bytes);
+    buffer->position += nr_bytes;
+    if (buffer->position > buffer->length)
+        buffer->length = buffer->position;
+
+    return nr_bytes;
+}
+
+
+static OPJ_OFF_T buffer_skip(OPJ_OFF_T offset, void *user_data)
+{
+    /* Change the output buffer position by `offset`.
+
+    Returns
+    -------
+    OPJ_OFF_T
+        `offset` for success, -1 if the new position would be negative.
+    */
+    encode_buffer_t *buffer = (encode_buffer_t *)user_data;
+
+    if (offset < 0 && (size_t)(-offset) > buffer->position)
+        return -1;
+
+    buffer->position += offset;
+
+    return offset;
+}
+
+
+static OPJ_BOOL buffer_seek(OPJ_OFF_T offset, void *user_data)
+{
+    /* Set the output buffer position to `offset`.
+
+    Returns
+    -------
+    OPJ_BOOL
+        OPJ_TRUE for success, OPJ_FALSE if `offset` is negative.
+    */
+    encode_buffer_t *buffer = (encode_buffer_t *)user_data;
+
+    if (offset < 0)
+        return OPJ_FALSE;
+
+    buffer->position = (size_t)offset;
+
+    return OPJ_TRUE;
+}
+
+
+extern opj_stream_t* create_output_stream(encode_buffer_t *buffer)
+{
+    /* Return a new output stream that writes to `buffer`.
+
+    Parameters
+    ----------
+    buffer : encode_buffer_t *
+        The buffer to write to, must remain valid for the lifetime of the
+        stream.
+
+    Returns
+    -------
+    opj_stream_t *
+        The output stream or NULL if it couldn't be created.
+    */
+    opj_stream_t *stream = opj_stream_create(BUFFER_SIZE, OPJ_FALSE);
+    if (!stream)
+        return NULL;
+
+    opj_stream_set_write_function(stream, buffer_write);
+    opj_stream_set_skip_function(stream, buffer_skip);
+    opj_stream_set_seek_function(stream, buffer_seek);
+    opj_stream_set_user_data(stream, buffer, NULL);
+
+    return stream;
+}
+
+
+// Input stream methods
+extern OPJ_SIZE_T input_read(void *dst, OPJ_SIZE_T nr_bytes, void *user_data)
+{
+    /* Read up to `nr_bytes` from the input buffer into `dst`.
+
+    Returns
+    -------
+    OPJ_SIZE_T
+        The number of bytes read, or -1 if at the end of the data.
+    */
+    input_buffer_t *buffer = (input_buffer_t *)user_data;
+
+    if (buffer->position >= buffer->length)
+        return (OPJ_SIZE_T)-1;
+
+    size_t remaining = buffer->length - buffer->position;
+    if (nr_bytes > remaining)
+        nr_bytes = remaining;
+
+    memcpy(dst, buffer->data + buffer->position, nr_bytes);
+    buffer->position += nr_bytes;
+
+    return nr_bytes;
+}
+
+
+extern OPJ_OFF_T input_skip(OPJ_OFF_T offset, void *user_data)
+{
+    /* Change the input buffer position by `offset`.
+
+    Returns
+    -------
+    OPJ_OFF_T
+        `offset` for success, -1 if the new position would be negative.
+    */
+    input_buffer_t *buffer = (input_buffer_t *)user_data;
+
+    if (offset < 0 && (size_t)(-offset) > buffer->position)
+        return -1;
+
+    buffer->position += offset;
+
+    return offset;
+}
+
+
+extern OPJ_BOOL input_seek(OPJ_OFF_T offset, void *user_data)
+{
+    /* Set the input buffer position to `offset`.
+
+    Returns
+    -------
+    OPJ_BOOL
+        OPJ_TRUE for success, OPJ_FALSE if `offset` is outside the data.
+    */
+    input_buffer_t *buffer = (input_buffer_t *)user_data;
+
+    if (offset < 0 || (size_t)offset > buffer->length)
+        return OPJ_FALSE;
+
+    buffer->position = (size_t)offset;
+
+    return OPJ_TRUE;
+}
+
+
+extern opj_stream_t* create_input_stream(input_buffer_t *buffer)
+{
+    /* Return a new input stream that reads from `buffer`.
+
+    Parameters
+    ----------
+    buffer : input_buffer_t *
+        The buffer to read from, must remain valid for the lifetime of the
+        stream.
+
+    Returns
+    -------
+    opj_stream_t *
+        The input stream or NULL if it couldn't be created.
+    */
+    opj_stream_t *stream = opj_stream_create(BUFFER_SIZE, OPJ_TRUE);
+    if (!stream)
+        return NULL;
+
+    opj_stream_set_read_function(stream, input_read);
+    opj_stream_set_skip_function(stream, input_skip);
+    opj_stream_set_seek_function(stream, input_seek);
+    opj_stream_set_user_data(stream, buffer, NULL);
+    opj_stream_set_user_data_length(stream, buffer->length);
+
+    return stream;
+}
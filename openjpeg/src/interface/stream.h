@@ -0,0 +1,38 @@
+/*
+
+Native in-memory input and output streams for openjpeg.
+
+*/
+
+#ifndef _PYLIBJPEG_STREAM_H_
+#define _PYLIBJPEG_STREAM_H_
+
+#include <stddef.h>
+#include "openjpeg.h"
+
+
+// The encoded output
+typedef struct EncodeBuffer {
+    unsigned char *data;  // the encoded data
+    size_t length;  // number of bytes of encoded data
+    size_t capacity;  // allocated size of `data` (in bytes)
+    size_t position;  // the current position of the output stream
+    int is_external;  // 1 if `data` is owned by the caller, 0 for malloc()
+} encode_buffer_t;
+
+
+// The encoded input
+typedef struct InputBuffer {
+    const unsigned char *data;  // the encoded data
+    size_t length;  // number of bytes of encoded data
+    size_t position;  // the current position of the input stream
+} input_buffer_t;
+
+
+extern opj_stream_t* create_output_stream(encode_buffer_t *buffer);
+extern opj_stream_t* create_input_stream(input_buffer_t *buffer);
+extern OPJ_SIZE_T input_read(void *dst, OPJ_SIZE_T nr_bytes, void *user_data);
+extern OPJ_OFF_T input_skip(OPJ_OFF_T offset, void *user_data);
+extern OPJ_BOOL input_seek(OPJ_OFF_T offset, void *user_data);
+
+#endif
@@ -0,0 +1,305 @@
+/*
+
+Losslessly re-encode JPEG 2000 data in memory.
+
+The source is decoded to its integer component planes, which are then encoded
+using the reversible 5/3 wavelet with the tile layout, number of resolutions,
+code-block size, precincts and progression order of the source. No colour
+conversion or upsampling is done, so the precision, signedness and sampling
+of the components are preserved. Neither stream uses the Python API so
+transcoding may be done without holding the GIL.
+
+openjpeg's encoder only takes a single set of coding parameters for all the
+components, so sources where COC marker segments give the components
+different resolutions, code-block or precinct sizes are rejected rather than
+having their layout changed.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "openjpeg.h"
+#include "messages.h"
+#include "stream.h"
+
+
+static int has_uniform_components(opj_codestream_info_v2_t *info)
+{
+    /* Return 1 if every component uses the same resolutions, code-block
+    and precinct sizes.
+
+    Parameters
+    ----------
+    info : opj_codestream_info_v2_t *
+        The main header information for the source codestream.
+
+    Returns
+    -------
+    int
+        1 if the components can be encoded using the parameters of the
+        first component, 0 otherwise.
+    */
+    opj_tccp_info_t *tccps = info->m_default_tile_info.tccp_info;
+    opj_tccp_info_t *first = &tccps[0];
+
+    for (OPJ_UINT32 c = 1; c < info->nbcomps; c++)
+    {
+        opj_tccp_info_t *tccp = &tccps[c];
+        if (
+            tccp->numresolutions != first->numresolutions
+            || tccp->cblkw != first->cblkw
+            || tccp->cblkh != first->cblkh
+            || (tccp->csty & 0x01) != (first->csty & 0x01)
+        )
+            return 0;
+
+        if (!(tccp->csty & 0x01))
+            continue;
+
+        for (OPJ_UINT32 ii = 0; ii < tccp->numresolutions; ii++)
+        {
+            if (
+                tccp->prcw[ii] != first->prcw[ii]
+                || tccp->prch[ii] != first->prch[ii]
+            )
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static void set_transcode_parameters(
+    opj_cparameters_t *cparameters,
+    opj_codestream_info_v2_t *info,
+    opj_image_t *image,
+    int mode
+)
+{
+    /* Set the openjpeg encoding parameters from the source codestream.
+
+    Parameters
+    ----------
+    cparameters : opj_cparameters_t *
+        The openjpeg encoding parameters, should already contain the
+        defaults.
+    info : opj_codestream_info_v2_t *
+        The main header information for the source codestream.
+    image : opj_image_t *
+        The decoded source image.
+    mode : int
+        The code-block coding style flags to use.
+    */
+    opj_tile_info_v2_t *tile = &(info->m_default_tile_info);
+    opj_tccp_info_t *tccp = &(tile->tccp_info[0]);
+
+    // A single lossless quality layer
+    cparameters->tcp_numlayers = 1;
+    cparameters->tcp_rates[0] = 0;
+    cparameters->cp_disto_alloc = 1;
+    cparameters->irreversible = 0;
+    cparameters->mode = mode;
+
+    cparameters->tcp_mct = (image->numcomps >= 3 && tile->mct) ? 1 : 0;
+    cparameters->prog_order = tile->prg;
+    cparameters->csty = (int)tile->csty;
+    cparameters->numresolution = (int)tccp->numresolutions;
+    cparameters->cblockw_init = 1 << tccp->cblkw;
+    cparameters->cblockh_init = 1 << tccp->cblkh;
+
+    // Precinct sizes, openjpeg wants them from the highest resolution down
+    if (tccp->csty & 0x01)
+    {
+        OPJ_UINT32 nr_resolutions = tccp->numresolutions;
+        cparameters->csty |= 0x01;
+        cparameters->res_spec = (int)nr_resolutions;
+        for (OPJ_UINT32 ii = 0; ii < nr_resolutions; ii++)
+        {
+            OPJ_UINT32 resno = nr_resolutions - 1 - ii;
+            cparameters->prcw_init[ii] = 1 << tccp->prcw[resno];
+            cparameters->prch_init[ii] = 1 << tccp->prch[resno];
+        }
+    }
+
+    // Keep the tile layout
+    if (info->tw * info->th > 1)
+    {
+        cparameters->tile_size_on = OPJ_TRUE;
+        cparameters->cp_tx0 = (int)info->tx0;
+        cparameters->cp_ty0 = (int)info->ty0;
+        cparameters->cp_tdx = (int)info->tdx;
+        cparameters->cp_tdy = (int)info->tdy;
+    }
+}
+
+
+extern int Transcode(
+    const unsigned char *src,
+    size_t length,
+    int codec_format,
+    int mode,
+    encode_buffer_t *output,
+    codec_messages_t *messages
+)
+{
+    /* Losslessly re-encode the JPEG 2000 data in `src` as a J2K codestream.
+
+    Doesn't use the Python API so may be called without holding the GIL.
+
+    Parameters
+    ----------
+    src : const unsigned char *
+        The JPEG 2000 data to be transcoded.
+    length : size_t
+        The length of `src` (in bytes).
+    codec_format : int
+        The format of `src`, one of:
+        * ``0`` - OPJ_CODEC_J2K : JPEG-2000 codestream
+        * ``2`` - OPJ_CODEC_JP2 : JP2 file format
+    mode : int
+        The code-block coding style flags to use when encoding, such as
+        ``1`` for selective arithmetic coding bypass.
+    output : encode_buffer_t *
+        The buffer the encoded data will be written to, see Encode().
+    messages : codec_messages_t *
+        If not NULL then the openjpeg error, warning and info messages will
+        be written to it.
+
+    Returns
+    -------
+    int
+        The exit status, 0 for success, failure otherwise.
+    */
+    opj_stream_t *stream = NULL;
+    opj_codec_t *codec = NULL;
+    opj_image_t *image = NULL;
+    opj_codestream_info_v2_t *info = NULL;
+    opj_dparameters_t dparameters;
+    opj_cparameters_t cparameters;
+    input_buffer_t input = {src, length, 0};
+
+    int error_code = EXIT_FAILURE;
+    clear_messages(messages);
+
+    // Decode the source
+    stream = create_input_stream(&input);
+    if (!stream)
+    {
+        // Failed to create the input stream
+        error_code = 1;
+        goto failure;
+    }
+
+    codec = opj_create_decompress((OPJ_CODEC_FORMAT)codec_format);
+    set_message_handlers(codec, messages);
+
+    opj_set_default_decoder_parameters(&dparameters);
+    if (!opj_setup_decoder(codec, &dparameters))
+    {
+        // Failed to setup the decoder
+        error_code = 2;
+        goto failure;
+    }
+
+    if (!opj_read_header(stream, codec, &image))
+    {
+        // Failed to read the header
+        error_code = 3;
+        goto failure;
+    }
+
+    info = opj_get_cstr_info(codec);
+    if (!info)
+    {
+        // Failed to get the codestream information
+        error_code = 4;
+        goto failure;
+    }
+
+    if (!has_uniform_components(info))
+    {
+        // Component specific coding parameters can't be kept
+        error_code = 10;
+        goto failure;
+    }
+
+    if (!(opj_decode(codec, stream, image) && opj_end_decompress(codec, stream)))
+    {
+        // Failed to decode the image
+        error_code = 5;
+        goto failure;
+    }
+
+    opj_destroy_codec(codec);
+    opj_stream_destroy(stream);
+    codec = NULL;
+    stream = NULL;
+
+    // Encode the decoded image
+    opj_set_default_encoder_parameters(&cparameters);
+    set_transcode_parameters(&cparameters, info, image, mode);
+
+    codec = opj_create_compress(OPJ_CODEC_J2K);
+    if (!codec)
+    {
+        // Failed to create the compressor
+        error_code = 6;
+        goto failure;
+    }
+    set_message_handlers(codec, messages);
+
+    if (!opj_setup_encoder(codec, &cparameters, image))
+    {
+        // Failed to setup the encoder
+        error_code = 7;
+        goto failure;
+    }
+
+    stream = create_output_stream(output);
+    if (!stream)
+    {
+        // Failed to create the output stream
+        error_code = 8;
+        goto failure;
+    }
+
+    if (
+        !opj_start_compress(codec, image, stream)
+        || !opj_encode(codec, stream)
+        || !opj_end_compress(codec, stream)
+    )
+    {
+        // Failed to encode the image
+        error_code = 9;
+        goto failure;
+    }
+
+    opj_destroy_cstr_info(&info);
+    opj_stream_destroy(stream);
+    opj_destroy_codec(codec);
+    opj_image_destroy(image);
+
+    return EXIT_SUCCESS;
+
+    failure:
+        if (info)
+            opj_destroy_cstr_info(&info);
+        if (stream)
+            opj_stream_destroy(stream);
+        if (codec)
+            opj_destroy_codec(codec);
+        if (image)
+            opj_image_destroy(image);
+
+        if (!output->is_external)
+        {
+            free(output->data);
+            output->data = NULL;
+            output->capacity = 0;
+        }
+        output->length = 0;
+        output->position = 0;
+
+        return error_code;
+}
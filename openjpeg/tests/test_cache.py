@@ -0,0 +1,298 @@
+"""Tests for caching decoded images."""
+
+from io import BytesIO
+import multiprocessing
+import os
+import sys
+import threading
+import uuid
+
+import numpy as np
+import pytest
+
+from openjpeg import cache as cache_module
+from openjpeg.cache import FrameCache, SharedFrameCache
+from openjpeg.utils import decode, encode
+
+
+def encoded_frames(nr_frames, shape=(32, 32)):
+    """Return a list of (arr, encoded) for `nr_frames` different images."""
+    frames = []
+    for seed in range(nr_frames):
+        rng = np.random.default_rng(seed)
+        arr = rng.integers(0, 255, size=shape, dtype="u1")
+        frames.append((arr, encode(arr)))
+
+    return frames
+
+
+class TestFrameCache(object):
+    """Tests for FrameCache."""
+    def test_init(self):
+        """Test creating a new cache."""
+        cache = FrameCache()
+        assert 256 * 1024 * 1024 == cache.max_size
+        assert 0 == cache.size
+        assert 0 == len(cache)
+        assert 0 == cache.hits
+        assert 0 == cache.misses
+        assert 0 == cache.evictions
+
+    def test_invalid_max_size_raises(self):
+        """Test a negative max_size raises."""
+        msg = r"'max_size' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            FrameCache(max_size=-1)
+
+    def test_make_key(self):
+        """Test the cache key depends on the data and options."""
+        key = FrameCache.make_key(b"\x00\x01", reshape=True)
+        assert key == FrameCache.make_key(b"\x00\x01", reshape=True)
+        assert key != FrameCache.make_key(b"\x00\x02", reshape=True)
+        assert key != FrameCache.make_key(b"\x00\x01", reshape=False)
+        assert key != FrameCache.make_key(b"\x00\x01")
+
+    def test_decode(self):
+        """Test decoding with a cache."""
+        (arr, data), = encoded_frames(1)
+        cache = FrameCache()
+        out = decode(data, cache=cache)
+        assert np.array_equal(out, arr)
+        assert not out.flags.writeable
+        assert 0 == cache.hits
+        assert 1 == cache.misses
+        assert arr.nbytes == cache.size
+
+        # Hits return the same shared array
+        assert decode(data, cache=cache) is out
+        assert decode(BytesIO(data), cache=cache) is out
+        assert 2 == cache.hits
+        assert 1 == cache.misses
+
+        # Different options are cached separately
+        out = decode(data, cache=cache, reshape=False)
+        assert out.shape == (32 * 32, )
+        assert 2 == len(cache)
+        assert 2 == cache.misses
+
+    def test_stats_not_cached(self):
+        """Test the cache isn't used when returning statistics."""
+        (arr, data), = encoded_frames(1)
+        cache = FrameCache()
+        out, stats = decode(data, cache=cache, stats=True)
+        assert out.flags.writeable
+        assert 0 == len(cache)
+        assert 0 == cache.misses
+
+    def test_eviction(self):
+        """Test the least recently used images are evicted."""
+        frames = encoded_frames(4)
+        cache = FrameCache(max_size=3 * 32 * 32)
+        for _, data in frames[:3]:
+            decode(data, cache=cache)
+
+        # Use the first frame so the second is the least recently used
+        decode(frames[0][1], cache=cache)
+        decode(frames[3][1], cache=cache)
+        assert 3 == len(cache)
+        assert 1 == cache.evictions
+        assert 3 * 32 * 32 == cache.size
+
+        keys = [
+            FrameCache.make_key(data, j2k_format=None, reshape=True)
+            for _, data in frames
+        ]
+        assert keys[0] in cache
+        assert keys[1] not in cache
+        assert keys[2] in cache
+        assert keys[3] in cache
+
+    def test_too_large(self):
+        """Test images larger than the cache aren't cached."""
+        (arr, data), = encoded_frames(1)
+        cache = FrameCache(max_size=100)
+        out = decode(data, cache=cache)
+        assert np.array_equal(out, arr)
+        assert 0 == len(cache)
+        assert 0 == cache.size
+        assert 0 == cache.evictions
+
+    def test_clear(self):
+        """Test clearing the cache."""
+        cache = FrameCache()
+        for _, data in encoded_frames(2):
+            decode(data, cache=cache)
+
+        assert 2 == len(cache)
+        cache.clear()
+        assert 0 == len(cache)
+        assert 0 == cache.size
+
+    def test_threads(self):
+        """Test using the cache from multiple threads."""
+        frames = encoded_frames(4)
+        cache = FrameCache()
+        errors = []
+
+        def worker():
+            for arr, data in frames * 4:
+                if not np.array_equal(decode(data, cache=cache), arr):
+                    errors.append(arr)
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads:
+            t.start()
+
+        for t in threads:
+            t.join()
+
+        assert not errors
+        assert 4 == len(cache)
+        assert 64 == cache.hits + cache.misses
+
+
+def _decode_in_process(name, data, queue):
+    """Decode `data` using the shared cache `name` in another process."""
+    cache = SharedFrameCache(name)
+    arr = decode(data, cache=cache)
+    queue.put((cache.hits, cache.misses, arr.sum()))
+    del arr
+    cache.close()
+
+
+@pytest.mark.skipif(
+    sys.version_info < (3, 8), reason="Requires Python 3.8 or later"
+)
+class TestSharedFrameCache(object):
+    """Tests for SharedFrameCache."""
+    def setup_method(self):
+        """Setup the tests."""
+        self.name = f"opj-test-{uuid.uuid4().hex[:16]}"
+        self.caches = []
+
+    def teardown_method(self):
+        """Remove the shared-memory segments."""
+        for cache in self.caches:
+            cache.unlink()
+
+    def new_cache(self, **kwargs):
+        """Return a new SharedFrameCache."""
+        cache = SharedFrameCache(self.name, **kwargs)
+        self.caches.append(cache)
+
+        return cache
+
+    def test_init(self):
+        """Test creating a new cache."""
+        cache = self.new_cache(max_size=1024, nr_slots=8)
+        assert self.name in cache.name
+        assert 1024 == cache.max_size
+        assert 0 == cache.size
+        assert 0 == len(cache)
+        assert 0 == cache.hits
+        assert 0 == cache.misses
+
+    def test_invalid_parameters_raises(self):
+        """Test invalid parameters raise."""
+        msg = r"'max_size' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            SharedFrameCache(self.name, max_size=-1)
+
+        msg = r"'nr_slots' must be greater than 0"
+        with pytest.raises(ValueError, match=msg):
+            SharedFrameCache(self.name, nr_slots=0)
+
+    def test_decode(self):
+        """Test decoding with a shared cache."""
+        frames = encoded_frames(2, shape=(31, 17, 3))
+        cache = self.new_cache(max_size=1024 * 1024, nr_slots=8)
+        for arr, data in frames:
+            out = decode(data, cache=cache)
+            assert np.array_equal(out, arr)
+            assert not out.flags.writeable
+
+        assert 2 == len(cache)
+        assert 2 == cache.misses
+        assert cache.size >= 2 * 31 * 17 * 3
+
+        out = decode(frames[0][1], cache=cache)
+        assert np.array_equal(out, frames[0][0])
+        assert 1 == cache.hits
+        del out
+
+    def test_attach(self):
+        """Test a second cache with the same name shares the images."""
+        (arr, data), = encoded_frames(1)
+        cache = self.new_cache(max_size=1024 * 1024, nr_slots=8)
+        decode(data, cache=cache)
+
+        other = SharedFrameCache(self.name, max_size=1, nr_slots=1)
+        assert cache.max_size == other.max_size
+        out = decode(data, cache=other)
+        assert np.array_equal(out, arr)
+        assert 1 == other.hits
+        assert 0 == other.misses
+        del out
+        other.close()
+
+    @pytest.mark.parametrize("size", [0, 4096])
+    def test_attach_uninitialised_raises(self, size, monkeypatch):
+        """Test attaching to a segment that hasn't been sized or had its
+        header written raises.
+        """
+        _posixshmem = pytest.importorskip("_posixshmem")
+        monkeypatch.setattr(cache_module, "_ATTACH_TIMEOUT", 0.05)
+        # As left by the creating process between shm_open(), ftruncate()
+        #   and writing the header
+        fd = _posixshmem.shm_open(
+            f"/{self.name}", os.O_CREAT | os.O_EXCL | os.O_RDWR, mode=0o600
+        )
+        os.ftruncate(fd, size)
+        msg = "wasn't initialised as an image cache"
+        try:
+            with pytest.raises(RuntimeError, match=msg):
+                SharedFrameCache(self.name)
+        finally:
+            os.close(fd)
+            _posixshmem.shm_unlink(f"/{self.name}")
+
+    def test_full(self):
+        """Test images aren't cached once the segment is full."""
+        frames = encoded_frames(3)
+        cache = self.new_cache(max_size=2 * 32 * 32, nr_slots=8)
+        for arr, data in frames:
+            assert np.array_equal(decode(data, cache=cache), arr)
+
+        assert 2 == len(cache)
+        assert 2 * 32 * 32 == cache.size
+
+        # Also when the index is full
+        self.name += "-2"
+        cache = self.new_cache(max_size=1024 * 1024, nr_slots=2)
+        for arr, data in frames:
+            assert np.array_equal(decode(data, cache=cache), arr)
+
+        assert 2 == len(cache)
+
+    def test_processes(self):
+        """Test the cache is shared between processes."""
+        (arr, data), = encoded_frames(1)
+        cache = self.new_cache(max_size=1024 * 1024, nr_slots=8)
+
+        ctx = multiprocessing.get_context("spawn")
+        queue = ctx.Queue()
+        process = ctx.Process(
+            target=_decode_in_process, args=(self.name, data, queue)
+        )
+        process.start()
+        hits, misses, total = queue.get(timeout=60)
+        process.join()
+        assert (0, 1) == (hits, misses)
+        assert arr.sum() == total
+
+        # Decoded by the other process
+        key = cache.make_key(data, j2k_format=None, reshape=True)
+        assert key in cache
+        out = cache.get(key)
+        assert np.array_equal(out, arr)
+        del out
@@ -1,7 +1,10 @@
 """Unit tests for openjpeg."""
 
+import asyncio
 from io import BytesIO
 import os
+import struct
+import time
 
 try:
     import pydicom
@@ -17,7 +20,24 @@ import numpy as np
 import pytest
 
 from openjpeg.data import get_indexed_datasets, JPEG_DIRECTORY
-from openjpeg.utils import get_openjpeg_version, decode, get_parameters
+import _openjpeg
+from openjpeg.utils import (
+    get_openjpeg_version,
+    decode,
+    decode_async,
+    decode_into,
+    decode_partial,
+    decode_pixel_data,
+    decode_pyramid,
+    encode,
+    get_parameters,
+    PlanePool,
+    ProgressiveDecoder,
+    MemoryLimitError,
+    CancelToken,
+    DecodeCancelledError,
+    DecodeTimeoutError,
+)
 
 
 DIR_15444 = JPEG_DIRECTORY / '15444'
@@ -64,6 +84,8 @@ def test_version():
     assert isinstance(version[0], int)
     assert 3 == len(version)
     assert 2 == version[0]
+    # HTJ2K decoding requires v2.5 or later
+    assert version >= (2, 5, 0)
 
 
 def generate_frames(ds):
@@ -216,6 +238,945 @@ class TestDecode(object):
         assert (256, 256, 3) == arr.shape
         assert [235, 244, 245] == arr[0, 0, :].tolist()
 
+    def test_max_memory(self):
+        """Test decoding with a memory limit."""
+        jpg = DIR_15444 / "2KLS" / "oj36.j2k"
+        with open(jpg, 'rb') as f:
+            data = f.read()
+
+        # Output: 256 * 256 * 3
+        # Planes: 256 * 256 * 4 + 2 * 128 * 256 * 4
+        # Colour conversion: 3 * 256 * 256 * 4
+        required = 196608 + 524288 + 786432
+        arr = decode(data, max_memory=required)
+        assert (256, 256, 3) == arr.shape
+
+        msg = (
+            r"Decoding the J2K data requires an estimated 1507328 bytes, "
+            r"which exceeds the 'max_memory' limit of 1507327 bytes"
+        )
+        with pytest.raises(MemoryLimitError, match=msg):
+            decode(data, max_memory=required - 1)
+
+    def test_max_memory_area_reduce(self):
+        """Test the memory limit only includes the area being decoded."""
+        arr = np.zeros((1024, 1024), dtype="u2")
+        data = encode(arr, bits_stored=12, tile_size=(256, 256))
+
+        # Output: 1024 * 1024 * 2
+        # Planes: 1024 * 1024 * 4, tile: 256 * 256 * 4
+        msg = (
+            r"Decoding the J2K data requires an estimated 6553600 bytes, "
+            r"which exceeds the 'max_memory' limit of 1000000 bytes"
+        )
+        with pytest.raises(MemoryLimitError, match=msg):
+            decode(data, max_memory=1000000)
+
+        # Output: 256 * 256 * 2
+        # Planes: 256 * 256 * 4, tile: 64 * 64 * 4
+        out = decode(data, reduce=2, max_memory=409600)
+        assert (256, 256) == out.shape
+        with pytest.raises(MemoryLimitError):
+            decode(data, reduce=2, max_memory=409599)
+
+        # Output: 100 * 50 * 2
+        # Planes: 100 * 50 * 4, tile: 256 * 256 * 4
+        area = (0, 0, 100, 50)
+        out = decode(data, area=area, max_memory=292144)
+        assert (50, 100) == out.shape
+        with pytest.raises(MemoryLimitError):
+            decode(data, area=area, max_memory=292143)
+
+    def test_stats(self):
+        """Test decoding with statistics."""
+        jpg = DIR_15444 / "2KLS" / "oj36.j2k"
+        with open(jpg, 'rb') as f:
+            data = f.read()
+
+        arr, stats = decode(data, stats=True)
+        assert (256, 256, 3) == arr.shape
+        assert np.array_equal(decode(data), arr)
+
+        times = stats['time']
+        for stage in ('header', 'decode', 'colour', 'upsample', 'pack'):
+            assert 0 <= times[stage] <= times['total']
+
+        assert times['decode'] > 0
+        assert 0 < times['read'] < times['total']
+        assert 0 < stats['bytes_read'] <= len(data)
+        assert stats['nr_reads'] > 0
+        assert stats['nr_skips'] >= 0
+        assert stats['nr_seeks'] >= 0
+        # Planes: 256 * 256 * 4 + 2 * 128 * 256 * 4
+        # Colour conversion: 3 * 256 * 256 * 4
+        # Output: 256 * 256 * 3
+        assert 524288 + 786432 + 196608 == stats['peak_memory']
+
+        messages = stats['messages']
+        assert [] == messages['error']
+        assert [] == messages['warning']
+        assert "Main header has been correctly decoded." in messages['info']
+
+        arr, stats = decode(data, reshape=False, stats=True)
+        assert (256 * 256 * 3,) == arr.shape
+
+    def test_error_messages(self):
+        """Test the openjpeg error messages are included in the exception."""
+        jpg = DIR_15444 / "2KLS" / "oj36.j2k"
+        with open(jpg, 'rb') as f:
+            data = f.read()
+
+        msg = (
+            r"Error decoding the J2K data: failed to decode image - "
+            r"\S+"
+        )
+        with pytest.raises(RuntimeError, match=msg):
+            decode(data[:200])
+
+    @pytest.mark.parametrize(
+        "dtype, bits", [("u1", 8), ("u2", 12), ("i2", 16)]
+    )
+    def test_planar(self, dtype, bits):
+        """Test decoding with each component written contiguously."""
+        rng = np.random.default_rng(0)
+        info = np.iinfo(dtype)
+        arr = rng.integers(
+            max(info.min, -2**(bits - 1)),
+            min(info.max, 2**bits - 1),
+            size=(65, 47, 3),
+            dtype=dtype,
+        )
+        data = encode(arr, bits_stored=bits, use_mct=False)
+        planar = decode(data, planar=True)
+        assert (3, 65, 47) == planar.shape
+        assert np.array_equal(planar, arr.transpose(2, 0, 1))
+
+        planar = decode(data, planar=True, reshape=False)
+        assert np.array_equal(
+            planar.view(dtype), arr.transpose(2, 0, 1).ravel()
+        )
+
+        # Lower resolution levels are also planar
+        flat = _openjpeg.decode(data, 0, levels=1, planar=True)
+        level = flat[planar.size:].view(dtype).reshape(3, 33, 24)
+        assert np.array_equal(level, decode(data, reduce=1, planar=True))
+
+    def test_planar_single_component(self):
+        """Test planar decoding of a single component image."""
+        arr = np.arange(64 * 48, dtype="u2").reshape(64, 48)
+        data = encode(arr, bits_stored=12)
+        assert np.array_equal(decode(data, planar=True), arr)
+
+    def test_rescale(self):
+        """Test decoding to float32 with a rescale slope and intercept."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(-2048, 2048, size=(65, 47), dtype="i2")
+        data = encode(arr, bits_stored=12)
+        out = decode(data, rescale=(1.5, -1024))
+        assert out.dtype == np.float32
+        assert (65, 47) == out.shape
+        reference = arr.astype("f4") * np.float32(1.5) - np.float32(1024)
+        assert np.array_equal(out, reference)
+
+        out = decode(data, rescale=(1, 0), reshape=False)
+        assert (65 * 47 * 4, ) == out.shape
+        assert np.array_equal(out.view("f4"), arr.ravel())
+
+        out = decode(data, rescale=(2, 0), area=(8, 4, 32, 24), reduce=1)
+        reference = decode(data, area=(8, 4, 32, 24), reduce=1) * 2
+        assert np.array_equal(out, reference)
+
+        # Multiple components
+        rgb = rng.integers(0, 256, size=(20, 30, 3), dtype="u1")
+        data = encode(rgb, use_mct=False)
+        out = decode(data, rescale=(0.5, 10), planar=True)
+        assert (3, 20, 30) == out.shape
+        assert np.array_equal(out, rgb.transpose(2, 0, 1) * 0.5 + 10)
+
+        msg = "'levels' cannot be used with 'rescale' or 'window'"
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(data, 0, levels=1, rescale=(1, 0))
+
+    def test_window(self):
+        """Test decoding to uint8 with a window applied."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(-2048, 2048, size=(65, 47), dtype="i2")
+        data = encode(arr, bits_stored=12)
+
+        def linear(x, center, width):
+            # DICOM Standard, Part 3, C.11.2.1.2.1
+            y = ((x - (center - 0.5)) / (width - 1) + 0.5) * 255
+            y[x <= center - 0.5 - (width - 1) / 2] = 0
+            y[x > center - 0.5 + (width - 1) / 2] = 255
+            return np.floor(y + 0.5)
+
+        def sigmoid(x, center, width):
+            # DICOM Standard, Part 3, C.11.2.1.3.1
+            y = 255 / (1 + np.exp(-4 * (x - center) / width))
+            return np.floor(y + 0.5)
+
+        out = decode(data, window=(40, 400))
+        assert out.dtype == np.uint8
+        assert (65, 47) == out.shape
+        reference = linear(arr.astype("f8"), 40, 400)
+        assert np.abs(out - reference).max() <= 1
+        assert 0 in out and 255 in out
+
+        out = decode(data, window=(40, 400), rescale=(2, -100))
+        reference = linear(arr * 2.0 - 100, 40, 400)
+        assert np.abs(out - reference).max() <= 1
+
+        out = decode(data, window=(40, 400), voi_function="SIGMOID")
+        reference = sigmoid(arr.astype("f8"), 40, 400)
+        assert np.abs(out - reference).max() <= 1
+
+        # A width of 1 is a threshold
+        out = decode(data, window=(0.5, 1))
+        assert np.array_equal(out, np.where(arr > 0, 255, 0))
+
+        # Thumbnail
+        out = decode(data, window=(40, 400), reduce=2)
+        assert (17, 12) == out.shape
+        reference = linear(decode(data, reduce=2).astype("f8"), 40, 400)
+        assert np.abs(out - reference).max() <= 1
+
+    def test_window_invalid_raises(self):
+        """Test invalid window parameters raise an exception."""
+        data = encode(np.zeros((16, 16), dtype="u1"))
+        msg = "Unsupported 'voi_function' value: LINEAR_EXACT"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, window=(40, 400), voi_function="LINEAR_EXACT")
+
+        msg = "The window width must be greater than or equal to 1"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, window=(40, 0.5))
+
+        msg = "The window width must be greater than 0"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, window=(40, 0), voi_function="SIGMOID")
+
+        msg = "'levels' cannot be used with 'rescale' or 'window'"
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(data, 0, levels=1, window=(40, 400))
+
+    @pytest.mark.parametrize("layout", ["RGBA", "BGRA"])
+    def test_layout(self, layout):
+        """Test decoding to RGBA and BGRA pixels."""
+        rng = np.random.default_rng(0)
+        rgb = rng.integers(0, 256, size=(20, 30, 3), dtype="u1")
+        order = [0, 1, 2] if layout == "RGBA" else [2, 1, 0]
+        data = encode(rgb)
+        out = decode(data, layout=layout)
+        assert out.dtype == np.uint8
+        assert (20, 30, 4) == out.shape
+        assert np.array_equal(out[..., :3], rgb[..., order])
+        assert np.all(out[..., 3] == 255)
+
+        # Grayscale is replicated
+        data = encode(rgb[..., 0])
+        out = decode(data, layout=layout)
+        for idx in range(3):
+            assert np.array_equal(out[..., idx], rgb[..., 0])
+
+        # With a window
+        arr = rng.integers(0, 2**12, size=(20, 30), dtype="u2")
+        data = encode(arr, bits_stored=12)
+        out = decode(data, layout=layout, window=(2048, 4096), reduce=1)
+        assert (10, 15, 4) == out.shape
+        reference = decode(data, window=(2048, 4096), reduce=1)
+        assert np.array_equal(out[..., 1], reference)
+
+        out = np.zeros((4, 20, 30), dtype="u1").transpose(1, 2, 0)
+        decode_into(data, out, layout=layout, window=(2048, 4096))
+        assert np.array_equal(out[..., 0], decode(data, window=(2048, 4096)))
+
+    def test_layout_signed(self):
+        """Test signed samples are offset so the minimum is 0."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(-128, 128, size=(20, 30, 3), dtype="i1")
+        arr[0, 0] = [-128, -1, 127]
+        data = encode(arr)
+        out = decode(data, layout="RGBA")
+        assert out.dtype == np.uint8
+        assert [0, 127, 255] == out[0, 0, :3].tolist()
+        assert np.array_equal(out[..., :3], (arr.astype("i2") + 128))
+        assert np.all(out[..., 3] == 255)
+
+    @staticmethod
+    def add_alpha(data):
+        """Return JP2 `data` with a Channel Definition box marking the last
+        of its 3 components as alpha.
+        """
+        cdef = struct.pack(">IIH", 28, 0x63646566, 3)
+        cdef += struct.pack(">3H", 0, 0, 1)
+        cdef += struct.pack(">3H", 1, 0, 2)
+        cdef += struct.pack(">3H", 2, 1, 0)
+        offset = data.index(b"jp2h") - 4
+        length = struct.unpack(">I", data[offset:offset + 4])[0]
+        return b"".join([
+            data[:offset],
+            struct.pack(">I", length + len(cdef)),
+            data[offset + 4:offset + length],
+            cdef,
+            data[offset + length:],
+        ])
+
+    def test_layout_alpha(self):
+        """Test the alpha samples are from the component marked as alpha."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(0, 256, size=(20, 30, 3), dtype="u1")
+        data = self.add_alpha(encode(arr, use_mct=False, codec_format=2))
+
+        out = decode(data, layout="RGBA")
+        assert np.array_equal(out[..., 3], arr[..., 2])
+        assert np.array_equal(out[..., 0], arr[..., 0])
+
+    def test_layout_alpha_scaled(self):
+        """Test alpha samples with fewer than 8-bits are scaled up."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(0, 2, size=(20, 30, 3), dtype="u1")
+        data = encode(arr, bits_stored=1, use_mct=False, codec_format=2)
+        data = self.add_alpha(data)
+
+        out = decode(data, layout="RGBA")
+        assert np.array_equal(out[..., 3], arr[..., 2] * 255)
+
+    def test_layout_invalid_raises(self):
+        """Test invalid layout parameters raise an exception."""
+        data = encode(np.zeros((16, 16), dtype="u2"), bits_stored=12)
+        msg = "Unsupported 'layout' value: ARGB"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, layout="ARGB")
+
+        msg = "'layout' requires 8-bit samples or 'window' to be used"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, layout="RGBA")
+
+        with pytest.raises(ValueError, match=msg):
+            decode(data, layout="RGBA", rescale=(1, 0))
+
+        msg = "'layout' cannot be used with 'levels' or 'planar'"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, layout="RGBA", window=(40, 400), planar=True)
+
+
+def _segment(marker, payload):
+    """Return a marker segment."""
+    return struct.pack(">HH", marker, len(payload) + 2) + payload
+
+
+def htj2k_codestream(ht=True):
+    """Return a 4x4 8-bit HTJ2K codestream with a single code-block.
+
+    The code-block has a single HT cleanup pass and there are no wavelet
+    decompositions, so the decoded samples are the code-block's
+    coefficients. If `ht` is ``False`` then the CAP marker segment and the
+    HT code-block style are left out.
+    """
+    # Rsiz with the Part 15 capabilities flag
+    siz = struct.pack(">H8IH", 0x4000 if ht else 0, 4, 4, 0, 0, 4, 4, 0, 0, 1)
+    siz += bytes([7, 1, 1])
+    # Pcap with Part 15, Ccap15 of 0 (HT only, single HT set)
+    cap = struct.pack(">IH", 0x00020000, 0)
+    # LRCP, 1 layer, no MCT, no decompositions, 4x4 code-blocks, 5/3
+    cod = bytes([0, 0, 0, 1, 0, 0, 0, 0, 0x40 if ht else 0, 1])
+    qcd = bytes([0x40, 8 << 3])
+    # Packet header: non-empty, included, 6 missing MSBs, 1 pass, 5 bytes
+    header = bytes([0xC0, 0x94])
+    # HT cleanup segment with a 2 byte MEL/VLC suffix (Scup)
+    block = b"\xbc\x5f\x16\x72\x00"
+    sot = struct.pack(">HIBB", 0, 14 + len(header) + len(block), 0, 1)
+
+    data = b"\xff\x4f" + _segment(0xFF51, siz)
+    if ht:
+        data += _segment(0xFF50, cap)
+
+    data += _segment(0xFF52, cod) + _segment(0xFF5C, qcd)
+    data += _segment(0xFF90, sot) + b"\xff\x93" + header + block
+    return data + b"\xff\xd9"
+
+
+class TestDecodeHTJ2K(object):
+    """Tests for decoding High-Throughput JPEG 2000 codestreams."""
+    def setup_method(self):
+        self.data = htj2k_codestream()
+        self.reference = np.asarray(
+            [
+                [190, 66, 138, 122],
+                [128, 14, 134, 122],
+                [128, 128, 128, 128],
+                [128, 128, 128, 128],
+            ],
+            dtype="u1",
+        )
+
+    def test_decode(self):
+        """Test decoding the HT code-block."""
+        arr = decode(self.data)
+        assert arr.dtype == np.uint8
+        assert np.array_equal(arr, self.reference)
+
+    def test_decode_pixel_data(self):
+        """Test decoding using the pixel data handler function."""
+        arr = decode_pixel_data(self.data)
+        assert np.array_equal(arr.ravel(), self.reference.ravel())
+
+    def test_not_ht(self):
+        """Test the samples come from the HT block decoder."""
+        # Without the HT code-block style the data is read as an empty
+        #   Part 1 code-block instead
+        arr = decode(htj2k_codestream(ht=False))
+        assert np.array_equal(arr, np.full((4, 4), 128, dtype="u1"))
+
+
+class TestDecodeInto(object):
+    """Tests for decode_into()."""
+    def setup_method(self):
+        """Setup the tests."""
+        rng = np.random.default_rng(0)
+        self.arr = rng.integers(0, 2**12, size=(65, 47, 3), dtype="u2")
+        self.data = encode(self.arr, bits_stored=12, use_mct=False)
+
+    def test_contiguous(self):
+        """Test decoding into a contiguous array."""
+        out = np.zeros((65, 47, 3), dtype="u2")
+        assert decode_into(self.data, out) is out
+        assert np.array_equal(out, self.arr)
+
+    def test_mosaic(self):
+        """Test decoding into a tile position of a larger array."""
+        mosaic = np.zeros((200, 200, 3), dtype="u2")
+        decode_into(self.data, mosaic[10:75, 20:67])
+        assert np.array_equal(mosaic[10:75, 20:67], self.arr)
+        mosaic[10:75, 20:67] = 0
+        assert not np.any(mosaic)
+
+    def test_strided(self):
+        """Test decoding into arrays with non-contiguous strides."""
+        # Channels first batch
+        batch = np.zeros((2, 3, 65, 47), dtype="u2")
+        decode_into(self.data, batch[1].transpose(1, 2, 0))
+        assert np.array_equal(batch[1], self.arr.transpose(2, 0, 1))
+        assert not np.any(batch[0])
+
+        out = np.asfortranarray(np.zeros((65, 47, 3), dtype="u2"))
+        decode_into(self.data, out)
+        assert np.array_equal(out, self.arr)
+
+        out = np.zeros((65, 47, 3), dtype="u2")[::-1, ::-1]
+        decode_into(self.data, out)
+        assert np.array_equal(out, self.arr)
+
+        out = np.zeros((130, 94, 3), dtype="u2")
+        decode_into(self.data, out[::2, ::2])
+        assert np.array_equal(out[::2, ::2], self.arr)
+        assert not np.any(out[1::2])
+
+    def test_single_component(self):
+        """Test decoding a single component image into a column slice."""
+        arr = self.arr[..., 0].astype("i2") - 2048
+        data = encode(arr, bits_stored=12)
+        volume = np.zeros((65, 47, 4), dtype="i2", order="F")
+        decode_into(data, volume[..., 2])
+        assert np.array_equal(volume[..., 2], arr)
+
+    def test_area_reduce(self):
+        """Test decoding an area at a lower resolution."""
+        out = np.zeros((10, 12, 3), dtype="u2")
+        area = (8, 4, 32, 24)
+        decode_into(self.data, out, area=area, reduce=1)
+        assert np.array_equal(out, decode(self.data, area=area, reduce=1))
+
+    def test_rescale(self):
+        """Test decoding into a float32 array with a rescale applied."""
+        out = np.zeros((3, 65, 47), dtype="f4").transpose(1, 2, 0)
+        decode_into(self.data, out, rescale=(0.25, -1))
+        assert np.array_equal(out, self.arr * 0.25 - 1)
+
+        msg = (
+            r"The dtype of 'out' \(uint16\) doesn't match the dtype of the "
+            r"decoded image \(float32\)"
+        )
+        with pytest.raises(ValueError, match=msg):
+            decode_into(self.data, np.zeros_like(self.arr), rescale=(1, 0))
+
+    def test_invalid_out_raises(self):
+        """Test an invalid output array raises an exception."""
+        msg = "'out' must be a numpy.ndarray"
+        with pytest.raises(TypeError, match=msg):
+            decode_into(self.data, bytearray(65 * 47 * 6))
+
+        msg = (
+            r"The shape of 'out' \(65, 47\) doesn't match the shape of the "
+            r"decoded image \(65, 47, 3\)"
+        )
+        with pytest.raises(ValueError, match=msg):
+            decode_into(self.data, np.zeros((65, 47), dtype="u2"))
+
+        msg = (
+            r"The dtype of 'out' \(int16\) doesn't match the dtype of the "
+            r"decoded image \(uint16\)"
+        )
+        with pytest.raises(ValueError, match=msg):
+            decode_into(self.data, np.zeros((65, 47, 3), dtype="i2"))
+
+        out = np.zeros((65, 47, 3), dtype="u2")
+        out.flags.writeable = False
+        with pytest.raises(ValueError, match="'out' must be writeable"):
+            decode_into(self.data, out)
+
+        msg = "'out' cannot be used with 'levels' or 'planar'"
+        out.flags.writeable = True
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(self.data, 0, planar=True, out=out)
+
+
+class TestDecodePartial(object):
+    """Tests for decode_partial()."""
+    def setup_method(self):
+        """Setup the tests."""
+        y, x = np.mgrid[0:128, 0:128]
+        arr = (np.sin(x / 7) * np.cos(y / 11) + 1) * 100
+        arr += np.random.default_rng(0).normal(0, 10, size=arr.shape)
+        self.arr = np.clip(arr, 0, 255).astype("u1")
+        self.data = encode(self.arr, compression_ratios=[80, 20, 5, 1])
+
+    def test_complete(self):
+        """Test decoding complete data."""
+        arr, is_partial = decode_partial(self.data)
+        assert not is_partial
+        assert np.array_equal(arr, decode(self.data))
+
+    @pytest.mark.parametrize("j2k_format", [0, 2])
+    def test_truncated(self, j2k_format):
+        """Test decoding truncated data gives a lower quality image."""
+        data = encode(
+            self.arr, compression_ratios=[80, 20, 5, 1], codec_format=j2k_format
+        )
+        reference = decode(data).astype("i4")
+        errors = []
+        for length in (len(data) // 8, len(data) // 2, len(data) - 2):
+            arr, is_partial = decode_partial(data[:length])
+            assert is_partial
+            assert arr.shape == (128, 128)
+            errors.append(np.abs(arr.astype("i4") - reference).mean())
+
+        # More data gives a better image
+        assert errors[0] > errors[1] > errors[2]
+
+        with pytest.raises(RuntimeError, match="failed to decode image"):
+            decode(data[:len(data) // 2])
+
+    def test_truncated_tiles(self):
+        """Test decoding data truncated between tiles."""
+        data = encode(self.arr, tile_size=(64, 64))
+        arr, is_partial = decode_partial(data[:len(data) // 2])
+        assert is_partial
+        # The first tile is complete
+        assert np.array_equal(arr[:64, :64], self.arr[:64, :64])
+        # The last tile is missing
+        assert np.all(arr[64:, 64:] == 0)
+
+    def test_truncated_header_raises(self):
+        """Test an incomplete main header raises an exception."""
+        with pytest.raises(RuntimeError, match="failed to read the header"):
+            decode_partial(self.data[:40])
+
+    def test_reshape_false(self):
+        """Test decoding without reshaping."""
+        arr, is_partial = decode_partial(self.data, reshape=False)
+        assert arr.shape == (128 * 128, )
+        assert not is_partial
+
+
+class TestDecodePyramid(object):
+    """Tests for decode_pyramid()."""
+    def setup_method(self):
+        """Setup the tests."""
+        rng = np.random.default_rng(0)
+        self.arr = rng.integers(0, 2**12, size=(301, 259), dtype="u2")
+
+    @pytest.mark.parametrize("tile_size", [None, (64, 64), (128, 96)])
+    def test_lossless(self, tile_size):
+        """Test the levels match decoding with reduce for lossless data."""
+        data = encode(self.arr, bits_stored=12, tile_size=tile_size)
+        pyramid = decode_pyramid(data, levels=4)
+        assert len(pyramid) == 4
+        assert np.array_equal(pyramid[0], self.arr)
+        for level, arr in enumerate(pyramid):
+            assert arr.dtype == np.uint16
+            assert np.array_equal(arr, decode(data, reduce=level))
+
+    def test_signed(self):
+        """Test the levels for signed data."""
+        arr = (self.arr.astype("i2") - 2048)
+        data = encode(arr, bits_stored=12, codec_format=2)
+        pyramid = decode_pyramid(data, levels=3)
+        for level, arr in enumerate(pyramid):
+            assert arr.dtype == np.int16
+            assert np.array_equal(arr, decode(data, reduce=level))
+
+    def test_rgb(self):
+        """Test the levels for multiple component data."""
+        rng = np.random.default_rng(0)
+        arr = rng.integers(0, 256, size=(100, 90, 3), dtype="u1")
+        data = encode(arr, use_mct=False)
+        pyramid = decode_pyramid(data, levels=3)
+        assert [arr.shape for arr in pyramid] == [
+            (100, 90, 3), (50, 45, 3), (25, 23, 3)
+        ]
+        for level, arr in enumerate(pyramid):
+            assert np.array_equal(arr, decode(data, reduce=level))
+
+        # The multiple component transform isn't reversed exactly
+        data = encode(arr, use_mct=True)
+        pyramid = decode_pyramid(data, levels=3)
+        for level, arr in enumerate(pyramid):
+            reference = decode(data, reduce=level).astype("i4")
+            assert np.abs(arr.astype("i4") - reference).max() < 8
+
+    def test_single_level(self):
+        """Test a single level is the full resolution image."""
+        data = encode(self.arr, bits_stored=12)
+        pyramid = decode_pyramid(data, levels=1)
+        assert len(pyramid) == 1
+        assert np.array_equal(pyramid[0], self.arr)
+
+    def test_reshape_false(self):
+        """Test decoding without reshaping."""
+        data = encode(self.arr, bits_stored=12)
+        pyramid = decode_pyramid(data, levels=2, reshape=False)
+        assert [arr.shape for arr in pyramid] == [
+            (301 * 259 * 2, ), (151 * 130 * 2, )
+        ]
+
+    def test_invalid_levels_raises(self):
+        """Test invalid levels raise an exception."""
+        data = encode(self.arr, bits_stored=12)
+        msg = "'levels' must be greater than 0"
+        with pytest.raises(ValueError, match=msg):
+            decode_pyramid(data, levels=0)
+
+        msg = "'levels' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(data, 0, levels=-1)
+
+        msg = "'levels' cannot be used with 'area' or 'reduce'"
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(data, 0, levels=1, reduce=1)
+
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.decode(data, 0, levels=1, area=(0, 0, 10, 10))
+
+
+class TestProgressiveDecoder(object):
+    """Tests for ProgressiveDecoder."""
+    def setup_method(self):
+        """Setup the tests."""
+        y, x = np.mgrid[0:128, 0:128]
+        arr = (np.sin(x / 7) * np.cos(y / 11) + 1) * 100
+        arr += np.random.default_rng(0).normal(0, 10, size=arr.shape)
+        self.arr = np.clip(arr, 0, 255).astype("u1")
+        self.data = encode(self.arr, compression_ratios=[80, 20, 5, 1])
+
+    def test_refinement(self):
+        """Test feeding more data gives a better image."""
+        reference = decode(self.data).astype("i4")
+        decoder = ProgressiveDecoder()
+        assert decoder.decode() is None
+        assert decoder.is_partial
+
+        # Not enough data for the header
+        decoder.feed(self.data[:40])
+        assert decoder.decode() is None
+        assert 40 == decoder.nr_bytes
+
+        errors = []
+        chunk_size = len(self.data) // 4
+        for start in range(40, len(self.data), chunk_size):
+            decoder.feed(self.data[start:start + chunk_size])
+            arr = decoder.decode()
+            assert arr.shape == (128, 128)
+            errors.append(np.abs(arr.astype("i4") - reference).mean())
+
+        assert errors == sorted(errors, reverse=True)
+        assert len(self.data) == decoder.nr_bytes
+        assert not decoder.is_partial
+        assert np.array_equal(decoder.decode(), decode(self.data))
+
+    def test_no_new_data(self):
+        """Test the image isn't decoded again without more data."""
+        decoder = ProgressiveDecoder()
+        decoder.feed(self.data[:len(self.data) // 2])
+        arr = decoder.decode()
+        assert decoder.is_partial
+        assert decoder.decode() is arr
+
+        decoder.feed(b"")
+        assert decoder.decode() is arr
+
+    def test_jp2(self):
+        """Test refining a JP2 file."""
+        data = encode(self.arr, compression_ratios=[80, 1], codec_format=2)
+        decoder = ProgressiveDecoder()
+        decoder.feed(data[:6])
+        assert decoder.decode() is None
+        decoder.feed(data[6:len(data) // 2])
+        assert decoder.decode().shape == (128, 128)
+        assert decoder.is_partial
+        decoder.feed(data[len(data) // 2:])
+        assert np.array_equal(decoder.decode(), decode(data))
+        assert not decoder.is_partial
+
+    def test_corrupt_tile_part_raises(self):
+        """Test a corrupt tile-part after a valid header raises."""
+        data = encode(self.arr, compression_ratios=[80, 1], tile_size=(64, 64))
+        idx = data.index(b"\xff\x90")
+        decoder = ProgressiveDecoder()
+        # Part way through the first tile-part header
+        decoder.feed(data[:idx + 4])
+        assert decoder.decode() is None
+
+        # Invalid Isot tile index
+        decoder.feed(b"\xff\xff" + data[idx + 6:])
+        with pytest.raises(RuntimeError, match="failed to decode image"):
+            decoder.decode()
+
+    def test_invalid_data_raises(self):
+        """Test data that isn't JPEG 2000 raises."""
+        decoder = ProgressiveDecoder()
+        decoder.feed(b"\x00" * 8)
+        assert decoder.decode() is None
+
+        decoder.feed(b"\x00" * 8)
+        with pytest.raises(ValueError, match="No matching JPEG 2000 format"):
+            decoder.decode()
+
+    def test_reset(self):
+        """Test resetting the decoder."""
+        decoder = ProgressiveDecoder(reshape=False)
+        decoder.feed(self.data)
+        assert decoder.decode().shape == (128 * 128, )
+        decoder.reset()
+        assert 0 == decoder.nr_bytes
+        assert decoder.decode() is None
+        assert decoder.is_partial
+
+
+class TestDecodeAsync(object):
+    """Tests for decode_async()."""
+    def setup_method(self):
+        """Setup the tests."""
+        rng = np.random.default_rng(0)
+        self.arr = rng.integers(0, 2**12, size=(256, 256), dtype="u2")
+        self.data = encode(self.arr, tile_size=(64, 64))
+
+    def test_decode(self):
+        """Test decoding bytes."""
+        arr = asyncio.run(decode_async(self.data))
+        assert np.array_equal(arr, self.arr)
+
+        arr = asyncio.run(decode_async(bytearray(self.data), reshape=False))
+        assert arr.shape == (256 * 256 * 2, )
+
+    def test_decode_path_and_file(self, tmp_path):
+        """Test decoding a path and a file-like."""
+        path = tmp_path / "test.j2k"
+        path.write_bytes(self.data)
+        arr = asyncio.run(decode_async(path))
+        assert np.array_equal(arr, self.arr)
+
+        arr = asyncio.run(decode_async(BytesIO(self.data)))
+        assert np.array_equal(arr, self.arr)
+
+    def test_concurrent(self):
+        """Test decoding concurrently."""
+        async def main():
+            return await asyncio.gather(
+                *[decode_async(self.data) for _ in range(4)]
+            )
+
+        for arr in asyncio.run(main()):
+            assert np.array_equal(arr, self.arr)
+
+    def test_invalid_format_raises(self):
+        """Test an invalid j2k_format raises."""
+        msg = "Unsupported 'j2k_format' value: 3"
+        with pytest.raises(ValueError, match=msg):
+            asyncio.run(decode_async(self.data, j2k_format=3))
+
+    def test_invalid_data_raises(self):
+        """Test invalid data raises."""
+        with pytest.raises(RuntimeError, match="failed to read the header"):
+            asyncio.run(decode_async(self.data[:40], j2k_format=0))
+
+    def test_cancelled(self):
+        """Test cancelling the awaiting task."""
+        async def main():
+            task = asyncio.create_task(decode_async(self.data))
+            await asyncio.sleep(0)
+            task.cancel()
+            await task
+
+        with pytest.raises(asyncio.CancelledError):
+            asyncio.run(main())
+
+    def test_cancel_token(self):
+        """Test a cancelled token aborts decoding."""
+        token = _openjpeg.CancelToken()
+        assert not token.cancelled
+        token.cancel()
+        assert token.cancelled
+        with pytest.raises(DecodeCancelledError, match="was cancelled"):
+            _openjpeg.decode(self.data, 0, cancel_token=token)
+
+
+def wait_until(deadline):
+    """Return once the :func:`time.monotonic` `deadline` has passed."""
+    while time.monotonic() <= deadline:
+        time.sleep(0.01)
+
+
+class InterruptingReader(BytesIO):
+    """A file-like that calls `callback` once, when a read reaches `offset`."""
+    def __init__(self, data, offset, callback):
+        super().__init__(data)
+        self._offset = offset
+        self._callback = callback
+        self.interrupted = False
+
+    def read(self, size=-1):
+        data = super().read(size)
+        if not self.interrupted and self.tell() >= self._offset:
+            self.interrupted = True
+            self._callback()
+
+        return data
+
+
+class TestDecodeCancel(object):
+    """Tests for decode() with a cancel_token or deadline."""
+    def setup_method(self):
+        """Setup the tests."""
+        rng = np.random.default_rng(0)
+        self.arr = rng.integers(0, 2**16, size=(1024, 1024), dtype="u2")
+        self.data = encode(self.arr, tile_size=(128, 128))
+
+    def test_not_cancelled(self):
+        """Test decoding with a token and deadline that aren't used."""
+        arr = decode(
+            self.data, cancel_token=CancelToken(), deadline=time.monotonic() + 60
+        )
+        assert np.array_equal(arr, self.arr)
+
+    def test_cancelled(self):
+        """Test decoding with a cancelled token raises."""
+        token = CancelToken()
+        token.cancel()
+        with pytest.raises(DecodeCancelledError, match="was cancelled"):
+            decode(self.data, cancel_token=token)
+
+    def test_cancelled_while_decoding(self):
+        """Test cancelling part way through decoding."""
+        token = CancelToken()
+        # Past the first read of the header, which reads up to 1 MiB
+        offset = len(self.data) * 3 // 4
+        assert offset > 2**20
+        stream = InterruptingReader(self.data, offset, token.cancel)
+        with pytest.raises(DecodeCancelledError):
+            decode(stream, cancel_token=token)
+
+        assert stream.interrupted
+        assert token.cancelled
+
+    def test_deadline_passed(self):
+        """Test a deadline that's already passed raises."""
+        msg = "The deadline for decoding has passed"
+        with pytest.raises(DecodeTimeoutError, match=msg):
+            decode(self.data, deadline=time.monotonic() - 1)
+
+    def test_deadline(self):
+        """Test decoding that takes longer than the deadline raises."""
+        deadline = time.monotonic() + 0.5
+        stream = InterruptingReader(
+            self.data, len(self.data) * 3 // 4, lambda: wait_until(deadline)
+        )
+        msg = "didn't finish before the deadline"
+        with pytest.raises(DecodeTimeoutError, match=msg) as exc:
+            decode(stream, deadline=deadline)
+
+        assert stream.interrupted
+        # Is also a TimeoutError and a DecodeCancelledError
+        assert isinstance(exc.value, TimeoutError)
+        assert isinstance(exc.value, DecodeCancelledError)
+
+    def test_deadline_async(self):
+        """Test decode_async() with a deadline."""
+        # The stream is read before decoding, so the deadline has passed by
+        #   the time the decoding starts
+        deadline = time.monotonic() + 0.1
+        stream = InterruptingReader(self.data, 0, lambda: wait_until(deadline))
+        with pytest.raises(DecodeTimeoutError):
+            asyncio.run(decode_async(stream, deadline=deadline))
+
+        assert stream.interrupted
+
+
+class TestPlanePool(object):
+    """Tests for PlanePool."""
+    def test_init(self):
+        """Test creating a new pool."""
+        pool = PlanePool()
+        assert 128 * 1024 * 1024 == pool.max_size
+        assert 0 == pool.size
+        assert 0 == pool.hits
+        assert 0 == pool.misses
+
+        pool = PlanePool(max_size=1024)
+        assert 1024 == pool.max_size
+
+    def test_invalid_max_size_raises(self):
+        """Test a negative max_size raises."""
+        msg = r"'max_size' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            PlanePool(max_size=-1)
+
+    def test_recycled(self):
+        """Test planes are recycled between decodes."""
+        jpg = DIR_15444 / "2KLS" / "oj36.j2k"
+        with open(jpg, 'rb') as f:
+            data = f.read()
+
+        reference = decode(data)
+
+        pool = PlanePool()
+        arr = decode(data, pool=pool)
+        assert 0 == pool.hits
+        assert pool.misses > 0
+        assert pool.size > 0
+        assert np.array_equal(reference, arr)
+
+        misses = pool.misses
+        arr = decode(data, pool=pool)
+        assert misses == pool.hits
+        assert misses == pool.misses
+        assert np.array_equal(reference, arr)
+
+        pool.clear()
+        assert 0 == pool.size
+
+    def test_too_small(self):
+        """Test a pool too small to hold any planes."""
+        jpg = DIR_15444 / "2KLS" / "oj36.j2k"
+        with open(jpg, 'rb') as f:
+            data = f.read()
+
+        pool = PlanePool(max_size=0)
+        decode(data, pool=pool)
+        decode(data, pool=pool)
+        assert 0 == pool.hits
+        assert 0 == pool.size
+
 
 @pytest.mark.skipif(not HAS_PYDICOM, reason="No pydicom")
 class TestDecodeDCM(object):
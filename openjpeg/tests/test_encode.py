@@ -0,0 +1,523 @@
+"""Tests for encoding with openjpeg."""
+
+import numpy as np
+import pytest
+
+import _openjpeg
+from openjpeg.utils import (
+    encode, encode_frames, decode, get_parameters, transcode
+)
+
+
+def random_array(shape, dtype, bits_stored, seed=0):
+    """Return an array of random values that fit within `bits_stored`."""
+    rng = np.random.default_rng(seed)
+    if np.dtype(dtype).kind == "u":
+        minimum, maximum = 0, 2**bits_stored - 1
+    else:
+        minimum, maximum = -2**(bits_stored - 1), 2**(bits_stored - 1) - 1
+
+    return rng.integers(
+        minimum, maximum, size=shape, endpoint=True
+    ).astype(dtype)
+
+
+class TestEncode(object):
+    """Tests for encode()."""
+    @pytest.mark.parametrize(
+        "dtype, bits_stored",
+        [
+            ("u1", 1), ("u1", 7), ("u1", 8), ("i1", 8),
+            ("u2", 12), ("u2", 16), ("i2", 12), ("i2", 16),
+        ]
+    )
+    def test_lossless_monochrome(self, dtype, bits_stored):
+        """Test round tripping single component images."""
+        arr = random_array((64, 75), dtype, bits_stored)
+        data = encode(arr, bits_stored=bits_stored)
+        assert data.startswith(b"\xff\x4f\xff\x51")
+
+        out = decode(data)
+        assert out.dtype == arr.dtype
+        assert np.array_equal(out, arr)
+
+        meta = get_parameters(data)
+        assert meta["precision"] == bits_stored
+        assert meta["is_signed"] == (arr.dtype.kind == "i")
+        assert meta["nr_components"] == 1
+
+    @pytest.mark.parametrize("dtype", ["u1", "u2"])
+    @pytest.mark.parametrize("use_mct", [True, False])
+    def test_lossless_rgb(self, dtype, use_mct):
+        """Test round tripping three component images."""
+        arr = random_array((50, 40, 3), dtype, 8)
+        data = encode(arr, use_mct=use_mct)
+
+        out = decode(data)
+        assert np.array_equal(out, arr)
+        assert get_parameters(data)["nr_components"] == 3
+
+    def test_jp2(self):
+        """Test encoding using the JP2 file format."""
+        arr = random_array((32, 32), "u1", 8)
+        data = encode(arr, codec_format=2)
+        assert data[4:8] == b"jP  "
+        assert np.array_equal(decode(data), arr)
+
+    def test_small(self):
+        """Test images smaller than the default number of resolutions."""
+        arr = random_array((1, 3), "u1", 8)
+        assert np.array_equal(decode(encode(arr)), arr)
+
+    def test_non_contiguous(self):
+        """Test non-contiguous and non-native byte ordered arrays."""
+        arr = random_array((64, 64), "u2", 16)[::2, ::3].astype(">u2")
+        assert np.array_equal(decode(encode(arr)), arr)
+
+    @pytest.mark.parametrize("nr_threads", [0, 2, 4])
+    def test_nr_threads(self, nr_threads):
+        """Test multi-threaded encoding gives the same output."""
+        arr = random_array((256, 256), "u2", 16)
+        data = encode(arr, nr_threads=nr_threads)
+        assert data == encode(arr)
+
+    def test_invalid_nr_threads_raises(self):
+        """Test an invalid number of threads raises an exception."""
+        msg = "'nr_threads' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), "u1"), nr_threads=-1)
+
+    def test_invalid_array_raises(self):
+        """Test invalid arrays raise exceptions."""
+        with pytest.raises(TypeError, match="'arr' must be a numpy ndarray"):
+            encode(b"\x00\x01")
+
+        msg = "The ndarray dtype must be uint8, int8, uint16 or int16"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), dtype="u4"))
+
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), dtype="f4"))
+
+        msg = r"The ndarray must have shape \(rows, columns\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8, 4), dtype="u1"))
+
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8,), dtype="u1"))
+
+        with pytest.raises(ValueError, match="must not be empty"):
+            encode(np.zeros((0, 8), dtype="u1"))
+
+    def test_invalid_bits_stored_raises(self):
+        """Test invalid bits stored values raise exceptions."""
+        msg = r"'bits_stored' must be in the range \(1, 8\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), dtype="u1"), bits_stored=12)
+
+        msg = r"values outside the range \(0, 1023\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.full((8, 8), 1024, dtype="u2"), bits_stored=10)
+
+        msg = r"values outside the range \(-512, 511\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.full((8, 8), -513, dtype="i2"), bits_stored=10)
+
+    @pytest.mark.parametrize("subsampling", [(1, 2), (2, 2)])
+    @pytest.mark.parametrize("shape", [(64, 32, 3), (63, 31, 3)])
+    def test_subsampling(self, subsampling, shape):
+        """Test encoding with subsampled chroma components."""
+        arr = random_array(shape, "u1", 8)
+        rows, columns = subsampling
+        for c in (1, 2):
+            # Make the chroma constant over each block so it's lossless
+            block = arr[::rows, ::columns, c]
+            block = block.repeat(rows, axis=0).repeat(columns, axis=1)
+            arr[..., c] = block[:shape[0], :shape[1]]
+
+        kwargs = {
+            "photometric_interpretation": "YBR_FULL", "codec_format": 2
+        }
+        reference = decode(encode(arr, **kwargs))
+        data = encode(arr, subsampling=subsampling, **kwargs)
+        assert len(data) < len(encode(arr, **kwargs))
+        assert np.array_equal(decode(data), reference)
+
+    def test_invalid_subsampling_raises(self):
+        """Test invalid subsampling values raise exceptions."""
+        arr = np.zeros((8, 8, 3), "u1")
+        msg = r"'subsampling' must be \(1, 1\), \(1, 2\) or \(2, 2\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(
+                arr, photometric_interpretation="YBR_FULL", subsampling=(2, 1)
+            )
+
+        msg = "'subsampling' requires a 'photometric_interpretation'"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, subsampling=(2, 2))
+
+    def test_invalid_photometric_interpretation_raises(self):
+        """Test invalid photometric interpretations raise exceptions."""
+        msg = "Unsupported 'photometric_interpretation' value: PALETTE"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), "u1"), photometric_interpretation="PALETTE")
+
+        msg = "requires 3 component"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), "u1"), photometric_interpretation="RGB")
+
+    def test_early_failure_message(self):
+        """Test failing before the message handlers are set gives no
+        stale openjpeg messages.
+        """
+        # Leave an openjpeg error message on the stack from a failed decode
+        with pytest.raises(RuntimeError):
+            decode(b"\xff\x4f\xff\x51\x00")
+
+        arr = np.zeros((8, 8, 2), "u1")
+        with pytest.raises(RuntimeError) as exc:
+            _openjpeg.encode(arr, 8, 1, False, 0)
+
+        assert str(exc.value) == (
+            "Error encoding the data: the number of samples per pixel must "
+            "be 1 or 3"
+        )
+
+    def test_invalid_codec_format_raises(self):
+        """Test an invalid codec format raises an exception."""
+        msg = "Unsupported 'codec_format' value: 1"
+        with pytest.raises(ValueError, match=msg):
+            encode(np.zeros((8, 8), "u1"), codec_format=1)
+
+    @pytest.mark.parametrize("codec_format", [0, 2])
+    def test_output_buffer_too_small(self, codec_format):
+        """Test encoding when the output size estimate is too small."""
+        arr = random_array((64, 64, 3), "u1", 8)
+        reference = _openjpeg.encode(arr, 8, 1, True, codec_format)
+
+        # Force the encoder to grow its own buffer
+        buffer = _openjpeg.encode(
+            arr, 8, 1, True, codec_format, size_hint=16
+        )
+        assert isinstance(buffer, bytes)
+        assert buffer == reference
+        assert np.array_equal(decode(buffer), arr)
+
+    @pytest.mark.parametrize("offset", [0, 1, 100000])
+    def test_output_buffer_shrunk(self, offset):
+        """Test the output is shrunk to the length of the encoded data."""
+        arr = random_array((64, 64), "u2", 12)
+        reference = _openjpeg.encode(arr, 12, 2, False, 0)
+
+        buffer = _openjpeg.encode(
+            arr, 12, 2, False, 0, size_hint=len(reference) + offset
+        )
+        assert len(buffer) == len(reference)
+        assert buffer == reference
+        assert np.array_equal(decode(buffer), arr)
+
+    def test_invalid_size_hint_raises(self):
+        """Test an invalid output size hint raises an exception."""
+        msg = "'size_hint' must be at least 1"
+        with pytest.raises(ValueError, match=msg):
+            _openjpeg.encode(
+                np.zeros((8, 8), "u1"), 8, 2, False, 0, size_hint=0
+            )
+
+
+def smooth_array(shape, dtype, bits_stored):
+    """Return a smooth image that compresses like a natural image."""
+    rows, columns = shape[:2]
+    y, x = np.mgrid[0:rows, 0:columns]
+    maximum = 2**bits_stored - 1
+    arr = (np.sin(x / 17) * np.cos(y / 23) + 1) * maximum / 2
+    if len(shape) == 3:
+        arr = np.stack([arr, arr[::-1], arr[:, ::-1]], axis=-1)
+
+    return arr.astype(dtype)
+
+
+def psnr(reference, arr, bits_stored):
+    """Return the peak signal-to-noise ratio (in dB) of `arr`."""
+    mse = np.mean((reference.astype("f8") - arr.astype("f8"))**2)
+    return 10 * np.log10((2**bits_stored - 1)**2 / mse)
+
+
+class TestEncodeLossy(object):
+    """Tests for encode() with lossy compression."""
+    def test_compression_ratios(self):
+        """Test encoding using compression ratio targets."""
+        arr = smooth_array((256, 256), "u2", 12)
+        lossless = encode(arr, bits_stored=12)
+        data = encode(arr, bits_stored=12, compression_ratios=[20])
+        assert len(data) < len(lossless)
+
+        out = decode(data)
+        assert out.dtype == arr.dtype
+        assert not np.array_equal(out, arr)
+        assert psnr(arr, out, 12) > 30
+
+    def test_signal_noise_ratios(self):
+        """Test encoding using PSNR targets."""
+        arr = smooth_array((256, 256), "u1", 8)
+        low = encode(arr, signal_noise_ratios=[30])
+        high = encode(arr, signal_noise_ratios=[30, 40])
+        assert len(low) < len(high)
+
+        # The targets are approximate
+        assert psnr(arr, decode(low), 8) > 25
+        assert psnr(arr, decode(high), 8) > 35
+
+    def test_quality_layers(self):
+        """Test the number of quality layers affects the output."""
+        arr = smooth_array((128, 128), "u1", 8)
+        single = encode(arr, compression_ratios=[5])
+        layered = encode(arr, compression_ratios=[40, 20, 5])
+        assert single != layered
+
+    def test_rgb(self):
+        """Test lossy encoding of RGB images."""
+        arr = smooth_array((128, 128, 3), "u1", 8)
+        data = encode(arr, compression_ratios=[10])
+        assert psnr(arr, decode(data), 8) > 30
+
+    def test_options(self):
+        """Test the resolution, code-block, progression and tile options."""
+        arr = smooth_array((256, 256), "u2", 16)
+        data = encode(
+            arr,
+            nr_resolutions=4,
+            codeblock_size=(32, 64),
+            progression_order="RPCL",
+            tile_size=(64, 128),
+        )
+        assert np.array_equal(decode(data), arr)
+
+        # COD marker segment: progression order and number of resolutions
+        idx = data.index(b"\xff\x52")
+        assert data[idx + 5] == 2
+        assert data[idx + 9] == 3
+        # Code-block width and height exponents (offset by 2)
+        assert data[idx + 10] == 4
+        assert data[idx + 11] == 3
+
+        # SIZ marker segment: tile width and height
+        idx = data.index(b"\xff\x51")
+        assert data[idx + 22:idx + 30] == (
+            b"\x00\x00\x00\x80\x00\x00\x00\x40"
+        )
+
+    def test_invalid_quality_raises(self):
+        """Test invalid quality layers raise exceptions."""
+        arr = np.zeros((8, 8), "u1")
+        msg = "Only one of 'compression_ratios' or 'signal_noise_ratios'"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, compression_ratios=[5], signal_noise_ratios=[30])
+
+        msg = "'compression_ratios' must be in decreasing order"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, compression_ratios=[5, 10])
+
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, compression_ratios=[0.5])
+
+        msg = "'signal_noise_ratios' must be in increasing order"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, signal_noise_ratios=[40, 30])
+
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, signal_noise_ratios=[0, 30])
+
+        msg = "No more than 100 quality layers may be used"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, compression_ratios=range(200, 99, -1))
+
+    def test_invalid_options_raises(self):
+        """Test invalid encoding options raise exceptions."""
+        arr = np.zeros((64, 64), "u1")
+        msg = r"'nr_resolutions' must be in the range \(1, 32\)"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, nr_resolutions=0)
+
+        msg = r"size \(16, 16\) is too small for 6 resolutions"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, nr_resolutions=6, tile_size=(16, 16))
+
+        msg = "'codeblock_size' must be a"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, codeblock_size=(48, 64))
+
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, codeblock_size=(128, 64))
+
+        msg = "Unsupported 'progression_order' value: ABCD"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, progression_order="ABCD")
+
+        msg = "'tile_size' must be a"
+        with pytest.raises(ValueError, match=msg):
+            encode(arr, tile_size=(0, 16))
+
+
+class TestEncodeFrames(object):
+    """Tests for encode_frames()."""
+    @pytest.mark.parametrize("nr_workers", [None, 1, 3])
+    def test_encode_frames(self, nr_workers):
+        """Test encoding multiple frames."""
+        arrays = [random_array((64, 64), "u1", 8, seed=ii) for ii in range(8)]
+        frames = encode_frames(arrays, nr_workers=nr_workers)
+        assert len(frames) == 8
+        for arr, data in zip(arrays, frames):
+            assert data == encode(arr)
+            assert np.array_equal(decode(data), arr)
+
+    def test_kwargs(self):
+        """Test the encoding parameters are used for every frame."""
+        arrays = [smooth_array((64, 64), "u2", 12) for ii in range(3)]
+        frames = encode_frames(
+            (arr for arr in arrays),
+            bits_stored=12,
+            compression_ratios=[10],
+        )
+        expected = encode(arrays[0], bits_stored=12, compression_ratios=[10])
+        assert frames == [expected] * 3
+
+    def test_empty(self):
+        """Test encoding no frames."""
+        assert encode_frames([]) == []
+
+    def test_error_raises(self):
+        """Test an invalid frame raises an exception."""
+        arrays = [np.zeros((8, 8), "u1"), np.zeros((8, 8), "f4")]
+        with pytest.raises(ValueError, match="The ndarray dtype must be"):
+            encode_frames(arrays)
+
+    def test_invalid_nr_workers_raises(self):
+        """Test an invalid number of workers raises an exception."""
+        msg = "'nr_workers' must be greater than 0"
+        with pytest.raises(ValueError, match=msg):
+            encode_frames([np.zeros((8, 8), "u1")], nr_workers=0)
+
+
+def get_cod(data):
+    """Return the Scod and SGcod/SPcod values from the COD marker."""
+    idx = data.index(b"\xff\x52")
+    length = int.from_bytes(data[idx + 2:idx + 4], "big")
+    return data[idx + 4:idx + 2 + length]
+
+
+class TestTranscode(object):
+    """Tests for transcode()."""
+    @pytest.mark.parametrize("bypass", [True, False])
+    def test_lossless(self, bypass):
+        """Test transcoding lossless data."""
+        arr = smooth_array((128, 128), "u2", 12)
+        src = encode(arr, bits_stored=12)
+        data = transcode(src, bypass=bypass)
+        assert np.array_equal(decode(data), arr)
+        assert get_parameters(data)["precision"] == 12
+
+        # Code-block style
+        assert get_cod(data)[8] == (1 if bypass else 0)
+
+    def test_lossy(self):
+        """Test transcoding lossy data gives the decoded image."""
+        arr = smooth_array((128, 128, 3), "u1", 8)
+        src = encode(arr, compression_ratios=[20])
+        data = transcode(src)
+        assert np.array_equal(decode(data), decode(src))
+
+        # Reversible 5/3 wavelet
+        assert get_cod(data)[9] == 1
+
+    def test_signed(self):
+        """Test the signedness is preserved."""
+        arr = random_array((32, 48), "i2", 10)
+        data = transcode(encode(arr, bits_stored=10))
+        assert np.array_equal(decode(data), arr)
+        meta = get_parameters(data)
+        assert meta["is_signed"]
+        assert meta["precision"] == 10
+
+    def test_layout(self):
+        """Test the tile layout and coding parameters are preserved."""
+        arr = smooth_array((256, 192), "u1", 8)
+        src = encode(
+            arr,
+            nr_resolutions=4,
+            codeblock_size=(32, 16),
+            progression_order="RPCL",
+            tile_size=(64, 128),
+        )
+        data = transcode(src, bypass=False)
+        assert np.array_equal(decode(data), arr)
+        assert get_cod(data) == get_cod(src)
+
+        idx = src.index(b"\xff\x51")
+        assert data[idx:idx + 40] == src[idx:idx + 40]
+
+    def test_bypass_noisy(self):
+        """Test the bypass mode with mostly bypassed code-block passes."""
+        # Noisy enough that most of the code-block passes are bypassed, see
+        # benchmarks/bench_decode.py for the decoding speed-up
+        arr = smooth_array((256, 256), "u2", 11)
+        arr += random_array((256, 256), "u2", 10)
+        src = encode(arr, bits_stored=12)
+        data = transcode(src, bypass=True)
+        assert np.array_equal(decode(data), arr)
+        assert get_cod(data)[8] & 0x01
+
+    @pytest.mark.parametrize("nr_decompositions", [5, 4])
+    def test_component_parameters(self, nr_decompositions):
+        """Test a COC marker segment for one of the components."""
+        arr = smooth_array((64, 64, 3), "u1", 8)
+        src = encode(arr, use_mct=False)
+        cod = get_cod(src)
+        assert cod[5] == 5
+
+        # Ccoc, Scoc, then SPcoc with the number of decompositions changed
+        coc = bytes([1, 0, nr_decompositions]) + cod[6:]
+        coc = b"\xff\x53" + (len(coc) + 2).to_bytes(2, "big") + coc
+        idx = src.index(b"\xff\x52") + 2 + len(cod) + 2
+        src = src[:idx] + coc + src[idx:]
+
+        if nr_decompositions == 5:
+            # The same as the COD so the layout can be kept
+            assert np.array_equal(decode(transcode(src)), arr)
+        else:
+            msg = (
+                "Error transcoding the data: the components use different "
+                "resolutions, code-block or precinct sizes"
+            )
+            with pytest.raises(RuntimeError, match=msg):
+                transcode(src)
+
+    def test_jp2(self):
+        """Test transcoding the JP2 format gives a J2K codestream."""
+        arr = smooth_array((64, 64), "u1", 8)
+        data = transcode(encode(arr, codec_format=2))
+        assert data.startswith(b"\xff\x4f\xff\x51")
+        assert np.array_equal(decode(data), arr)
+
+    def test_file_like(self, tmp_path):
+        """Test transcoding from a path or file-like."""
+        arr = smooth_array((64, 64), "u1", 8)
+        src = encode(arr)
+        path = tmp_path / "test.j2k"
+        path.write_bytes(src)
+        assert transcode(path) == transcode(src)
+        with open(path, "rb") as f:
+            assert transcode(f) == transcode(src)
+
+    def test_truncated_raises(self):
+        """Test transcoding truncated data raises an exception."""
+        src = encode(smooth_array((64, 64), "u1", 8))
+        msg = "Error transcoding the data: failed to decode image"
+        with pytest.raises(RuntimeError, match=msg):
+            transcode(src[:len(src) // 2])
+
+    def test_invalid_type_raises(self):
+        """Test an invalid source raises an exception."""
+        msg = "must either be bytes or have a read"
+        with pytest.raises(TypeError, match=msg):
+            transcode(1234)
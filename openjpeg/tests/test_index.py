@@ -0,0 +1,466 @@
+"""Tests for indexing codestreams and decoding regions."""
+
+from io import BytesIO
+import struct
+
+import numpy as np
+import pytest
+
+from openjpeg.index import (
+    build_index,
+    CodestreamIndex,
+    SparseBuffer,
+    TilePart,
+    _Reader,
+)
+from openjpeg.utils import decode, decode_region, encode
+
+
+def tiled_image(codec_format=0):
+    """Return a (arr, encoded) for an image with 3 x 3 tiles."""
+    rng = np.random.default_rng(0)
+    arr = rng.integers(0, 4095, size=(100, 90), dtype="u2")
+    data = encode(
+        arr, bits_stored=12, tile_size=(40, 32), codec_format=codec_format
+    )
+
+    return arr, data
+
+
+def insert(data, offset, segment):
+    """Return `data` with `segment` inserted at `offset`."""
+    return data[:offset] + segment + data[offset:]
+
+
+class TestBuildIndex(object):
+    """Tests for build_index()."""
+    def setup_method(self):
+        """Setup the tests."""
+        self.arr, self.data = tiled_image()
+
+    def test_j2k(self):
+        """Test indexing a J2K codestream."""
+        index = build_index(self.data)
+        assert 0 == index.offset
+        assert len(self.data) == index.length
+        assert (0, 0, 90, 100) == index.image_area
+        assert (90, 100) == (index.columns, index.rows)
+        assert (32, 40) == index.tile_size
+        assert (0, 0) == index.tile_origin
+        assert (3, 3) == index.tile_grid
+        assert [(12, 0, 1, 1)] == index.components
+        assert 1 == index.nr_layers
+        assert not index.uses_ppm
+
+        assert 9 == len(index.tile_parts)
+        assert list(range(9)) == [tp.tile for tp in index.tile_parts]
+        assert index.main_header_length == index.tile_parts[0].offset
+        for tile_part in index.tile_parts:
+            offset = tile_part.offset
+            assert b"\xff\x90" == self.data[offset:offset + 2]
+            assert tile_part.header_length > 12
+            assert tile_part.packet_lengths is None
+
+        last = index.tile_parts[-1]
+        assert len(self.data) - 2 == last.offset + last.length
+
+    def test_jp2(self):
+        """Test indexing a JP2 file."""
+        _, data = tiled_image(codec_format=2)
+        index = build_index(BytesIO(data))
+        assert index.offset > 0
+        assert b"\xff\x4f" == data[index.offset:index.offset + 2]
+        assert 9 == len(index.tile_parts)
+        j2k = build_index(self.data)
+        assert [tp.offset - index.offset for tp in index.tile_parts] == [
+            tp.offset for tp in j2k.tile_parts
+        ]
+
+    def test_invalid_data_raises(self):
+        """Test indexing data that isn't JPEG 2000 raises."""
+        msg = "No JPEG 2000 codestream found in the data"
+        with pytest.raises(ValueError, match=msg):
+            build_index(b"\x00" * 32)
+
+    def test_tlm(self):
+        """Test the tile-parts are located using TLM marker segments."""
+        index = build_index(self.data)
+        lengths = [tp.length for tp in index.tile_parts]
+        # Ztlm 0, Stlm with no Ttlm and 32-bit Ptlm
+        tlm = struct.pack(f">BB{len(lengths)}I", 0, 0x40, *lengths)
+        segment = struct.pack(">HH", 0xFF55, 2 + len(tlm)) + tlm
+        data = insert(self.data, index.main_header_length, segment)
+
+        reader = _Reader(data)
+        tlm_index = build_index(reader, packets=False)
+        nr_reads = reader.nr_reads
+        assert index.main_header_length + len(segment) == (
+            tlm_index.main_header_length
+        )
+        assert 9 == len(tlm_index.tile_parts)
+        for a, b in zip(index.tile_parts, tlm_index.tile_parts):
+            assert a.tile == b.tile
+            assert a.offset + len(segment) == b.offset
+            assert a.length == b.length
+            assert 0 == b.header_length
+
+        # Without PLM the tile-part headers are read for the packet lengths
+        reader = _Reader(data)
+        build_index(reader)
+        assert reader.nr_reads >= nr_reads + 2 * 9
+
+    def test_plt(self):
+        """Test packet lengths are read from PLT marker segments."""
+        index = build_index(self.data)
+        first = index.tile_parts[0]
+        # Zplt 0, then 3 and 200 as variable length values
+        plt = b"\x00\x03\x81\x48"
+        segment = struct.pack(">HH", 0xFF58, 2 + len(plt)) + plt
+        sod = first.offset + first.header_length - 2
+        data = insert(self.data, sod, segment)
+        # Update Psot
+        data = bytearray(data)
+        struct.pack_into(
+            ">I", data, first.offset + 6, first.length + len(segment)
+        )
+
+        plt_index = build_index(bytes(data))
+        assert [3, 200] == plt_index.tile_parts[0].packet_lengths
+        assert first.header_length + len(segment) == (
+            plt_index.tile_parts[0].header_length
+        )
+        assert plt_index.tile_parts[1].packet_lengths is None
+
+    def test_plm(self):
+        """Test packet lengths are read from PLM marker segments."""
+        index = build_index(self.data)
+        lengths = [tp.length for tp in index.tile_parts]
+        tlm = struct.pack(f">BB{len(lengths)}I", 0, 0x40, *lengths)
+        # Zplm 0, then Nplm and the packet lengths for each tile-part
+        plm = b"\x00" + b"\x02\x81\x48" * 9
+        segments = (
+            struct.pack(">HH", 0xFF55, 2 + len(tlm)) + tlm
+            + struct.pack(">HH", 0xFF57, 2 + len(plm)) + plm
+        )
+        data = insert(self.data, index.main_header_length, segments)
+
+        reader = _Reader(data)
+        plm_index = build_index(reader)
+        # Only the main header is read
+        assert reader.nr_reads < 2 * 9
+        for tile_part in plm_index.tile_parts:
+            assert [200] == tile_part.packet_lengths
+
+
+class TestCodestreamIndex(object):
+    """Tests for CodestreamIndex."""
+    def setup_method(self):
+        """Setup the tests."""
+        self.arr, self.data = tiled_image()
+
+    def test_round_trip(self):
+        """Test serialising and restoring an index."""
+        index = build_index(self.data)
+        index.tile_parts[0] = index.tile_parts[0]._replace(
+            packet_lengths=[3, 200]
+        )
+        data = index.to_bytes()
+        assert isinstance(data, bytes)
+
+        other = CodestreamIndex.from_bytes(data)
+        for attr in (
+            "offset",
+            "length",
+            "main_header_length",
+            "image_area",
+            "tile_size",
+            "tile_origin",
+            "components",
+            "progression_order",
+            "nr_layers",
+            "nr_decompositions",
+            "codeblock_size",
+            "precinct_sizes",
+            "uses_mct",
+            "uses_ppm",
+            "tile_parts",
+        ):
+            assert getattr(index, attr) == getattr(other, attr)
+
+        assert isinstance(other.tile_parts[0], TilePart)
+
+    def test_from_bytes_invalid_raises(self):
+        """Test restoring from invalid data raises."""
+        msg = "The data is not a serialised codestream index"
+        with pytest.raises(ValueError, match=msg):
+            CodestreamIndex.from_bytes(b"\x00" * 128)
+
+    def test_tiles(self):
+        """Test finding the tiles that overlap an area."""
+        index = build_index(self.data)
+        assert list(range(9)) == index.tiles()
+        assert [0] == index.tiles((0, 0, 1, 1))
+        assert [0, 1, 2, 3, 4, 5] == index.tiles((10, 20, 70, 50))
+        assert [0, 1, 3, 4] == index.tiles((10, 20, 60, 50))
+        assert [8] == index.tiles((64, 80, 90, 100))
+        assert [1, 4, 7] == index.tiles((32, 0, 64, 100))
+
+        msg = r"Invalid 'area' value \(0, 0, 91, 10\)"
+        with pytest.raises(ValueError, match=msg):
+            index.tiles((0, 0, 91, 10))
+
+        with pytest.raises(ValueError, match="Invalid 'area' value"):
+            index.tiles((10, 10, 10, 20))
+
+    def test_read_area(self):
+        """Test reading the tiles needed for an area."""
+        index = build_index(self.data)
+        reader = _Reader(self.data)
+        data = index.read_area(reader, (0, 0, 10, 10))
+        assert 2 == reader.nr_reads
+        assert data.startswith(b"\xff\x4f")
+        assert data.endswith(b"\xff\xd9")
+        assert len(data) == (
+            index.main_header_length + index.tile_parts[0].length + 2
+        )
+        arr = decode(data)
+        assert np.array_equal(arr[:40, :32], self.arr[:40, :32])
+
+
+class TestDecodeRegion(object):
+    """Tests for decode(area=...) and decode_region()."""
+    def setup_method(self):
+        """Setup the tests."""
+        self.arr, self.data = tiled_image()
+
+    def test_decode_area(self):
+        """Test decoding an area of the image."""
+        out = decode(self.data, area=(10, 20, 70, 50))
+        assert (30, 60) == out.shape
+        assert np.array_equal(out, self.arr[20:50, 10:70])
+
+        out = decode(self.data, area=(0, 0, 90, 100))
+        assert np.array_equal(out, self.arr)
+
+        out = decode(self.data, area=(5, 6, 7, 8), reshape=False)
+        assert (2 * 2 * 2, ) == out.shape
+
+    def test_decode_invalid_area_raises(self):
+        """Test decoding an invalid area raises."""
+        msg = r"Invalid 'area' value \(0, 0, 90, 101\)"
+        with pytest.raises(ValueError, match=msg):
+            decode(self.data, area=(0, 0, 90, 101))
+
+    def test_decode_region(self):
+        """Test decoding a region, reading only the tiles needed."""
+        index = build_index(self.data)
+        for area in [
+            (10, 20, 70, 50),
+            (0, 0, 1, 1),
+            (64, 80, 90, 100),
+            (0, 0, 90, 100),
+        ]:
+            x0, y0, x1, y1 = area
+            out = decode_region(self.data, area, index)
+            assert np.array_equal(out, self.arr[y0:y1, x0:x1])
+
+        # Without an index
+        out = decode_region(BytesIO(self.data), (31, 39, 33, 41))
+        assert np.array_equal(out, self.arr[39:41, 31:33])
+
+    def test_decode_region_jp2(self):
+        """Test decoding a region of a JP2 file."""
+        _, data = tiled_image(codec_format=2)
+        index = CodestreamIndex.from_bytes(build_index(data).to_bytes())
+        out = decode_region(data, (10, 20, 70, 50), index)
+        assert np.array_equal(out, self.arr[20:50, 10:70])
+
+    def test_decode_region_rgb(self):
+        """Test decoding a region of an RGB image."""
+        rng = np.random.default_rng(1)
+        arr = rng.integers(0, 255, size=(64, 64, 3), dtype="u1")
+        data = encode(arr, tile_size=(32, 32))
+        out = decode_region(data, (16, 16, 48, 40))
+        assert np.array_equal(out, arr[16:40, 16:48])
+
+
+class RangeStore(object):
+    """A stand-in for object storage that serves byte ranges."""
+    def __init__(self, data):
+        self.data = data
+        self.nr_bytes = 0
+        self.nr_requests = 0
+
+    def fetch(self, offset, length):
+        """Return `length` bytes from `offset`."""
+        self.nr_bytes += length
+        self.nr_requests += 1
+        return self.data[offset:offset + length]
+
+
+def layered_image(progression_order="LRCP", **kwargs):
+    """Return a (arr, encoded) for a tiled image with 3 quality layers."""
+    rng = np.random.default_rng(0)
+    arr = rng.integers(0, 4095, size=(300, 260), dtype="u2")
+    data = encode(
+        arr,
+        bits_stored=12,
+        tile_size=(128, 128),
+        compression_ratios=[40, 10, 1],
+        progression_order=progression_order,
+        **kwargs,
+    )
+
+    return arr, data
+
+
+class TestByteRanges(object):
+    """Tests for CodestreamIndex.byte_ranges() and SparseBuffer."""
+    def fetch_and_decode(self, data, index, area, reduce=0, layers=None):
+        """Return the decoded area and the store used to fetch it."""
+        store = RangeStore(data)
+        buffer = SparseBuffer(len(data))
+        for offset, length in index.byte_ranges(area, reduce, layers):
+            buffer.add(offset, store.fetch(offset, length))
+
+        assert store.nr_bytes == buffer.nr_bytes
+        arr = decode_region(buffer, area, index, reduce=reduce, layers=layers)
+
+        return arr, store
+
+    def test_no_packet_lengths(self):
+        """Test whole tile-parts are used without the packet lengths."""
+        _, data = layered_image()
+        index = build_index(data)
+        ranges = index.byte_ranges((0, 0, 100, 100), layers=1)
+        first = index.tile_parts[0]
+        assert [(0, first.offset + first.length)] == ranges
+
+        ranges = index.byte_ranges((130, 0, 250, 100), reduce=1)
+        second = index.tile_parts[1]
+        assert [
+            (0, index.main_header_length), (second.offset, second.length)
+        ] == ranges
+
+    def test_layers(self):
+        """Test only the packets for the decoded layers are fetched."""
+        _, data = layered_image(plt=True)
+        index = build_index(data)
+        area = (10, 20, 200, 250)
+        arr, store = self.fetch_and_decode(data, index, area, layers=1)
+        assert np.array_equal(arr, decode(data, area=area, layers=1))
+        assert (230, 190) == arr.shape
+        assert store.nr_bytes < len(data) // 20
+
+        arr, store = self.fetch_and_decode(data, index, area, layers=2)
+        assert np.array_equal(arr, decode(data, area=area, layers=2))
+
+    def test_reduce(self):
+        """Test only the packets for the decoded resolutions are fetched."""
+        _, data = layered_image("RLCP", plt=True)
+        index = build_index(data)
+        area = (0, 0, 260, 300)
+        arr, store = self.fetch_and_decode(data, index, area, reduce=2)
+        assert np.array_equal(arr, decode(data, reduce=2))
+        assert (75, 65) == arr.shape
+        assert store.nr_bytes < len(data) // 10
+        # The first tile is merged with the main header
+        assert 9 == store.nr_requests
+
+        area = (100, 100, 140, 290)
+        arr, _ = self.fetch_and_decode(data, index, area, reduce=1, layers=2)
+        assert np.array_equal(
+            arr, decode(data, area=area, reduce=1, layers=2)
+        )
+        assert (95, 20) == arr.shape
+
+    def test_progression_orders(self):
+        """Test the byte ranges for each progression order."""
+        area = (100, 100, 140, 290)
+        for order in ["LRCP", "RLCP", "RPCL", "PCRL", "CPRL"]:
+            _, data = layered_image(order, plt=True)
+            index = build_index(data)
+            arr, store = self.fetch_and_decode(
+                data, index, area, reduce=1, layers=2
+            )
+            assert np.array_equal(
+                arr, decode(data, area=area, reduce=1, layers=2)
+            )
+
+    def test_invalid_raises(self):
+        """Test invalid reduce and layers values raise."""
+        _, data = layered_image()
+        index = build_index(data)
+        msg = r"'reduce' must be in the range \(0, 5\)"
+        with pytest.raises(ValueError, match=msg):
+            index.byte_ranges(reduce=6)
+
+        with pytest.raises(ValueError, match="'layers' must be greater"):
+            index.byte_ranges(layers=0)
+
+    def test_sparse_buffer(self):
+        """Test reading from a SparseBuffer."""
+        buffer = SparseBuffer()
+        buffer.add(10, b"\x01\x02\x03")
+        buffer.add(0, b"\x00")
+        assert 4 == buffer.nr_bytes
+        assert 13 == buffer.seek(0, 2)
+        buffer.seek(11)
+        assert b"\x02\x03" == buffer.read(2)
+        assert 13 == buffer.tell()
+        buffer.seek(0)
+        assert b"\x00" == buffer.read(1)
+
+        msg = "The sparse buffer doesn't contain the 2 bytes at offset 1"
+        with pytest.raises(ValueError, match=msg):
+            buffer.read(2)
+
+        # Missing data needed for decoding
+        _, data = layered_image()
+        index = build_index(data)
+        buffer = SparseBuffer(len(data))
+        buffer.add(0, data[:index.main_header_length])
+        with pytest.raises(ValueError, match="doesn't contain"):
+            decode_region(buffer, (0, 0, 10, 10), index)
+
+
+class TestDecodeReduceLayers(object):
+    """Tests for decode() with `reduce` and `layers`."""
+    def test_reduce(self):
+        """Test discarding resolution levels."""
+        arr, data = tiled_image()
+        assert (50, 45) == decode(data, reduce=1).shape
+        assert (25, 23) == decode(data, reduce=2).shape
+        assert (4, 3) == decode(data, reduce=5).shape
+        assert (7, 3) == decode(data, area=(3, 5, 9, 20), reduce=1).shape
+
+        msg = "'reduce' must be greater than or equal to 0"
+        with pytest.raises(ValueError, match=msg):
+            decode(data, reduce=-1)
+
+        with pytest.raises(RuntimeError):
+            decode(data, reduce=6)
+
+    def test_layers(self):
+        """Test decoding fewer quality layers."""
+        arr, data = layered_image()
+        full = decode(data)
+        assert np.array_equal(full, decode(data, layers=3))
+        assert np.array_equal(full, decode(data, layers=10))
+        one = decode(data, layers=1)
+        assert np.abs(one.astype("i4") - arr).mean() > (
+            np.abs(full.astype("i4") - arr).mean()
+        )
+
+        with pytest.raises(ValueError, match="'layers' must be greater"):
+            decode(data, layers=0)
+
+    def test_tlm(self):
+        """Test encoding with TLM marker segments."""
+        _, data = layered_image(tlm=True)
+        reader = _Reader(data)
+        index = build_index(reader, packets=False)
+        assert reader.nr_reads < 2 * 9
+        assert index.tile_parts == [
+            tp._replace(header_length=0) for tp in build_index(data).tile_parts
+        ]
@@ -1,10 +1,24 @@
 
+import asyncio
+from concurrent.futures import ThreadPoolExecutor
 from io import BytesIO
 from math import ceil
+import os
 from pathlib import Path
+import threading
 import warnings
 
+import numpy as np
+
+from openjpeg.index import _Reader, _has_headers, build_index
 import _openjpeg
+from _openjpeg import (
+    CancelToken,
+    DecodeCancelledError,
+    DecodeTimeoutError,
+    MemoryLimitError,
+    PlanePool,
+)
 
 
 def _get_format(stream):
@@ -56,13 +70,484 @@ def _get_format(stream):
     raise ValueError("No matching JPEG 2000 format found")
 
 
+# Map the DICOM (0028,0004) *Photometric Interpretation* to OPJ_COLOR_SPACE
+_COLOURSPACES = {
+    "MONOCHROME1": (1, 2),
+    "MONOCHROME2": (1, 2),
+    "RGB": (3, 1),
+    "YBR_FULL": (3, 3),
+}
+
+# Map the progression order to OPJ_PROG_ORDER
+_PROGRESSION_ORDERS = {"LRCP": 0, "RLCP": 1, "RPCL": 2, "PCRL": 3, "CPRL": 4}
+
+
+def encode(
+    arr,
+    bits_stored=None,
+    photometric_interpretation=None,
+    use_mct=True,
+    compression_ratios=None,
+    signal_noise_ratios=None,
+    nr_resolutions=None,
+    codeblock_size=None,
+    progression_order="LRCP",
+    tile_size=None,
+    nr_threads=1,
+    codec_format=0,
+    tlm=False,
+    plt=False,
+    subsampling=None,
+):
+    """Return the JPEG 2000 compressed `arr` as :class:`bytes`.
+
+    By default encoding is lossless, using the reversible 5/3 wavelet with a
+    single quality layer, which is suitable for use with the *JPEG 2000 Image
+    Compression (Lossless Only)* transfer syntax. If `compression_ratios` or
+    `signal_noise_ratios` are used then encoding is lossy, using the
+    irreversible 9/7 wavelet with one quality layer per target, which is
+    suitable for the *JPEG 2000 Image Compression* transfer syntax.
+
+    .. versionadded:: 1.2
+
+    Parameters
+    ----------
+    arr : numpy.ndarray
+        The image data to be encoded as an ndarray of ``np.uint8``,
+        ``np.int8``, ``np.uint16`` or ``np.int16``, with shape (rows,
+        columns) for single component images or (rows, columns, 3) for
+        three component images.
+    bits_stored : int, optional
+        The number of bits used per sample, in the range (1, 8) for 8-bit
+        arrays and (1, 16) for 16-bit arrays. Default is the number of bits
+        used by the array's dtype.
+    photometric_interpretation : str, optional
+        The DICOM *Photometric Interpretation* of `arr`, one of
+        ``"MONOCHROME1"``, ``"MONOCHROME2"``, ``"RGB"`` or ``"YBR_FULL"``.
+        Default is ``"MONOCHROME2"`` for single component images and
+        ``"RGB"`` otherwise.
+    use_mct : bool, optional
+        If ``True`` (default) then apply the multiple component transform to
+        ``"RGB"`` images, which usually improves the compression. Ignored for
+        other photometric interpretations.
+    compression_ratios : list of float, optional
+        The compression ratio target for each quality layer, in decreasing
+        order, such as ``[80, 20, 5]``. A ratio of ``1`` may be used for the
+        final layer to include all the remaining data. Cannot be used with
+        `signal_noise_ratios`.
+    signal_noise_ratios : list of float, optional
+        The peak signal-to-noise ratio target (in dB) for each quality layer,
+        in increasing order, such as ``[30, 40, 50]``. A value of ``0`` may be
+        used for the final layer to include all the remaining data. Cannot be
+        used with `compression_ratios`.
+    nr_resolutions : int, optional
+        The number of resolutions (the number of wavelet decompositions plus
+        one), in the range (1, 32). Default is 6, or fewer if the image (or
+        tile) is too small.
+    codeblock_size : tuple of int, optional
+        The code-block size as (rows, columns), each a power of 2 in the range
+        (4, 1024) with ``rows * columns <= 4096``, default ``(64, 64)``.
+    progression_order : str, optional
+        The progression order, one of ``"LRCP"`` (default), ``"RLCP"``,
+        ``"RPCL"``, ``"PCRL"`` or ``"CPRL"``.
+    tile_size : tuple of int, optional
+        The tile size as (rows, columns), default is to use a single tile.
+    nr_threads : int, optional
+        The number of threads openjpeg may use for encoding the code-blocks,
+        or ``0`` to use one per CPU, default ``1``. When encoding many
+        frames use :func:`encode_frames` instead.
+    codec_format : int, optional
+        The format of the encoded data, one of:
+
+        * ``0``: JPEG-2000 codestream (such as for DICOM *Pixel Data*)
+        * ``2``: JP2 file format
+    tlm : bool, optional
+        If ``True`` then add TLM marker segments to the main header with the
+        length of every tile-part, so :func:`~openjpeg.index.build_index`
+        can locate the tiles without reading the tile-part headers. Requires
+        openjpeg v2.5 or later. Default ``False``.
+    plt : bool, optional
+        If ``True`` then add PLT marker segments to the tile-part headers
+        with the length of every packet, so
+        :meth:`~openjpeg.index.CodestreamIndex.byte_ranges` can leave out
+        the quality layers and resolutions that aren't needed. Requires
+        openjpeg v2.5 or later. Default ``False``.
+    subsampling : tuple of int, optional
+        The subsampling of the chroma components as (rows, columns), one of
+        ``(1, 1)``, ``(1, 2)`` for 4:2:2 or ``(2, 2)`` for 4:2:0. Only
+        available with a `photometric_interpretation` of ``"YBR_FULL"``,
+        each subsampled value is the top-left sample of its block. 4:4:0
+        (``(2, 1)``) isn't supported as openjpeg's sYCC to RGB conversion
+        can't upsample it when decoding. Default is no subsampling.
+
+    Returns
+    -------
+    bytes
+        The encoded JPEG 2000 data.
+
+    Raises
+    ------
+    ValueError
+        If `arr` or any of the parameters are invalid.
+    RuntimeError
+        If the encoding failed.
+    """
+    if not isinstance(arr, np.ndarray):
+        raise TypeError("'arr' must be a numpy ndarray")
+
+    if arr.dtype.kind not in "ui" or arr.dtype.itemsize not in (1, 2):
+        raise ValueError(
+            f"The ndarray dtype must be uint8, int8, uint16 or int16, not "
+            f"'{arr.dtype}'"
+        )
+
+    if arr.ndim not in (2, 3) or (arr.ndim == 3 and arr.shape[2] != 3):
+        raise ValueError(
+            f"The ndarray must have shape (rows, columns) or (rows, columns, "
+            f"3), not {arr.shape}"
+        )
+
+    if 0 in arr.shape:
+        raise ValueError("The ndarray must not be empty")
+
+    nr_bits = arr.dtype.itemsize * 8
+    if bits_stored is None:
+        bits_stored = nr_bits
+
+    if not 1 <= bits_stored <= nr_bits:
+        raise ValueError(
+            f"'bits_stored' must be in the range (1, {nr_bits}) for a "
+            f"'{arr.dtype}' ndarray, not {bits_stored}"
+        )
+
+    # Make sure the values fit within `bits_stored`
+    if bits_stored < nr_bits:
+        if arr.dtype.kind == "u":
+            minimum, maximum = 0, 2**bits_stored - 1
+        else:
+            minimum, maximum = -2**(bits_stored - 1), 2**(bits_stored - 1) - 1
+
+        if arr.min() < minimum or arr.max() > maximum:
+            raise ValueError(
+                f"The ndarray contains values outside the range ({minimum}, "
+                f"{maximum}) allowed by a 'bits_stored' value of "
+                f"{bits_stored}"
+            )
+
+    nr_components = 3 if arr.ndim == 3 else 1
+    if photometric_interpretation is None:
+        photometric_interpretation = (
+            "RGB" if nr_components == 3 else "MONOCHROME2"
+        )
+
+    try:
+        nr_expected, colourspace = _COLOURSPACES[photometric_interpretation]
+    except KeyError:
+        raise ValueError(
+            f"Unsupported 'photometric_interpretation' value: "
+            f"{photometric_interpretation}"
+        )
+
+    if nr_expected != nr_components:
+        raise ValueError(
+            f"A 'photometric_interpretation' of "
+            f"'{photometric_interpretation}' requires {nr_expected} "
+            f"component(s) but the ndarray has {nr_components}"
+        )
+
+    if codec_format not in (0, 2):
+        raise ValueError(f"Unsupported 'codec_format' value: {codec_format}")
+
+    if subsampling is not None:
+        subsampling = tuple(subsampling)
+        if subsampling not in ((1, 1), (1, 2), (2, 2)):
+            raise ValueError(
+                "'subsampling' must be (1, 1), (1, 2) or (2, 2), not "
+                f"{subsampling}"
+            )
+
+        if photometric_interpretation != "YBR_FULL" and subsampling != (1, 1):
+            raise ValueError(
+                "'subsampling' requires a 'photometric_interpretation' of "
+                "'YBR_FULL'"
+            )
+
+    use_mct = use_mct and photometric_interpretation == "RGB"
+
+    if compression_ratios and signal_noise_ratios:
+        raise ValueError(
+            "Only one of 'compression_ratios' or 'signal_noise_ratios' may "
+            "be used"
+        )
+
+    quality_mode, layers = 0, []
+    if compression_ratios:
+        quality_mode, layers = 1, [float(x) for x in compression_ratios]
+        if (
+            any(x < 1 for x in layers)
+            or any(a <= b for a, b in zip(layers, layers[1:]))
+        ):
+            raise ValueError(
+                "'compression_ratios' must be in decreasing order and greater "
+                "than or equal to 1"
+            )
+    elif signal_noise_ratios:
+        quality_mode, layers = 2, [float(x) for x in signal_noise_ratios]
+        values = layers[:-1] if layers[-1] == 0 else layers
+        if (
+            any(x <= 0 for x in values)
+            or any(a >= b for a, b in zip(values, values[1:]))
+        ):
+            raise ValueError(
+                "'signal_noise_ratios' must be in increasing order and "
+                "greater than 0, except for a final value of 0"
+            )
+
+    if len(layers) > 100:
+        raise ValueError("No more than 100 quality layers may be used")
+
+    rows, columns = arr.shape[:2]
+    if tile_size is not None:
+        if len(tile_size) != 2 or any(x < 1 for x in tile_size):
+            raise ValueError(
+                "'tile_size' must be a (rows, columns) pair of positive "
+                "integers"
+            )
+
+        rows, columns = min(rows, tile_size[0]), min(columns, tile_size[1])
+
+    if nr_resolutions is not None:
+        if not 1 <= nr_resolutions <= 32:
+            raise ValueError("'nr_resolutions' must be in the range (1, 32)")
+
+        if 2**(nr_resolutions - 1) > min(rows, columns):
+            raise ValueError(
+                f"The image (or tile) size ({rows}, {columns}) is too small "
+                f"for {nr_resolutions} resolutions"
+            )
+
+    if codeblock_size is not None:
+        sizes = [2**ii for ii in range(2, 11)]
+        if (
+            len(codeblock_size) != 2
+            or any(x not in sizes for x in codeblock_size)
+            or codeblock_size[0] * codeblock_size[1] > 4096
+        ):
+            raise ValueError(
+                "'codeblock_size' must be a (rows, columns) pair of powers of "
+                "2 in the range (4, 1024), with rows * columns <= 4096"
+            )
+
+    if nr_threads < 0:
+        raise ValueError("'nr_threads' must be greater than or equal to 0")
+
+    try:
+        progression_order = _PROGRESSION_ORDERS[progression_order]
+    except KeyError:
+        raise ValueError(
+            f"Unsupported 'progression_order' value: {progression_order}"
+        )
+
+    # The interface requires C-contiguous, native byte ordered data
+    arr = np.ascontiguousarray(arr, dtype=arr.dtype.newbyteorder("="))
+
+    # The interface uses (width, height) for the sizes
+    return _openjpeg.encode(
+        arr,
+        bits_stored,
+        colourspace,
+        use_mct,
+        codec_format,
+        irreversible=quality_mode != 0,
+        quality_mode=quality_mode,
+        layers=layers,
+        nr_resolutions=nr_resolutions or 0,
+        codeblock_size=codeblock_size[::-1] if codeblock_size else (0, 0),
+        progression_order=progression_order,
+        tile_size=tile_size[::-1] if tile_size else (0, 0),
+        nr_threads=nr_threads or os.cpu_count() or 1,
+        tlm=tlm,
+        plt=plt,
+        subsampling=subsampling[::-1] if subsampling else (1, 1),
+    )
+
+
+def encode_frames(arrays, nr_workers=None, **kwargs):
+    """Return a list of the JPEG 2000 compressed `arrays`.
+
+    The frames are encoded concurrently using a pool of worker threads,
+    which is much more efficient than multi-threaded encoding of each frame
+    when there are many frames to encode.
+
+    .. versionadded:: 1.2
+
+    Parameters
+    ----------
+    arrays : iterable of numpy.ndarray
+        The frames to be encoded, see :func:`encode` for the supported
+        arrays.
+    nr_workers : int, optional
+        The maximum number of frames to encode concurrently, default one per
+        CPU.
+    **kwargs
+        The encoding parameters to use for every frame, see :func:`encode`.
+
+    Returns
+    -------
+    list of bytes
+        The encoded JPEG 2000 data for each frame, in the same order as
+        `arrays`.
+
+    Raises
+    ------
+    ValueError
+        If any of the arrays or parameters are invalid.
+    RuntimeError
+        If the encoding failed.
+    """
+    if nr_workers is not None and nr_workers < 1:
+        raise ValueError("'nr_workers' must be greater than 0")
+
+    arrays = list(arrays)
+    if nr_workers == 1 or len(arrays) < 2:
+        return [encode(arr, **kwargs) for arr in arrays]
+
+    # The GIL is released while encoding so the frames are encoded in
+    #   parallel by the worker threads
+    with ThreadPoolExecutor(max_workers=nr_workers) as executor:
+        return list(executor.map(lambda arr: encode(arr, **kwargs), arrays))
+
+
+def transcode(stream, bypass=True):
+    """Return the losslessly re-encoded JPEG 2000 data in `stream`.
+
+    The JPEG 2000 data is decoded to its integer component planes and then
+    re-encoded using the reversible 5/3 wavelet, keeping the tile layout,
+    number of resolutions, code-block size, precincts and progression order
+    of the original. The component precision, signedness and sampling are
+    also preserved. Both the decoding and encoding are done in memory without
+    holding the GIL.
+
+    By default the code-blocks are encoded using selective arithmetic coding
+    bypass (the lazy mode), which makes the transcoded data noticeably
+    faster to decode at the cost of a slightly larger size.
+
+    .. versionadded:: 1.2
+
+    .. note::
+
+        openjpeg only has a block decoder for High-Throughput JPEG 2000
+        (HTJ2K), so transcoding to HTJ2K isn't possible. Its encoder also
+        uses the same coding parameters for every component, so data where
+        COC marker segments give the components different resolutions,
+        code-block or precinct sizes can't be transcoded.
+
+    Parameters
+    ----------
+    stream : str, pathlib.Path, bytes or file-like
+        The path to the JPEG 2000 file or a Python object containing the
+        encoded JPEG 2000 data. If using a file-like then the object must
+        have a ``read()`` method.
+    bypass : bool, optional
+        If ``True`` (default) then use selective arithmetic coding bypass
+        when encoding.
+
+    Returns
+    -------
+    bytes
+        The transcoded data as a JPEG 2000 codestream. If the original image
+        was lossy then the transcoded data will match the decoded image.
+
+    Raises
+    ------
+    RuntimeError
+        If the transcoding failed or the components use different coding
+        parameters.
+    """
+    if isinstance(stream, (str, Path)):
+        with open(stream, 'rb') as f:
+            stream = f.read()
+
+    if not isinstance(stream, (bytes, bytearray, memoryview)):
+        if not hasattr(stream, "read"):
+            raise TypeError(
+                "The Python object containing the encoded JPEG 2000 data "
+                "must either be bytes or have a read() method."
+            )
+
+        stream = stream.read()
+
+    j2k_format = _get_format(BytesIO(stream))
+
+    return _openjpeg.transcode(stream, j2k_format, 1 if bypass else 0)
+
+
+def _reshape(
+    arr,
+    stream,
+    j2k_format,
+    area=None,
+    reduce=0,
+    planar=False,
+    dtype=None,
+    nr_components=None,
+):
+    """Return the 1D uint8 `arr` reshaped and re-viewed to match the image
+    data, or the decoded `area` of the image with `reduce` resolution levels
+    discarded. If `planar` then the components are the first dimension, and
+    if `dtype` or `nr_components` are used then they replace those of the
+    image.
+    """
+    meta = get_parameters(stream, j2k_format)
+    bpp = ceil(meta["precision"] / 8)
+
+    if dtype is None:
+        dtype = f"uint{8 * bpp}" if not meta["is_signed"] else f"int{8 * bpp}"
+
+    arr = arr.view(dtype)
+
+    x0, y0, x1, y1 = area or (0, 0, meta["columns"], meta["rows"])
+    scale = 2**reduce
+    shape = [
+        ceil(y1 / scale) - ceil(y0 / scale),
+        ceil(x1 / scale) - ceil(x0 / scale),
+    ]
+
+    nr_components = nr_components or meta["nr_components"]
+    if nr_components > 1:
+        if planar:
+            shape.insert(0, nr_components)
+        else:
+            shape.append(nr_components)
+
+    return arr.reshape(*shape)
+
+
 def get_openjpeg_version():
     """Return the openjpeg version as tuple of int."""
     version = _openjpeg.get_version().decode("ascii").split(".")
     return tuple([int(ii) for ii in version])
 
 
-def decode(stream, j2k_format=None, reshape=True):
+def decode(
+    stream,
+    j2k_format=None,
+    reshape=True,
+    pool=None,
+    max_memory=None,
+    stats=False,
+    cancel_token=None,
+    deadline=None,
+    cache=None,
+    area=None,
+    reduce=0,
+    layers=None,
+    planar=False,
+    rescale=None,
+    window=None,
+    voi_function="LINEAR",
+    layout=None,
+):
     """Return the decoded JPEG2000 data from `stream` as a
     :class:`numpy.ndarray`.
 
@@ -85,14 +570,321 @@ def decode(stream, j2k_format=None, reshape=True):
     reshape : bool, optional
         Reshape and re-view the output array so it matches the image data
         (default), otherwise return a 1D array of ``np.uint8``.
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls. Useful
+        when repeatedly decoding images of the same size.
+
+        .. versionadded:: 1.2
+    max_memory : int, optional
+        The maximum memory that may be used when decoding (in bytes). The
+        peak memory needed is estimated from the JPEG 2000 header before
+        anything is decoded, default no limit.
+
+        .. versionadded:: 1.2
+    stats : bool, optional
+        If ``True`` then also return a :class:`dict` containing statistics
+        about the decoding (default ``False``):
+
+        * ``'time'``: a :class:`dict` with the wall time (in seconds) spent
+          in each stage of the decoding, ``'header'`` for reading the main
+          header, ``'decode'`` for tier-2, tier-1 and the inverse DWT,
+          ``'colour'`` for the sYCC to RGB conversion, ``'upsample'`` for
+          upsampling subsampled components, ``'pack'`` for writing the
+          output and ``'total'``. ``'read'`` is the time spent in the stream
+          callbacks, which overlaps the other stages.
+        * ``'bytes_read'``: the number of bytes read from `stream`.
+        * ``'nr_reads'``, ``'nr_skips'`` and ``'nr_seeks'``: the number of
+          calls to the stream callbacks.
+        * ``'peak_memory'``: the peak size of the decoded image planes and
+          the output array (in bytes). Memory used internally by openjpeg
+          for tier-1 decoding isn't included.
+        * ``'messages'``: a :class:`dict` with the ``'error'``, ``'warning'``
+          and ``'info'`` messages from openjpeg as lists of :class:`str`.
+
+        .. versionadded:: 1.2
+    cancel_token : openjpeg.CancelToken, optional
+        A token that can be used to cancel the decoding from another thread.
+        Cancelling is checked whenever more data is read, which for tiled
+        images is between tiles, and between the decoding stages.
+
+        .. versionadded:: 1.2
+    deadline : float, optional
+        The :func:`time.monotonic` time by which decoding must finish,
+        checked in the same places as `cancel_token`. Default no limit.
+
+        .. versionadded:: 1.2
+    cache : openjpeg.FrameCache, optional
+        If used then the decoded image will be looked up in and added to
+        the cache, and will be read-only. Not used if `stats` is ``True``.
+
+        .. versionadded:: 1.2
+    area : tuple of int, optional
+        The (x0, y0, x1, y1) pixel coordinates of the area of the image to
+        decode, relative to the image origin, default the whole image. Only
+        the code-blocks that overlap the area are decoded, but all of the
+        data is still read, use :func:`decode_region` to only read the tiles
+        that are needed.
+
+        .. versionadded:: 1.2
+    reduce : int, optional
+        The number of highest resolution levels to discard, each one halves
+        the width and height of the decoded image (rounding up), default
+        ``0``. Discarded levels aren't decoded.
+
+        .. versionadded:: 1.2
+    layers : int, optional
+        The number of quality layers to decode, default all layers.
+
+        .. versionadded:: 1.2
+    planar : bool, optional
+        If ``True`` then each component of the image is written contiguously
+        and the reshaped array has shape (components, rows, columns), as
+        used by many machine learning frameworks. Otherwise the components
+        of each pixel are interleaved and the array has shape (rows,
+        columns, components) (default). Single component images have shape
+        (rows, columns) either way.
+
+        .. versionadded:: 1.2
+    rescale : tuple of (float, float), optional
+        If used then return a float32 array with the (slope, intercept)
+        applied to each sample as ``value * slope + intercept``, such as the
+        DICOM *Rescale Slope* and *Rescale Intercept* to give Hounsfield
+        units for CT. This is done while writing the decoded data, so no
+        additional conversion of the array is needed.
+
+        .. versionadded:: 1.2
+    window : tuple of (float, float), optional
+        If used then return a uint8 array for display with the (center,
+        width) window applied to each sample after any `rescale`, such as
+        the DICOM *Window Center* and *Window Width*. Combined with `reduce`
+        this gives a display ready thumbnail from a single decode.
+
+        .. versionadded:: 1.2
+    voi_function : str, optional
+        The VOI LUT function used with `window`, one of ``"LINEAR"``
+        (default) or ``"SIGMOID"``, as in the DICOM *VOI LUT Function*.
+
+        .. versionadded:: 1.2
+    layout : str, optional
+        If used then return a uint8 array of shape (rows, columns, 4) with
+        ``"RGBA"`` or ``"BGRA"`` pixels, such as for uploading as a
+        texture. The alpha samples are from the component marked as alpha
+        (such as by a JP2 *Channel Definition* box) scaled to 8-bits,
+        otherwise 255, and a single colour component is replicated to all
+        three colours. Without a `window` signed samples are offset so
+        their minimum is 0. Requires 8-bit samples or `window`, and can't be
+        used with `planar`.
+
+        .. versionadded:: 1.2
+
+    Returns
+    -------
+    numpy.ndarray or tuple of (numpy.ndarray, dict)
+        An array of containing the decoded image data, and if `stats` is
+        ``True``, the decoding statistics.
+
+    Raises
+    ------
+    RuntimeError
+        If the decoding failed.
+    openjpeg.MemoryLimitError
+        If decoding would require more than `max_memory` bytes.
+    openjpeg.DecodeCancelledError
+        If the decoding was cancelled using `cancel_token`.
+    openjpeg.DecodeTimeoutError
+        If the decoding didn't finish before the `deadline`.
+    """
+    if isinstance(stream, (str, Path)):
+        with open(stream, 'rb') as f:
+            stream = f.read()
+
+    if cache is not None and not stats:
+        if not isinstance(stream, (bytes, bytearray)):
+            stream = stream.read()
+
+        options = {"j2k_format": j2k_format, "reshape": reshape}
+        if area is not None:
+            options["area"] = tuple(area)
+
+        if reduce or layers:
+            options.update({"reduce": reduce, "layers": layers})
+
+        if planar:
+            options["planar"] = True
+
+        if rescale is not None:
+            options["rescale"] = tuple(rescale)
+
+        if window is not None:
+            options.update(
+                {"window": tuple(window), "voi_function": voi_function}
+            )
+
+        if layout is not None:
+            options["layout"] = layout
+
+        key = cache.make_key(stream, **options)
+        arr = cache.get(key)
+        if arr is None:
+            arr = decode(
+                stream,
+                j2k_format,
+                reshape,
+                pool,
+                max_memory,
+                cancel_token=cancel_token,
+                deadline=deadline,
+                area=area,
+                reduce=reduce,
+                layers=layers,
+                planar=planar,
+                rescale=rescale,
+                window=window,
+                voi_function=voi_function,
+                layout=layout,
+            )
+            arr = cache.put(key, arr)
+
+        return arr
+
+    # bytes are decoded from memory without holding the GIL, which also
+    #   lets other threads cancel the decoding
+    data = stream if isinstance(stream, bytes) else None
+    if isinstance(stream, (bytes, bytearray)):
+        stream = BytesIO(stream)
+
+    required_methods = ["read", "tell", "seek"]
+    if not all([hasattr(stream, meth) for meth in required_methods]):
+        raise TypeError(
+            "The Python object containing the encoded JPEG 2000 data must "
+            "either be bytes or have read(), tell() and seek() methods."
+        )
+
+    if j2k_format is None:
+        j2k_format = _get_format(stream)
+
+    if j2k_format not in [0, 1, 2]:
+        raise ValueError(f"Unsupported 'j2k_format' value: {j2k_format}")
+
+    result = _openjpeg.decode(
+        stream if data is None else data,
+        j2k_format,
+        pool,
+        max_memory,
+        stats,
+        cancel_token=cancel_token,
+        deadline=deadline,
+        area=area,
+        reduce=reduce,
+        layers=layers,
+        planar=planar,
+        rescale=rescale,
+        window=window,
+        voi_function=voi_function,
+        layout=layout,
+    )
+    arr, info = result if stats else (result, None)
+    if reshape:
+        dtype = "float32" if rescale is not None else None
+        dtype = "uint8" if window is not None or layout else dtype
+        arr = _reshape(
+            arr,
+            stream,
+            j2k_format,
+            area,
+            reduce,
+            planar,
+            dtype,
+            4 if layout else None,
+        )
+
+    return (arr, info) if stats else arr
+
+
+def decode_into(
+    stream,
+    out,
+    j2k_format=None,
+    pool=None,
+    area=None,
+    reduce=0,
+    layers=None,
+    rescale=None,
+    window=None,
+    voi_function="LINEAR",
+    layout=None,
+):
+    """Decode the JPEG 2000 data in `stream` directly into the array `out`.
+
+    `out` may have any strides, so the image can be written straight into a
+    view of a larger array without an intermediate copy, such as a tile
+    position within a mosaic, a frame or channel of a batch, or a Fortran
+    ordered volume.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        import numpy as np
+        from openjpeg import decode_into
+
+        mosaic = np.zeros((1024, 1024), dtype="u2")
+        decode_into(tile, mosaic[512:768, 256:512])
+
+        batch = np.zeros((8, 3, 256, 256), dtype="u1")
+        decode_into(frame, batch[0].transpose(1, 2, 0))
+
+    Parameters
+    ----------
+    stream : str, pathlib.Path, bytes or file-like
+        The path to the JPEG 2000 file or a Python object containing the
+        encoded JPEG 2000 data. If using a file-like then the object must
+        have ``tell()``, ``seek()`` and ``read()`` methods.
+    out : numpy.ndarray
+        The writeable array to decode into, with the same shape and dtype as
+        would be returned by :func:`decode` using the same `area` and
+        `reduce`, or float32 if `rescale` is used, or uint8 if `window` is
+        used. If `layout` is used then the shape is (rows, columns, 4).
+    j2k_format : int, optional
+        The JPEG 2000 format to use for decoding, one of:
+
+        * ``0``: JPEG-2000 codestream (such as from DICOM *Pixel Data*)
+        * ``1``: JPT-stream (JPEG 2000, JPIP)
+        * ``2``: JP2 file format
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls.
+    area : tuple of int, optional
+        The (x0, y0, x1, y1) pixel coordinates of the area of the image to
+        decode, relative to the image origin, default the whole image.
+    reduce : int, optional
+        The number of highest resolution levels to discard, default ``0``.
+    layers : int, optional
+        The number of quality layers to decode, default all layers.
+    rescale : tuple of (float, float), optional
+        The (slope, intercept) to apply to each sample as ``value * slope +
+        intercept``, see :func:`decode`.
+    window : tuple of (float, float), optional
+        The (center, width) window to apply to each sample, see
+        :func:`decode`.
+    voi_function : str, optional
+        The VOI LUT function used with `window`, one of ``"LINEAR"``
+        (default) or ``"SIGMOID"``.
+    layout : str, optional
+        Decode to ``"RGBA"`` or ``"BGRA"`` pixels, see :func:`decode`.
 
     Returns
     -------
     numpy.ndarray
-        An array of containing the decoded image data.
+        `out`, containing the decoded image data.
 
     Raises
     ------
+    ValueError
+        If `out` doesn't have the shape or dtype of the decoded image, or
+        isn't writeable.
     RuntimeError
         If the decoding failed.
     """
@@ -100,6 +892,7 @@ def decode(stream, j2k_format=None, reshape=True):
         with open(stream, 'rb') as f:
             stream = f.read()
 
+    data = stream if isinstance(stream, bytes) else None
     if isinstance(stream, (bytes, bytearray)):
         stream = BytesIO(stream)
 
@@ -116,24 +909,537 @@ def decode(stream, j2k_format=None, reshape=True):
     if j2k_format not in [0, 1, 2]:
         raise ValueError(f"Unsupported 'j2k_format' value: {j2k_format}")
 
-    arr = _openjpeg.decode(stream, j2k_format)
-    if not reshape:
-        return arr
+    return _openjpeg.decode(
+        stream if data is None else data,
+        j2k_format,
+        pool,
+        area=area,
+        reduce=reduce,
+        layers=layers,
+        out=out,
+        rescale=rescale,
+        window=window,
+        voi_function=voi_function,
+        layout=layout,
+    )
+
+
+def decode_partial(stream, j2k_format=None, reshape=True, pool=None):
+    """Return the decoded JPEG 2000 data from a possibly truncated `stream`.
+
+    Decodes as much of the image as the available data allows, such as the
+    layers, resolutions or tiles that have been received so far when the
+    data is still being transferred. Any missing image data is left as
+    zero, so the image will be of lower quality than the complete data.
 
+    .. versionadded:: 1.2
+
+    Parameters
+    ----------
+    stream : str, pathlib.Path, bytes or file-like
+        The path to the JPEG 2000 file or a Python object containing the
+        (possibly truncated) encoded JPEG 2000 data. If using a file-like
+        then the object must have ``tell()``, ``seek()`` and ``read()``
+        methods.
+    j2k_format : int, optional
+        The JPEG 2000 format to use for decoding, one of:
+
+        * ``0``: JPEG-2000 codestream (such as from DICOM *Pixel Data*)
+        * ``2``: JP2 file format
+    reshape : bool, optional
+        Reshape and re-view the output array so it matches the image data
+        (default), otherwise return a 1D array of ``np.uint8``.
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls.
+
+    Returns
+    -------
+    tuple of (numpy.ndarray, bool)
+        An array containing the decoded image data and ``True`` if the data
+        was truncated, ``False`` if it was complete.
+
+    Raises
+    ------
+    RuntimeError
+        If the decoding failed, such as when there's too little data to
+        decode anything because the main header or the first tile-part
+        header is incomplete.
+    """
+    if isinstance(stream, (str, Path)):
+        with open(stream, 'rb') as f:
+            stream = f.read()
+
+    # bytes are decoded from memory without holding the GIL
+    data = stream if isinstance(stream, bytes) else None
+    if isinstance(stream, (bytes, bytearray)):
+        stream = BytesIO(stream)
+
+    required_methods = ["read", "tell", "seek"]
+    if not all([hasattr(stream, meth) for meth in required_methods]):
+        raise TypeError(
+            "The Python object containing the encoded JPEG 2000 data must "
+            "either be bytes or have read(), tell() and seek() methods."
+        )
+
+    if j2k_format is None:
+        j2k_format = _get_format(stream)
+
+    if j2k_format not in [0, 2]:
+        raise ValueError(f"Unsupported 'j2k_format' value: {j2k_format}")
+
+    arr, info = _openjpeg.decode(
+        stream if data is None else data,
+        j2k_format,
+        pool,
+        None,
+        False,
+        allow_partial=True,
+    )
+    if reshape:
+        arr = _reshape(arr, stream, j2k_format)
+
+    return arr, info["is_partial"]
+
+
+def decode_pyramid(
+    stream, levels=4, j2k_format=None, reshape=True, pool=None
+):
+    """Return a list of the JPEG 2000 image in `stream` at `levels`
+    resolutions, from a single decode.
+
+    The first item is the full resolution image and each item after it is
+    half the width and height of the one before (rounding up), such as for
+    the levels of a deep-zoom tile pyramid. The codestream is decoded only
+    once, with each lower resolution image then produced from the one above
+    using the low-pass filter of the reversible 5/3 wavelet transform, one
+    tile at a time.
+
+    For losslessly encoded grayscale images the result is identical to
+    decoding each level with ``decode(stream, reduce=level)``. For lossy
+    images, those using the irreversible 9/7 wavelet or a multiple component
+    transform the lower resolution images may differ slightly from those
+    decoded using `reduce`.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        from openjpeg import decode_pyramid
+
+        full, half, quarter, eighth = decode_pyramid("slide.j2k", levels=4)
+
+    Parameters
+    ----------
+    stream : str, pathlib.Path, bytes or file-like
+        The path to the JPEG 2000 file or a Python object containing the
+        encoded JPEG 2000 data. If using a file-like then the object must
+        have ``tell()``, ``seek()`` and ``read()`` methods.
+    levels : int, optional
+        The number of resolution levels to return, including the full
+        resolution image, default ``4``.
+    j2k_format : int, optional
+        The JPEG 2000 format to use for decoding, one of:
+
+        * ``0``: JPEG-2000 codestream (such as from DICOM *Pixel Data*)
+        * ``2``: JP2 file format
+    reshape : bool, optional
+        Reshape and re-view the output arrays so they match the image data
+        (default), otherwise return 1D arrays of ``np.uint8``.
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls.
+
+    Returns
+    -------
+    list of numpy.ndarray
+        The decoded image at each resolution level, from highest to lowest.
+
+    Raises
+    ------
+    RuntimeError
+        If the decoding failed.
+    """
+    if isinstance(stream, (str, Path)):
+        with open(stream, 'rb') as f:
+            stream = f.read()
+
+    if isinstance(stream, (bytes, bytearray)):
+        stream = BytesIO(stream)
+
+    required_methods = ["read", "tell", "seek"]
+    if not all([hasattr(stream, meth) for meth in required_methods]):
+        raise TypeError(
+            "The Python object containing the encoded JPEG 2000 data must "
+            "either be bytes or have read(), tell() and seek() methods."
+        )
+
+    if j2k_format is None:
+        j2k_format = _get_format(stream)
+
+    if j2k_format not in [0, 2]:
+        raise ValueError(f"Unsupported 'j2k_format' value: {j2k_format}")
+
+    if levels < 1:
+        raise ValueError("'levels' must be greater than 0")
+
+    arr = _openjpeg.decode(stream, j2k_format, pool, levels=levels - 1)
+
+    # Split the output into the arrays for each level
     meta = get_parameters(stream, j2k_format)
     bpp = ceil(meta["precision"] / 8)
+    pyramid = []
+    offset = 0
+    for level in range(levels):
+        scale = 2**level
+        length = (
+            ceil(meta["rows"] / scale) * ceil(meta["columns"] / scale)
+            * meta["nr_components"] * bpp
+        )
+        item = arr[offset:offset + length]
+        if reshape:
+            item = _reshape(item, stream, j2k_format, reduce=level)
 
-    dtype = f"uint{8 * bpp}" if not meta["is_signed"] else f"int{8 * bpp}"
-    arr = arr.view(dtype)
+        pyramid.append(item)
+        offset += length
 
-    shape = [meta["rows"], meta["columns"]]
-    if meta["nr_components"] > 1:
-        shape.append(meta["nr_components"])
+    return pyramid
 
-    return arr.reshape(*shape)
 
+def decode_region(
+    src, area, index=None, reshape=True, pool=None, reduce=0, layers=None
+):
+    """Return the decoded `area` of the JPEG 2000 data in `src`, only
+    reading the parts of `src` that are needed.
+
+    Uses an index of the codestream structure to read just the main header
+    and the tiles that overlap `area`, which are then decoded to give the
+    pixels within `area`. For large tiled images, such as whole slide
+    images, this is much faster than reading and decoding the entire image.
+    If the index has the packet lengths then decoding fewer quality layers or
+    resolution levels may also need less of each tile, see
+    :meth:`CodestreamIndex.byte_ranges`.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        from openjpeg import build_index, decode_region, SparseBuffer
+
+        index = build_index("slide.j2k")
+        arr = decode_region("slide.j2k", (1024, 2048, 1536, 2560), index)
 
-def decode_pixel_data(stream, ds=None):
+        # Or from remote data, fetching only the byte ranges needed
+        area = (1024, 2048, 1536, 2560)
+        buffer = SparseBuffer()
+        for offset, length in index.byte_ranges(area, reduce=1):
+            buffer.add(offset, fetch(offset, length))
+
+        arr = decode_region(buffer, area, index, reduce=1)
+
+    Parameters
+    ----------
+    src : str, pathlib.Path, bytes, file-like or openjpeg.SparseBuffer
+        The J2K codestream or JP2 file, if a file-like then it must have
+        ``seek()``, ``tell()`` and ``read()`` methods. If a
+        :class:`~openjpeg.index.SparseBuffer` then it must contain the byte
+        ranges from :meth:`CodestreamIndex.byte_ranges` and `index` must be
+        used.
+    area : tuple of int
+        The (x0, y0, x1, y1) pixel coordinates of the area to decode,
+        relative to the image origin.
+    index : openjpeg.CodestreamIndex, optional
+        The index for `src`, from :func:`build_index` or
+        :meth:`CodestreamIndex.from_bytes`. If not used then `src` will be
+        indexed first.
+    reshape : bool, optional
+        Reshape and re-view the output array so it matches the image data
+        (default), otherwise return a 1D array of ``np.uint8``.
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls.
+    reduce : int, optional
+        The number of highest resolution levels to discard, each one halves
+        the width and height of the decoded image, default ``0``.
+    layers : int, optional
+        The number of quality layers to decode, default all layers.
+
+    Returns
+    -------
+    numpy.ndarray
+        An array containing the decoded image data within `area`.
+    """
+    reader = _Reader(src)
+    if index is None:
+        index = build_index(reader, packets=reduce > 0 or layers is not None)
+
+    data = index.read_area(reader, area, reduce, layers)
+    arr = _openjpeg.decode(
+        data, 0, pool, area=area, reduce=reduce, layers=layers
+    )
+    if reshape:
+        arr = _reshape(arr, data, 0, area, reduce)
+
+    return arr
+
+
+# The worker threads used by decode_async(), created when first needed
+_ASYNC_EXECUTOR = None
+_ASYNC_LOCK = threading.Lock()
+# Each worker thread keeps its own PlanePool
+_ASYNC_LOCAL = threading.local()
+
+
+def _get_async_executor():
+    """Return the executor used by decode_async()."""
+    global _ASYNC_EXECUTOR
+
+    with _ASYNC_LOCK:
+        if _ASYNC_EXECUTOR is None:
+            _ASYNC_EXECUTOR = ThreadPoolExecutor(
+                max_workers=os.cpu_count() or 1,
+                thread_name_prefix="openjpeg-decode",
+            )
+
+        return _ASYNC_EXECUTOR
+
+
+def _decode_in_worker(
+    data, j2k_format, reshape, max_memory, cancel_token, deadline
+):
+    """Decode `data` in one of the decode_async() worker threads."""
+    pool = getattr(_ASYNC_LOCAL, "pool", None)
+    if pool is None:
+        pool = _ASYNC_LOCAL.pool = PlanePool()
+
+    # The GIL is released while decoding bytes
+    arr = _openjpeg.decode(
+        data,
+        j2k_format,
+        pool,
+        max_memory,
+        cancel_token=cancel_token,
+        deadline=deadline,
+    )
+    if reshape:
+        arr = _reshape(arr, BytesIO(data), j2k_format)
+
+    return arr
+
+
+async def decode_async(
+    stream, j2k_format=None, reshape=True, max_memory=None, deadline=None
+):
+    """Return the decoded JPEG 2000 data from `stream` without blocking the
+    event loop.
+
+    The data is decoded by a pool of worker threads, one per CPU, which don't
+    hold the GIL while decoding. If the awaiting task is cancelled then the
+    decode is aborted the next time the decoder reads more data, which for
+    tiled images is between tiles, or between the decoding stages.
+
+    .. versionadded:: 1.2
+
+    Parameters
+    ----------
+    stream : str, pathlib.Path, bytes-like or file-like
+        The path to the JPEG 2000 file or a Python object containing the
+        encoded JPEG 2000 data. If using a file-like then the object must
+        have a ``read()`` method and the data will be read from the current
+        position.
+    j2k_format : int, optional
+        The JPEG 2000 format to use for decoding, one of:
+
+        * ``0``: JPEG-2000 codestream (such as from DICOM *Pixel Data*)
+        * ``1``: JPT-stream (JPEG 2000, JPIP)
+        * ``2``: JP2 file format
+    reshape : bool, optional
+        Reshape and re-view the output array so it matches the image data
+        (default), otherwise return a 1D array of ``np.uint8``.
+    max_memory : int, optional
+        The maximum memory that may be used when decoding (in bytes), default
+        no limit.
+    deadline : float, optional
+        The :func:`time.monotonic` time by which decoding must finish,
+        default no limit.
+
+    Returns
+    -------
+    numpy.ndarray
+        An array of containing the decoded image data.
+
+    Raises
+    ------
+    RuntimeError
+        If the decoding failed.
+    openjpeg.MemoryLimitError
+        If decoding would require more than `max_memory` bytes.
+    openjpeg.DecodeTimeoutError
+        If the decoding didn't finish before the `deadline`.
+    """
+    loop = asyncio.get_running_loop()
+    executor = _get_async_executor()
+
+    if isinstance(stream, (str, Path)):
+        stream = await loop.run_in_executor(executor, Path(stream).read_bytes)
+    elif hasattr(stream, "read"):
+        stream = stream.read()
+
+    data = bytes(stream)
+    if j2k_format is None:
+        j2k_format = _get_format(BytesIO(data))
+
+    if j2k_format not in [0, 1, 2]:
+        raise ValueError(f"Unsupported 'j2k_format' value: {j2k_format}")
+
+    cancel_token = CancelToken()
+    future = loop.run_in_executor(
+        executor,
+        _decode_in_worker,
+        data,
+        j2k_format,
+        reshape,
+        max_memory,
+        cancel_token,
+        deadline,
+    )
+    try:
+        return await future
+    except asyncio.CancelledError:
+        # Stop the worker as well
+        cancel_token.cancel()
+        raise
+
+
+class ProgressiveDecoder(object):
+    """Decode JPEG 2000 data as it's received, refining the image as more
+    data becomes available.
+
+    openjpeg can't resume decoding part way through a codestream, so each
+    refinement decodes all the data received so far. The received data is
+    copied once per refinement and then decoded from memory without holding
+    the GIL, the decoded image planes are recycled between refinements and
+    nothing is decoded unless more data has been received since the last
+    refinement.
+
+    .. versionadded:: 1.2
+
+    Examples
+    --------
+
+    .. code-block:: python
+
+        decoder = ProgressiveDecoder()
+        for chunk in response.iter_content(65536):
+            decoder.feed(chunk)
+            arr = decoder.decode()
+            if arr is not None:
+                show(arr)
+
+    Parameters
+    ----------
+    j2k_format : int, optional
+        The JPEG 2000 format of the data, one of:
+
+        * ``0``: JPEG-2000 codestream (such as from DICOM *Pixel Data*)
+        * ``2``: JP2 file format
+
+        Default is to detect the format from the data.
+    reshape : bool, optional
+        Reshape and re-view the output array so it matches the image data
+        (default), otherwise return a 1D array of ``np.uint8``.
+    pool : openjpeg.PlanePool, optional
+        The pool used to recycle the decoded image planes between
+        refinements, default is to use a new pool.
+    """
+    def __init__(self, j2k_format=None, reshape=True, pool=None):
+        self._buffer = bytearray()
+        self._format = j2k_format
+        self._reshape = reshape
+        self._pool = pool if pool is not None else PlanePool()
+        self._arr = None
+        self._is_partial = True
+        # The amount of data used by the last refinement
+        self._decoded_length = 0
+
+    def decode(self):
+        """Return the image decoded from all the data received so far.
+
+        Returns
+        -------
+        numpy.ndarray or None
+            The decoded image, or ``None`` if not enough data has been
+            received to decode anything yet. If the data received so far ends
+            part way through a header then the previously decoded image is
+            returned.
+
+        Raises
+        ------
+        RuntimeError
+            If the decoding failed.
+        ValueError
+            If the data isn't JPEG 2000 or the headers are invalid.
+        """
+        if len(self._buffer) == self._decoded_length:
+            return self._arr
+
+        data = bytes(self._buffer)
+        if self._format is None:
+            try:
+                self._format = _get_format(BytesIO(data))
+            except ValueError:
+                # The longest format signature is 12 bytes
+                if len(data) >= 12:
+                    raise
+
+                return None
+
+        # openjpeg fails if the data ends part way through the main header
+        #   or a tile-part header, so wait for the rest of it
+        if not _has_headers(data):
+            return self._arr
+
+        self._arr, self._is_partial = decode_partial(
+            data, self._format, self._reshape, self._pool
+        )
+        self._decoded_length = len(data)
+
+        return self._arr
+
+    def feed(self, data):
+        """Add more of the JPEG 2000 data.
+
+        Parameters
+        ----------
+        data : bytes-like
+            The next chunk of the encoded JPEG 2000 data.
+        """
+        self._buffer.extend(data)
+
+    @property
+    def is_partial(self):
+        """Return ``True`` if the last decoded image used truncated data,
+        ``False`` if the data was complete.
+        """
+        return self._is_partial
+
+    @property
+    def nr_bytes(self):
+        """Return the number of bytes of data received so far."""
+        return len(self._buffer)
+
+    def reset(self):
+        """Discard the received data so the decoder can be reused."""
+        self._buffer = bytearray()
+        self._arr = None
+        self._is_partial = True
+        self._decoded_length = 0
+
+
+def decode_pixel_data(stream, ds=None, pool=None, max_memory=None):
     """Return the decoded JPEG 2000 data as a :class:`numpy.ndarray`.
 
     Intended for use with *pydicom* ``Dataset`` objects.
@@ -150,6 +1456,15 @@ def decode_pixel_data(stream, ds=None):
         *Samples per Pixel*, *Bits Stored* and *Pixel Representation* values
         will be checked against the JPEG 2000 data and warnings issued if
         different.
+    pool : openjpeg.PlanePool, optional
+        A pool used to recycle the decoded image planes between calls.
+
+        .. versionadded:: 1.2
+    max_memory : int, optional
+        The maximum memory that may be used when decoding (in bytes), default
+        no limit.
+
+        .. versionadded:: 1.2
 
     Returns
     -------
@@ -160,6 +1475,8 @@ def decode_pixel_data(stream, ds=None):
     ------
     RuntimeError
         If the decoding failed.
+    openjpeg.MemoryLimitError
+        If decoding would require more than `max_memory` bytes.
     """
     if isinstance(stream, (bytes, bytearray)):
         stream = BytesIO(stream)
@@ -179,7 +1496,7 @@ def decode_pixel_data(stream, ds=None):
             "non-conformant to the DICOM Standard (Part 5, Annex A.4.4)"
         )
 
-    arr = _openjpeg.decode(stream, j2k_format)
+    arr = _openjpeg.decode(stream, j2k_format, pool, max_memory)
 
     if not ds:
         return arr
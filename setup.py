@@ -1,4 +1,5 @@
 
+import filecmp
 import os
 import sys
 from pathlib import Path
@@ -35,6 +36,13 @@ def get_source_files():
     source_files = [
         INTERFACE_SRC / "decode.c",
         INTERFACE_SRC / "color.c",
+        INTERFACE_SRC / "pool.c",
+        INTERFACE_SRC / "messages.c",
+        INTERFACE_SRC / "encode.c",
+        INTERFACE_SRC / "stream.c",
+        INTERFACE_SRC / "transcode.c",
+        INTERFACE_SRC / "atomics.c",
+        INTERFACE_SRC / "pyramid.c",
     ]
     for fname in OPENJPEG_SRC.glob("*"):
         if fname.parts[-1].startswith("test"):
@@ -55,12 +63,18 @@ def get_source_files():
 def setup_oj():
     """Run custom cmake."""
     base_dir = os.path.join("openjpeg", "src", "openjpeg")
+    custom = os.path.join("build_tools", "cmake", "CMakeLists.txt")
+    upstream = os.path.join(base_dir, "CMakeLists.txt")
+
+    # Keep the submodule's own CMakeLists.txt, the custom one takes the
+    #   openjpeg version from it
+    if os.path.exists(upstream) and not filecmp.cmp(upstream, custom, False):
+        shutil.copy(
+            upstream, os.path.join(base_dir, "CMakeLists.upstream.txt")
+        )
 
     # Copy custom CMakeLists.txt file to openjpeg base dir
-    shutil.copy(
-        os.path.join("build_tools", "cmake", "CMakeLists.txt"),
-        base_dir
-    )
+    shutil.copy(custom, base_dir)
     build_dir = os.path.join(base_dir, "build")
     if os.path.exists(build_dir):
         shutil.rmtree(build_dir)
@@ -75,7 +89,7 @@ def setup_oj():
     fpath = os.path.abspath(base_dir)
     cur_dir = os.getcwd()
     os.chdir(build_dir)
-    subprocess.call(['cmake', fpath])
+    subprocess.check_call(['cmake', fpath])
     os.chdir(cur_dir)
 
     # Turn off JPIP
@@ -90,6 +104,15 @@ setup_oj()
 extra_compile_args = []
 extra_link_args = []
 
+# openjpeg's thread pool, used for multi-threaded encoding, is only built
+#   when one of these is defined, otherwise opj_codec_set_threads() fails
+if platform.system() == "Windows":
+    define_macros = [("MUTEX_win32", None)]
+else:
+    define_macros = [("MUTEX_pthread", None)]
+    extra_compile_args.append("-pthread")
+    extra_link_args.append("-pthread")
+
 # Maybe use cythonize instead
 ext = Extension(
     "_openjpeg",
@@ -101,6 +124,7 @@ ext = Extension(
         distutils.sysconfig.get_python_inc(),
         # Numpy includes get added by the `build` subclass
     ],
+    define_macros=define_macros,
     extra_compile_args=extra_compile_args,
     extra_link_args=extra_link_args,
 )
@@ -143,7 +167,6 @@ setup(
         "Intended Audience :: Science/Research",
         "Development Status :: 5 - Production/Stable",
         "Natural Language :: English",
-        "Programming Language :: Python :: 3.6",
         "Programming Language :: Python :: 3.7",
         "Programming Language :: Python :: 3.8",
         "Programming Language :: Python :: 3.9",
@@ -151,7 +174,7 @@ setup(
         "Topic :: Scientific/Engineering :: Medical Science Apps.",
         "Topic :: Software Development :: Libraries",
     ],
-    python_requires = ">=3.6",
+    python_requires = ">=3.7",
     setup_requires = ["setuptools>=18.0", "cython", "numpy"],
     install_requires = ["numpy"],
     cmdclass = {"build": build},
@@ -161,6 +184,9 @@ setup(
         "pylibjpeg.pixel_data_decoders": [
             "1.2.840.10008.1.2.4.90 = openjpeg:decode_pixel_data",
             "1.2.840.10008.1.2.4.91 = openjpeg:decode_pixel_data",
+            "1.2.840.10008.1.2.4.201 = openjpeg:decode_pixel_data",
+            "1.2.840.10008.1.2.4.202 = openjpeg:decode_pixel_data",
+            "1.2.840.10008.1.2.4.203 = openjpeg:decode_pixel_data",
         ],
         "pylibjpeg.jpeg_2000_decoders": "openjpeg = openjpeg:decode",
     }